@@ -0,0 +1,594 @@
+// 包含实现文件，以便直接测量内部转换函数并取得底层 aria2::Session，
+// 使 C API 和 aria2:: C++ API 在同一会话上对比。
+#include "../src/aria2_c_api.cpp"
+
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <sys/resource.h>
+#endif
+
+#if defined(__GLIBC__)
+// 替换 malloc 统计每次操作的分配次数，包括 aria2 内部的分配。
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+static std::atomic<uint64_t> g_allocs{0};
+
+extern "C" void* malloc(size_t size)
+{
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+#  define ARIA2_BENCH_COUNT_ALLOCS 1
+#endif
+
+namespace {
+
+struct bench_options {
+  size_t size = 2000;
+  int64_t min_time_ms = 200;
+  const char* filter = nullptr;
+};
+
+bench_options g_options;
+
+uint64_t alloc_count()
+{
+#if defined(ARIA2_BENCH_COUNT_ALLOCS)
+  return g_allocs.load(std::memory_order_relaxed);
+#else
+  return 0;
+#endif
+}
+
+// 重复执行 fn 至少 min_time_ms 毫秒，teardown 在计时之外执行。
+void bench(const std::string& name,
+           size_t items,
+           const std::function<void()>& fn,
+           const std::function<void()>& teardown = nullptr)
+{
+  if (g_options.filter && name.find(g_options.filter) == std::string::npos) {
+    return;
+  }
+  fn();
+  if (teardown) {
+    teardown();
+  }
+  std::chrono::nanoseconds elapsed{0};
+  uint64_t allocs = 0;
+  uint64_t iterations = 0;
+  while (iterations < 3 ||
+         elapsed < std::chrono::milliseconds(g_options.min_time_ms)) {
+    uint64_t allocs_before = alloc_count();
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    elapsed += std::chrono::steady_clock::now() - start;
+    allocs += alloc_count() - allocs_before;
+    ++iterations;
+    if (teardown) {
+      teardown();
+    }
+  }
+  double ns_per_op = static_cast<double>(elapsed.count()) / iterations;
+  std::printf("%-44s %14.0f %10.1f", name.c_str(), ns_per_op,
+              ns_per_op / std::max<size_t>(items, 1));
+#if defined(ARIA2_BENCH_COUNT_ALLOCS)
+  std::printf(" %12.1f\n", static_cast<double>(allocs) / iterations);
+#else
+  std::printf(" %12s\n", "-");
+#endif
+}
+
+std::string sized(const char* name)
+{
+  return std::string(name) + "/" + std::to_string(g_options.size);
+}
+
+void bench_key_vals()
+{
+  std::vector<std::string> storage;
+  storage.reserve(g_options.size * 2);
+  std::vector<aria2_key_val_t> options(g_options.size);
+  for (size_t i = 0; i < g_options.size; ++i) {
+    storage.push_back("header-" + std::to_string(i));
+    storage.push_back("X-Bench-" + std::to_string(i) + ": value");
+  }
+  for (size_t i = 0; i < g_options.size; ++i) {
+    options[i].key = const_cast<char*>(storage[i * 2].c_str());
+    options[i].value = const_cast<char*>(storage[i * 2 + 1].c_str());
+  }
+  bench(sized("to_key_vals/wrapper"), g_options.size, [&] {
+    aria2::KeyVals result = aria2_to_key_vals(options.data(), options.size());
+    (void)result;
+  });
+  aria2::KeyVals cpp_options = aria2_to_key_vals(options.data(),
+                                                 options.size());
+  bench(sized("to_key_vals/direct_copy"), g_options.size, [&] {
+    aria2::KeyVals result = cpp_options;
+    (void)result;
+  });
+  bench(sized("copy_key_vals/wrapper"), g_options.size, [&] {
+    aria2_key_val_t* out = nullptr;
+    size_t out_count = 0;
+    aria2_copy_key_vals(cpp_options, &out, &out_count);
+    aria2_free_key_vals(out, out_count);
+  });
+}
+
+void bench_global_options(aria2_session_t* session)
+{
+  bench("get_global_options/wrapper", 1, [&] {
+    aria2_key_val_t* options = nullptr;
+    size_t options_count = 0;
+    aria2_get_global_options(session, &options, &options_count);
+    aria2_free_key_vals(options, options_count);
+  });
+  aria2_arena_t* arena = aria2_arena_new(0);
+  bench("get_global_options/wrapper_arena", 1, [&] {
+    aria2_key_val_t* options = nullptr;
+    size_t options_count = 0;
+    aria2_get_global_options_arena(session, arena, &options, &options_count);
+    aria2_arena_reset(arena);
+  });
+  aria2_arena_free(arena);
+  bench("get_global_options/direct", 1, [&] {
+    aria2::KeyVals options = aria2::getGlobalOptions(session->session);
+    (void)options;
+  });
+}
+
+// 写出一个包含 count 个文件的 torrent，用于测量文件列表的转换。
+bool write_torrent(const std::string& path, size_t count)
+{
+  const int64_t file_length = 16 * 1024;
+  const int64_t piece_length = 256 * 1024;
+  int64_t total = file_length * static_cast<int64_t>(count);
+  int64_t pieces = (total + piece_length - 1) / piece_length;
+  std::string files;
+  for (size_t i = 0; i < count; ++i) {
+    std::string name = "file-" + std::to_string(i) + ".bin";
+    files += "d6:lengthi" + std::to_string(file_length) + "e4:pathl" +
+             std::to_string(name.size()) + ":" + name + "ee";
+  }
+  std::string torrent =
+      "d4:infod5:filesl" + files + "e4:name5:bench12:piece lengthi" +
+      std::to_string(piece_length) + "e6:pieces" +
+      std::to_string(pieces * 20) + ":" +
+      std::string(static_cast<size_t>(pieces * 20), '\0') + "ee";
+  std::ofstream out(path, std::ios::binary);
+  out << torrent;
+  return static_cast<bool>(out);
+}
+
+void bench_download_handle(aria2_session_t* session, const std::string& dir)
+{
+  std::string torrent = dir + "/aria2_c_api_bench.torrent";
+  aria2_gid_t gid = 0;
+  aria2_key_val_t options[] = {{const_cast<char*>("pause"),
+                                const_cast<char*>("true")}};
+  if (!write_torrent(torrent, g_options.size) ||
+      aria2_add_torrent_simple(session, &gid, torrent.c_str(), options, 1,
+                               -1) != 0) {
+    std::printf("# cannot add torrent, skipping download handle benchmarks\n");
+    std::remove(torrent.c_str());
+    return;
+  }
+
+  bench("download_handle/wrapper", 1, [&] {
+    aria2_delete_download_handle(aria2_get_download_handle(session, gid));
+  });
+  bench("download_handle/wrapper_cached", 1, [&] {
+    aria2_release_download_handle(aria2_acquire_download_handle(session, gid));
+  });
+  bench("download_handle/direct", 1, [&] {
+    aria2::deleteDownloadHandle(
+        aria2::getDownloadHandle(session->session, gid));
+  });
+
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  bench(sized("get_files/wrapper"), g_options.size, [&] {
+    aria2_file_data_t* files = nullptr;
+    size_t files_count = 0;
+    aria2_download_handle_get_files(dh, &files, &files_count);
+    aria2_free_file_data_array(files, files_count);
+  });
+  aria2_arena_t* arena = aria2_arena_new(0);
+  bench(sized("get_files/wrapper_arena"), g_options.size, [&] {
+    aria2_file_data_t* files = nullptr;
+    size_t files_count = 0;
+    aria2_download_handle_get_files_arena(dh, arena, &files, &files_count);
+    aria2_arena_reset(arena);
+  });
+  aria2_arena_free(arena);
+  std::vector<aria2::FileData> cpp_files = dh->handle->getFiles();
+  bench(sized("copy_file_data_vector/wrapper"), g_options.size, [&] {
+    aria2_file_data_t* files = nullptr;
+    size_t files_count = 0;
+    aria2_copy_file_data_vector(cpp_files, &files, &files_count);
+    aria2_free_file_data_array(files, files_count);
+  });
+  bench(sized("get_files/direct"), g_options.size, [&] {
+    std::vector<aria2::FileData> files = dh->handle->getFiles();
+    (void)files;
+  });
+  aria2_delete_download_handle(dh);
+
+  aria2_remove_download(session, gid, 1);
+  std::remove(torrent.c_str());
+}
+
+void bench_gid_hex()
+{
+  std::vector<aria2_gid_t> gids(g_options.size);
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  for (aria2_gid_t& gid : gids) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    gid = state;
+  }
+  bench(sized("gid_to_hex/wrapper"), gids.size(), [&] {
+    for (aria2_gid_t gid : gids) {
+      aria2_free(aria2_gid_to_hex(gid));
+    }
+  });
+  bench(sized("gid_to_hex/wrapper_buf"), gids.size(), [&] {
+    char buf[17];
+    for (aria2_gid_t gid : gids) {
+      aria2_gid_to_hex_buf(gid, buf);
+    }
+  });
+  std::vector<char> packed(gids.size() * 17);
+  bench(sized("gid_to_hex/wrapper_batch"), gids.size(), [&] {
+    aria2_gids_to_hex_batch(gids.data(), gids.size(), packed.data());
+  });
+  bench(sized("gid_to_hex/direct"), gids.size(), [&] {
+    for (aria2_gid_t gid : gids) {
+      std::string hex = aria2::gidToHex(gid);
+      (void)hex;
+    }
+  });
+
+  std::vector<std::string> hex(gids.size());
+  std::vector<const char*> hex_ptrs(gids.size());
+  for (size_t i = 0; i < gids.size(); ++i) {
+    hex[i] = aria2::gidToHex(gids[i]);
+    hex_ptrs[i] = hex[i].c_str();
+  }
+  std::vector<aria2_gid_t> decoded(gids.size());
+  bench(sized("hex_to_gid/wrapper"), gids.size(), [&] {
+    for (size_t i = 0; i < hex_ptrs.size(); ++i) {
+      decoded[i] = aria2_hex_to_gid(hex_ptrs[i]);
+    }
+  });
+  bench(sized("hex_to_gid/wrapper_batch"), gids.size(), [&] {
+    aria2_hex_to_gids_batch(hex_ptrs.data(), hex_ptrs.size(), decoded.data());
+  });
+  bench(sized("hex_to_gid/direct"), gids.size(), [&] {
+    for (size_t i = 0; i < hex.size(); ++i) {
+      decoded[i] = aria2::hexToGid(hex[i]);
+    }
+  });
+}
+
+void bench_add_uri(aria2_session_t* session)
+{
+  std::vector<std::string> uris(g_options.size);
+  std::vector<const char*> uri_ptrs(g_options.size);
+  for (size_t i = 0; i < uris.size(); ++i) {
+    uris[i] = "http://127.0.0.1:1/bench/" + std::to_string(i);
+    uri_ptrs[i] = uris[i].c_str();
+  }
+  aria2_key_val_t options[] = {
+      {const_cast<char*>("pause"), const_cast<char*>("true")},
+      {const_cast<char*>("split"), const_cast<char*>("4")},
+      {const_cast<char*>("max-connection-per-server"),
+       const_cast<char*>("4")}};
+  std::vector<aria2_gid_t> gids(uris.size());
+  auto remove_all = [&] {
+    for (aria2_gid_t gid : gids) {
+      aria2_remove_download(session, gid, 1);
+    }
+    aria2_run(session, ARIA2_RUN_ONCE);
+  };
+
+  bench(sized("add_uri/wrapper_loop"), uris.size(), [&] {
+    for (size_t i = 0; i < uri_ptrs.size(); ++i) {
+      aria2_add_uri(session, &gids[i], &uri_ptrs[i], 1, options, 3, -1);
+    }
+  }, remove_all);
+
+  aria2_option_set_t* option_set = aria2_option_set_new();
+  for (const aria2_key_val_t& option : options) {
+    aria2_option_set_set(option_set, option.key, option.value);
+  }
+  std::vector<aria2_uri_job_t> jobs(uris.size());
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    jobs[i] = aria2_uri_job_t{&uri_ptrs[i], 1, nullptr, 0, -1, option_set};
+  }
+  std::vector<int> results(uris.size());
+  bench(sized("add_uri/wrapper_batch"), uris.size(), [&] {
+    aria2_add_uri_batch(session, jobs.data(), jobs.size(), gids.data(),
+                        results.data());
+  }, remove_all);
+  aria2_option_set_free(option_set);
+
+  aria2::KeyVals cpp_options = aria2_to_key_vals(options, 3);
+  bench(sized("add_uri/direct"), uris.size(), [&] {
+    for (size_t i = 0; i < uris.size(); ++i) {
+      aria2::A2Gid gid = 0;
+      aria2::addUri(session->session, &gid, {uris[i]}, cpp_options, -1);
+      gids[i] = gid;
+    }
+  }, remove_all);
+}
+
+void bench_bitfield()
+{
+  size_t num_pieces = g_options.size * 512;
+  std::vector<uint8_t> bitfield((num_pieces + 7) / 8);
+  uint64_t state = 0x243f6a8885a308d3ULL;
+  for (uint8_t& byte : bitfield) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    // 大段连续已完成区间中夹杂少量缺失分片。
+    byte = (state & 0xf) ? 0xff : static_cast<uint8_t>(state >> 8);
+  }
+  bench(sized("bitfield_stats/wrapper"), num_pieces, [&] {
+    aria2_bitfield_stats_t stats;
+    aria2_bitfield_stats(bitfield.data(), bitfield.size(), num_pieces, &stats);
+  });
+  bench(sized("bitfield_stats/bit_loop"), num_pieces, [&] {
+    size_t completed = 0;
+    size_t runs = 0;
+    bool previous = false;
+    for (size_t i = 0; i < num_pieces; ++i) {
+      bool bit = (bitfield[i / 8] >> (7 - i % 8)) & 1;
+      completed += bit;
+      runs += bit && !previous;
+      previous = bit;
+    }
+    volatile size_t sink = completed + runs;
+    (void)sink;
+  });
+}
+
+// 每次迭代少量分片完成时，按保存的位图原地比较得出翻转区间，与每次
+// 复制整个位图并重新列出全部已完成区间对比。两者都包含 aria2 的
+// getBitfield 返回副本的开销。
+void bench_bitfield_delta()
+{
+  size_t num_pieces = g_options.size * 512;
+  std::string current((num_pieces + 7) / 8, '\0');
+  uint64_t state = 0x13198a2e03707344ULL;
+  for (char& byte : current) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    // 已完成一部分，完成的分片分散在多个区间中。
+    byte = static_cast<char>((state & 0x3) ? 0 : state >> 8);
+  }
+  size_t next_piece = 0;
+  auto progress = [&] {
+    // 每次迭代完成 4 个分散的分片。
+    for (int i = 0; i < 4; ++i) {
+      size_t piece = (next_piece * 7919) % num_pieces;
+      current[piece / 8] =
+          static_cast<char>(current[piece / 8] | (0x80 >> (piece % 8)));
+      ++next_piece;
+    }
+  };
+  aria2_bitfield_track track;
+  std::string copy = current;
+  aria2_bitfield_track_update(track, copy, num_pieces);
+  bench(sized("bitfield_delta/in_place"), num_pieces, [&] {
+    progress();
+    std::string bits = current;
+    aria2_bitfield_track_update(track, bits, num_pieces);
+  });
+  bench(sized("bitfield_delta/unchanged"), num_pieces, [&] {
+    std::string bits = current;
+    aria2_bitfield_track_update(track, bits, num_pieces);
+  });
+  std::vector<aria2_piece_range_t> ranges;
+  bench(sized("bitfield_delta/full_copy"), num_pieces, [&] {
+    progress();
+    std::string bits = current;
+    ranges.clear();
+    aria2_collect_runs(reinterpret_cast<const uint8_t*>(bits.data()),
+                       bits.size(), num_pieces, &ranges);
+  });
+}
+
+double process_cpu_seconds()
+{
+#if defined(_WIN32)
+  FILETIME creation, exit, kernel, user;
+  GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+  auto seconds = [](const FILETIME& time) {
+    return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) |
+            time.dwLowDateTime) /
+           1e7;
+  };
+  return seconds(kernel) + seconds(user);
+#else
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+// 在只有暂停下载的会话上运行 run 一段时间，输出每秒墙钟时间消耗的
+// CPU 毫秒数和事件循环迭代次数。
+void bench_idle_mode(const std::string& name, const std::function<int()>& run)
+{
+  if (g_options.filter && name.find(g_options.filter) == std::string::npos) {
+    return;
+  }
+  auto duration = std::chrono::milliseconds(
+      std::max<int64_t>(g_options.min_time_ms, 1000));
+  double cpu_before = process_cpu_seconds();
+  auto start = std::chrono::steady_clock::now();
+  uint64_t iterations = 0;
+  while (std::chrono::steady_clock::now() - start < duration) {
+    iterations += run();
+  }
+  double wall = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  double cpu = process_cpu_seconds() - cpu_before;
+  std::printf("%-44s %14.2f %10.1f %12s\n", name.c_str(),
+              cpu * 1000 / wall, iterations / wall, "-");
+}
+
+// 对比旧的 RUN_ONCE 轮询与 aria2_run_for/aria2_run_with_tick 的空闲开销，
+// 并测量另一线程调用 aria2_wakeup 到 aria2_run_for 返回的延迟。
+void bench_idle(aria2_session_t* session)
+{
+  const std::string names[] = {
+      sized("idle/run_once_poll"), sized("idle/run_for_100ms"),
+      sized("idle/run_with_tick_100ms"), "idle/wakeup_latency"};
+  auto selected = [](const std::string& name) {
+    return !g_options.filter || name.find(g_options.filter) != std::string::npos;
+  };
+  if (std::none_of(std::begin(names), std::end(names), selected)) {
+    return;
+  }
+  std::vector<std::string> uris(g_options.size);
+  std::vector<const char*> uri_ptrs(g_options.size);
+  for (size_t i = 0; i < uris.size(); ++i) {
+    uris[i] = "http://127.0.0.1:1/idle/" + std::to_string(i);
+    uri_ptrs[i] = uris[i].c_str();
+  }
+  aria2_key_val_t options[] = {
+      {const_cast<char*>("pause"), const_cast<char*>("true")}};
+  std::vector<aria2_gid_t> gids(uris.size());
+  for (size_t i = 0; i < uri_ptrs.size(); ++i) {
+    aria2_add_uri(session, &gids[i], &uri_ptrs[i], 1, options, 1, -1);
+  }
+
+  std::printf("%-44s %14s %10s %12s\n", "idle benchmark", "cpu ms/s",
+              "iters/s", "");
+  bench_idle_mode(names[0], [&] {
+    // main.cpp 原先的做法：RUN_ONCE 循环中自行检查时钟。
+    aria2_run(session, ARIA2_RUN_ONCE);
+    return 1;
+  });
+  bench_idle_mode(names[1], [&] {
+    aria2_run_for(session, 100);
+    return 1;
+  });
+  bench_idle_mode(names[2], [&] {
+    int ticks = 0;
+    aria2_run_with_tick(session, 100, [](aria2_session_t*, void* user_data) {
+      return ++*static_cast<int*>(user_data) >= 10 ? 1 : 0;
+    }, &ticks);
+    return ticks;
+  });
+
+  const int samples = selected(names[3]) ? 10 : 0;
+  double total_ms = 0;
+  double max_ms = 0;
+  for (int i = 0; i < samples; ++i) {
+    std::chrono::steady_clock::time_point woken;
+    std::thread waker([&] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50 + i * 37));
+      woken = std::chrono::steady_clock::now();
+      aria2_wakeup(session);
+    });
+    aria2_run_for(session, 5000);
+    double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - woken)
+                    .count();
+    waker.join();
+    total_ms += ms;
+    max_ms = std::max(max_ms, ms);
+  }
+  if (samples) {
+    std::printf("%-44s mean=%.1fms max=%.1fms\n", names[3].c_str(),
+                total_ms / samples, max_ms);
+  }
+
+  for (aria2_gid_t gid : gids) {
+    aria2_remove_download(session, gid, 1);
+  }
+  aria2_run(session, ARIA2_RUN_ONCE);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--size" && i + 1 < argc) {
+      g_options.size = std::max<size_t>(std::strtoull(argv[++i], nullptr, 10),
+                                        1);
+    }
+    else if (arg == "--min-time-ms" && i + 1 < argc) {
+      g_options.min_time_ms = std::strtoll(argv[++i], nullptr, 10);
+    }
+    else if (arg == "--help") {
+      std::printf("usage: %s [--size N] [--min-time-ms MS] [FILTER]\n",
+                  argv[0]);
+      return 0;
+    }
+    else {
+      g_options.filter = argv[i];
+    }
+  }
+
+  const char* tmp = std::getenv("TMPDIR");
+  std::string dir = tmp && *tmp ? tmp : "/tmp";
+
+  aria2_library_init();
+  aria2_key_val_t options[] = {
+      {const_cast<char*>("dir"), const_cast<char*>(dir.c_str())},
+      {const_cast<char*>("max-download-result"), const_cast<char*>("0")}};
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  config.keep_running = 1;
+  aria2_session_t* session = aria2_session_new(options, 2, &config);
+  if (!session) {
+    std::fprintf(stderr, "aria2_session_new failed\n");
+    return 1;
+  }
+
+  std::printf("%-44s %14s %10s %12s\n", "benchmark", "ns/op", "ns/item",
+              "allocs/op");
+  bench_key_vals();
+  bench_global_options(session);
+  bench_download_handle(session, dir);
+  bench_gid_hex();
+  bench_add_uri(session);
+  bench_bitfield();
+  bench_bitfield_delta();
+  bench_idle(session);
+
+  aria2_shutdown(session, 1);
+  aria2_session_final(session);
+  aria2_library_deinit();
+  return 0;
+}
@@ -0,0 +1,250 @@
+// 端到端吞吐量基准：进程内启动支持 Range 和 keep-alive 的 HTTP/1.1 服务器，
+// 通过 C API 从回环地址下载，报告吞吐量、每 GB 的 CPU 时间和事件循环迭代耗时。
+#include "aria2_c_api.h"
+#include "loopback_server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+struct bench_options {
+  int64_t file_size = 64 * 1024 * 1024;
+  int files = 4;
+  int split = 4;
+  int max_connection_per_server = 4;
+  int max_concurrent_downloads = 4;
+  std::string dir;
+};
+
+double process_cpu_seconds()
+{
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+struct download_counts {
+  int completed = 0;
+  int errors = 0;
+};
+
+int on_download_event(aria2_session_t* session,
+                      aria2_download_event_t event,
+                      aria2_gid_t gid,
+                      void* user_data)
+{
+  (void)session;
+  (void)gid;
+  auto* counts = static_cast<download_counts*>(user_data);
+  if (event == ARIA2_EVENT_ON_DOWNLOAD_COMPLETE) {
+    ++counts->completed;
+  }
+  else if (event == ARIA2_EVENT_ON_DOWNLOAD_ERROR) {
+    ++counts->errors;
+  }
+  return 0;
+}
+
+int64_t parse_size(const char* text)
+{
+  char* end = nullptr;
+  double value = std::strtod(text, &end);
+  switch (end ? *end : 0) {
+  case 'K':
+  case 'k':
+    value *= 1024;
+    break;
+  case 'M':
+  case 'm':
+    value *= 1024 * 1024;
+    break;
+  case 'G':
+  case 'g':
+    value *= 1024.0 * 1024 * 1024;
+    break;
+  default:
+    break;
+  }
+  return static_cast<int64_t>(value);
+}
+
+double percentile(std::vector<int64_t>& values, double p)
+{
+  if (values.empty()) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(p * (values.size() - 1));
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return static_cast<double>(values[index]);
+}
+
+void usage(const char* argv0)
+{
+  std::printf("usage: %s [--size BYTES[K|M|G]] [--files N] [--split N]\n"
+              "          [--max-connection-per-server N]\n"
+              "          [--max-concurrent-downloads N] [--dir DIR]\n",
+              argv0);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  bench_options options;
+  const char* tmp = std::getenv("TMPDIR");
+  options.dir = std::string(tmp && *tmp ? tmp : "/tmp") +
+                "/aria2_c_api_loopback_bench";
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc || arg == "--help") {
+      usage(argv[0]);
+      return arg == "--help" ? 0 : 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--size") {
+      options.file_size = std::max<int64_t>(parse_size(value), 1);
+    }
+    else if (arg == "--files") {
+      options.files = std::max(std::atoi(value), 1);
+    }
+    else if (arg == "--split") {
+      options.split = std::max(std::atoi(value), 1);
+    }
+    else if (arg == "--max-connection-per-server") {
+      options.max_connection_per_server = std::max(std::atoi(value), 1);
+    }
+    else if (arg == "--max-concurrent-downloads") {
+      options.max_concurrent_downloads = std::max(std::atoi(value), 1);
+    }
+    else if (arg == "--dir") {
+      options.dir = value;
+    }
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::signal(SIGPIPE, SIG_IGN);
+  mkdir(options.dir.c_str(), 0755);
+
+  loopback_server server(options.file_size, options.files);
+  if (!server.start()) {
+    std::fprintf(stderr, "cannot start loopback server: %s\n",
+                 std::strerror(errno));
+    return 1;
+  }
+
+  aria2_library_init();
+  std::string split = std::to_string(options.split);
+  std::string max_connection =
+      std::to_string(options.max_connection_per_server);
+  std::string max_concurrent =
+      std::to_string(options.max_concurrent_downloads);
+  aria2_key_val_t global_options[] = {
+      {const_cast<char*>("dir"), const_cast<char*>(options.dir.c_str())},
+      {const_cast<char*>("max-concurrent-downloads"),
+       const_cast<char*>(max_concurrent.c_str())},
+      {const_cast<char*>("file-allocation"), const_cast<char*>("none")},
+      {const_cast<char*>("allow-overwrite"), const_cast<char*>("true")},
+      {const_cast<char*>("auto-file-renaming"), const_cast<char*>("false")},
+      {const_cast<char*>("min-split-size"), const_cast<char*>("1M")},
+      {const_cast<char*>("max-download-result"), const_cast<char*>("0")}};
+  download_counts counts;
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  config.keep_running = 0;
+  config.download_event_callback = on_download_event;
+  config.user_data = &counts;
+  aria2_session_t* session =
+      aria2_session_new(global_options,
+                        sizeof(global_options) / sizeof(global_options[0]),
+                        &config);
+  if (!session) {
+    std::fprintf(stderr, "aria2_session_new failed\n");
+    return 1;
+  }
+
+  std::vector<std::string> uris(static_cast<size_t>(options.files));
+  std::vector<const char*> uri_ptrs(uris.size());
+  for (size_t i = 0; i < uris.size(); ++i) {
+    uris[i] = "http://127.0.0.1:" + std::to_string(server.port()) +
+              "/bench-" + std::to_string(i) + ".bin";
+    uri_ptrs[i] = uris[i].c_str();
+  }
+  aria2_option_set_t* job_options = aria2_option_set_new();
+  aria2_option_set_set(job_options, "split", split.c_str());
+  aria2_option_set_set(job_options, "max-connection-per-server",
+                       max_connection.c_str());
+  std::vector<aria2_uri_job_t> jobs(uris.size());
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    jobs[i] = aria2_uri_job_t{&uri_ptrs[i], 1, nullptr, 0, -1, job_options};
+  }
+
+  double cpu_before = process_cpu_seconds();
+  auto start = std::chrono::steady_clock::now();
+  aria2_add_uri_batch(session, jobs.data(), jobs.size(), nullptr, nullptr);
+  std::vector<int64_t> iterations_us;
+  for (;;) {
+    auto iteration_start = std::chrono::steady_clock::now();
+    int rv = aria2_run(session, ARIA2_RUN_ONCE);
+    iterations_us.push_back(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - iteration_start)
+            .count());
+    if (rv != 1) {
+      break;
+    }
+  }
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  double cpu_total = process_cpu_seconds() - cpu_before;
+
+  aria2_option_set_free(job_options);
+  aria2_session_final(session);
+  aria2_library_deinit();
+  server.stop();
+
+  for (size_t i = 0; i < uris.size(); ++i) {
+    std::string path = options.dir + "/bench-" + std::to_string(i) + ".bin";
+    std::remove(path.c_str());
+  }
+  rmdir(options.dir.c_str());
+
+  double bytes = static_cast<double>(options.file_size) * counts.completed;
+  double gigabytes = bytes / 1e9;
+  double cpu_server = server.cpu_seconds();
+  double cpu_client = std::max(cpu_total - cpu_server, 0.0);
+  std::printf("files=%d size=%" PRId64 " split=%d "
+              "max-connection-per-server=%d max-concurrent-downloads=%d\n",
+              options.files, options.file_size, options.split,
+              options.max_connection_per_server,
+              options.max_concurrent_downloads);
+  std::printf("completed=%d errors=%d elapsed=%.3fs throughput=%.1f MB/s\n",
+              counts.completed, counts.errors, elapsed,
+              elapsed > 0 ? bytes / 1e6 / elapsed : 0.0);
+  std::printf("cpu total=%.3fs client=%.3fs server=%.3fs "
+              "client/GB=%.3fs\n",
+              cpu_total, cpu_client, cpu_server,
+              gigabytes > 0 ? cpu_client / gigabytes : 0.0);
+  std::printf("loop iterations=%zu p50=%.0fus p99=%.0fus max=%.0fus\n",
+              iterations_us.size(), percentile(iterations_us, 0.50),
+              percentile(iterations_us, 0.99),
+              percentile(iterations_us, 1.0));
+  return counts.errors == 0 && counts.completed == options.files ? 0 : 1;
+}
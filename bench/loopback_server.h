@@ -0,0 +1,290 @@
+// 回环 HTTP/1.1 测试服务器，支持 Range 和 keep-alive，
+// 供回环基准程序和测试共用。
+#ifndef ARIA2_C_API_LOOPBACK_SERVER_H
+#define ARIA2_C_API_LOOPBACK_SERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+inline int64_t thread_cpu_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// 文件内容为固定模式的重复，偏移 o 处的字节为 pattern[o % pattern.size()]。
+class loopback_server {
+public:
+  loopback_server(int64_t file_size, int files)
+      : file_size_(file_size), files_(files), pattern_(64 * 1024)
+  {
+    for (size_t i = 0; i < pattern_.size(); ++i) {
+      pattern_[i] = static_cast<char>((i * 131 + 7) & 0xff);
+    }
+  }
+
+  ~loopback_server() { stop(); }
+
+  bool start()
+  {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ == -1) {
+      return false;
+    }
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+            -1 ||
+        listen(listen_fd_, 128) == -1 ||
+        getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len) ==
+            -1) {
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+    port_ = ntohs(addr.sin_port);
+    acceptor_ = std::thread([this] { accept_loop(); });
+    return true;
+  }
+
+  void stop()
+  {
+    if (listen_fd_ == -1) {
+      return;
+    }
+    stopping_.store(true);
+    shutdown(listen_fd_, SHUT_RDWR);
+    acceptor_.join();
+    close(listen_fd_);
+    listen_fd_ = -1;
+    std::vector<std::thread> workers;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (int fd : connections_) {
+        shutdown(fd, SHUT_RDWR);
+      }
+      workers.swap(workers_);
+    }
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  }
+
+  uint16_t port() const { return port_; }
+  double cpu_seconds() const { return cpu_ns_.load() / 1e9; }
+  char byte_at(int64_t offset) const
+  {
+    return pattern_[static_cast<size_t>(offset) % pattern_.size()];
+  }
+
+private:
+  void accept_loop()
+  {
+    int64_t start = thread_cpu_ns();
+    while (!stopping_.load()) {
+      int fd = accept(listen_fd_, nullptr, nullptr);
+      if (fd == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      std::lock_guard<std::mutex> lock(mutex_);
+      connections_.push_back(fd);
+      workers_.emplace_back([this, fd] { serve(fd); });
+    }
+    cpu_ns_.fetch_add(thread_cpu_ns() - start);
+  }
+
+  bool send_all(int fd, const char* data, size_t length)
+  {
+    while (length) {
+      ssize_t n = send(fd, data, length, 0);
+      if (n <= 0) {
+        if (n == -1 && errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      data += n;
+      length -= static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  bool send_body(int fd, int64_t begin, int64_t end)
+  {
+    while (begin < end) {
+      size_t offset = static_cast<size_t>(begin % pattern_.size());
+      size_t length = std::min(static_cast<int64_t>(pattern_.size() - offset),
+                               end - begin);
+      if (!send_all(fd, pattern_.data() + offset, length)) {
+        return false;
+      }
+      begin += static_cast<int64_t>(length);
+    }
+    return true;
+  }
+
+  static std::string header_value(const std::string& request,
+                                  const char* name)
+  {
+    std::string lower = request;
+    std::transform(lower.begin(), lower.end(), lower.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    std::string key = std::string("\r\n") + name + ":";
+    size_t pos = lower.find(key);
+    if (pos == std::string::npos) {
+      return std::string();
+    }
+    pos += key.size();
+    size_t end = request.find("\r\n", pos);
+    std::string value = request.substr(pos, end - pos);
+    value.erase(0, value.find_first_not_of(" \t"));
+    return value;
+  }
+
+  // 处理一个请求，返回 false 时关闭连接。
+  bool respond(int fd, const std::string& request)
+  {
+    char method[16];
+    char path[256];
+    if (std::sscanf(request.c_str(), "%15s %255s", method, path) != 2) {
+      return false;
+    }
+    bool head = std::strcmp(method, "HEAD") == 0;
+    int index = -1;
+    // /stream-N.bin 与 /bench-N.bin 内容相同，但不提供长度，
+    // 以关闭连接表示结束。
+    if (std::sscanf(path, "/stream-%d.bin", &index) == 1 && index >= 0 &&
+        index < files_ && path == "/stream-" + std::to_string(index) + ".bin") {
+      const char* response = "HTTP/1.1 200 OK\r\n"
+                             "Content-Type: application/octet-stream\r\n"
+                             "Connection: close\r\n\r\n";
+      if (send_all(fd, response, std::strlen(response)) && !head) {
+        send_body(fd, 0, file_size_);
+      }
+      return false;
+    }
+    if (std::sscanf(path, "/bench-%d.bin", &index) != 1 || index < 0 ||
+        index >= files_ ||
+        path != "/bench-" + std::to_string(index) + ".bin") {
+      const char* not_found =
+          "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+      return send_all(fd, not_found, std::strlen(not_found));
+    }
+
+    int64_t begin = 0;
+    int64_t end = file_size_;
+    bool partial = false;
+    std::string range = header_value(request, "range");
+    if (!range.empty()) {
+      long long first = -1;
+      long long last = -1;
+      if (std::sscanf(range.c_str(), "bytes=%lld-%lld", &first, &last) < 1 ||
+          first < 0 || first >= file_size_ || (last != -1 && last < first)) {
+        std::string response =
+            "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" +
+            std::to_string(file_size_) + "\r\nContent-Length: 0\r\n\r\n";
+        return send_all(fd, response.data(), response.size());
+      }
+      begin = first;
+      end = last == -1 ? file_size_ : std::min<int64_t>(last + 1, file_size_);
+      partial = true;
+    }
+
+    std::string response = partial ? "HTTP/1.1 206 Partial Content\r\n"
+                                    : "HTTP/1.1 200 OK\r\n";
+    response += "Accept-Ranges: bytes\r\n"
+                "Content-Type: application/octet-stream\r\n"
+                "Connection: keep-alive\r\n"
+                "Content-Length: " +
+                std::to_string(end - begin) + "\r\n";
+    if (partial) {
+      response += "Content-Range: bytes " + std::to_string(begin) + "-" +
+                  std::to_string(end - 1) + "/" + std::to_string(file_size_) +
+                  "\r\n";
+    }
+    response += "\r\n";
+    if (!send_all(fd, response.data(), response.size())) {
+      return false;
+    }
+    if (!head && !send_body(fd, begin, end)) {
+      return false;
+    }
+    return header_value(request, "connection") != "close";
+  }
+
+  void serve(int fd)
+  {
+    int64_t start = thread_cpu_ns();
+    std::string buffer;
+    char chunk[4096];
+    bool open = true;
+    while (open && !stopping_.load()) {
+      size_t end;
+      while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+          if (n == -1 && errno == EINTR) {
+            continue;
+          }
+          open = false;
+          break;
+        }
+        buffer.append(chunk, static_cast<size_t>(n));
+      }
+      if (!open) {
+        break;
+      }
+      std::string request = buffer.substr(0, end + 2);
+      buffer.erase(0, end + 4);
+      open = respond(fd, request);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      connections_.erase(
+          std::find(connections_.begin(), connections_.end(), fd));
+      close(fd);
+    }
+    cpu_ns_.fetch_add(thread_cpu_ns() - start);
+  }
+
+  int64_t file_size_;
+  int files_;
+  std::vector<char> pattern_;
+  int listen_fd_ = -1;
+  uint16_t port_ = 0;
+  std::atomic<bool> stopping_{false};
+  std::atomic<int64_t> cpu_ns_{0};
+  std::thread acceptor_;
+  std::mutex mutex_;
+  std::vector<int> connections_;
+  std::vector<std::thread> workers_;
+};
+
+#endif // ARIA2_C_API_LOOPBACK_SERVER_H
@@ -23,6 +23,17 @@ case "$(uname -s)" in
   *)      NPROC=$(nproc 2>/dev/null || echo 2) ;;
 esac
 
+# Add the libaria2 extensions used by aria2_c_api (download data writers and the loop hook).
+# Runs in the aria2 source directory before autoreconf.
+apply_aria2_api_ext() {
+  if [[ ! -f src/aria2api_ext.cc ]]; then
+    patch -p1 < "$ROOT_DIR/aria2_api_ext.diff"
+  fi
+  if ! grep -q aria2api_ext.cc src/Makefile.am; then
+    printf '\nif ENABLE_LIBARIA2\nSRCS += aria2api_ext.cc\nendif # ENABLE_LIBARIA2\n' >> src/Makefile.am
+  fi
+}
+
 build_windows_mingw() {
   local host="$1"
   local suffix="$2"
@@ -111,6 +122,7 @@ build_windows_mingw() {
   if [[ -n "$apply_patch" ]]; then
     patch -p1 < "$ROOT_DIR/fix_mingw32_size_max.diff"
   fi
+  apply_aria2_api_ext
   autoreconf -i
   ./configure \
     --prefix=$OUT_DIR/aria2 \
@@ -160,6 +172,7 @@ build_linux_x64() {
   export CC=gcc-12
   export CXX=g++-12
   pushd aria2
+  apply_aria2_api_ext
   autoreconf -i
   ./configure --prefix="$OUT_DIR/aria2" --without-gnutls --with-openssl --without-libxml2 --with-libexpat --enable-libaria2 ARIA2_STATIC=yes
   make -j$NPROC
@@ -185,6 +198,7 @@ build_linux_arm64() {
   export CC=gcc-12
   export CXX=g++-12
   pushd aria2
+  apply_aria2_api_ext
   autoreconf -i
   ./configure --prefix="$OUT_DIR/aria2" --without-gnutls --with-openssl --without-libxml2 --with-libexpat --enable-libaria2 ARIA2_STATIC=yes
   make -j$NPROC
@@ -210,6 +224,7 @@ build_macos_arm64() {
   export CC=clang
   export CXX=clang++
   pushd aria2
+  apply_aria2_api_ext
   autoreconf -i
   ./configure --prefix="$OUT_DIR/aria2" --without-openssl --without-gnutls --with-appletls --disable-nls --enable-libaria2 --enable-static --disable-shared ARIA2_STATIC=yes
   make -j$NPROC
@@ -301,6 +316,7 @@ build_android_arm64() {
 
   echo "-----build aria2-----"
   cd "$ROOT_DIR/aria2"
+  apply_aria2_api_ext
   autoreconf -i
   ./configure \
     --prefix=$OUT_DIR/aria2 \
@@ -415,6 +431,7 @@ build_android_x64() {
 
   echo "-----build aria2-----"
   cd "$ROOT_DIR/aria2"
+  apply_aria2_api_ext
   autoreconf -i
   ./configure \
     --prefix=$OUT_DIR/aria2 \
@@ -527,6 +544,7 @@ build_ios_arm64() {
 
   echo "-----build aria2-----"
   cd "$ROOT_DIR/aria2"
+  apply_aria2_api_ext
   autoreconf -i
   ./configure \
     --prefix=${OUT_DIR}/aria2 \
@@ -635,6 +653,7 @@ build_macos_x64() {
 
   echo "-----build aria2-----"
   cd "$ROOT_DIR/aria2"
+  apply_aria2_api_ext
   autoreconf -i
   ./configure \
     --prefix=${OUT_DIR}/aria2 \
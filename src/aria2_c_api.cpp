@@ -1,852 +1,6329 @@
 #include "aria2_c_api.h"
 
 #include "../aria2/src/includes/aria2/aria2.h"
+#include "../aria2/src/includes/aria2/aria2_ext.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <new>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#  include <immintrin.h>
+#  define ARIA2_C_API_X86_64 1
+#elif defined(__aarch64__)
+#  include <arm_neon.h>
+#  define ARIA2_C_API_NEON 1
+#endif
+
+// SHA-1 与 SHA-256 优先使用平台加密库，都没有时使用内置实现。
+#if defined(ARIA2_C_API_HAVE_OPENSSL) && __has_include(<openssl/evp.h>)
+#  include <openssl/evp.h>
+#  define ARIA2_C_API_OPENSSL 1
+#elif defined(__APPLE__)
+#  include <CommonCrypto/CommonDigest.h>
+#  define ARIA2_C_API_COMMON_CRYPTO 1
+#elif defined(_WIN32)
+#  ifndef WIN32_LEAN_AND_MEAN
+#    define WIN32_LEAN_AND_MEAN
+#  endif
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#  include <bcrypt.h>
+#  define ARIA2_C_API_BCRYPT 1
+#else
+#  define ARIA2_C_API_BUNDLED_SHA 1
+#endif
+
+#if defined(__linux__)
+#  include <pthread.h>
+#  include <sched.h>
+#  include <sys/eventfd.h>
+#  include <unistd.h>
+#elif !defined(_WIN32)
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+#define ARIA2_API_TABLE(X)                        \
+  X(aria2_library_init)                           \
+  X(aria2_library_deinit)                         \
+  X(aria2_set_api_metrics_enabled)                \
+  X(aria2_get_api_metrics)                        \
+  X(aria2_reset_api_metrics)                      \
+  X(aria2_session_config_init)                    \
+  X(aria2_session_new)                            \
+  X(aria2_session_final)                          \
+  X(aria2_run)                                    \
+  X(aria2_run_for)                                \
+  X(aria2_run_with_tick)                          \
+  X(aria2_wakeup)                                 \
+  X(aria2_session_post)                           \
+  X(aria2_gid_to_hex)                             \
+  X(aria2_hex_to_gid)                             \
+  X(aria2_is_null)                                \
+  X(aria2_gid_to_hex_buf)                         \
+  X(aria2_gids_to_hex_batch)                      \
+  X(aria2_hex_to_gids_batch)                      \
+  X(aria2_add_uri)                                \
+  X(aria2_option_set_new)                         \
+  X(aria2_option_set_set)                         \
+  X(aria2_option_set_free)                        \
+  X(aria2_option_set_prefix_first)                \
+  X(aria2_option_set_set_sink)                    \
+  X(aria2_option_set_set_memory_target)           \
+  X(aria2_option_set_set_digests)                 \
+  X(aria2_add_uri_with_option_set)                \
+  X(aria2_add_torrent_with_option_set)            \
+  X(aria2_change_option_with_option_set)          \
+  X(aria2_change_global_option_with_option_set)   \
+  X(aria2_add_uri_batch)                          \
+  X(aria2_add_metalink)                           \
+  X(aria2_add_torrent)                            \
+  X(aria2_add_torrent_simple)                     \
+  X(aria2_get_active_download)                    \
+  X(aria2_get_status_snapshot)                    \
+  X(aria2_session_get_event_fd)                   \
+  X(aria2_drain_events)                           \
+  X(aria2_get_dropped_event_count)                \
+  X(aria2_register_change_poller)                 \
+  X(aria2_unregister_change_poller)               \
+  X(aria2_poll_changes)                           \
+  X(aria2_remove_download)                        \
+  X(aria2_pause_download)                         \
+  X(aria2_unpause_download)                       \
+  X(aria2_change_option)                          \
+  X(aria2_get_global_option)                      \
+  X(aria2_get_global_options)                     \
+  X(aria2_change_global_option)                   \
+  X(aria2_option_name)                            \
+  X(aria2_get_option_int64)                       \
+  X(aria2_get_option_bool)                        \
+  X(aria2_set_option_int64)                       \
+  X(aria2_set_option_bool)                        \
+  X(aria2_get_global_stat)                        \
+  X(aria2_get_global_stat_series)                 \
+  X(aria2_get_global_stat_summary)                \
+  X(aria2_change_position)                        \
+  X(aria2_shutdown)                               \
+  X(aria2_get_download_handle)                    \
+  X(aria2_delete_download_handle)                 \
+  X(aria2_acquire_download_handle)                \
+  X(aria2_release_download_handle)                \
+  X(aria2_download_handle_get_status)             \
+  X(aria2_download_handle_get_total_length)       \
+  X(aria2_download_handle_get_completed_length)   \
+  X(aria2_download_handle_get_upload_length)      \
+  X(aria2_download_handle_get_bitfield)           \
+  X(aria2_download_handle_get_download_speed)     \
+  X(aria2_download_handle_get_upload_speed)       \
+  X(aria2_download_handle_get_info_hash)          \
+  X(aria2_download_handle_get_piece_length)       \
+  X(aria2_download_handle_get_num_pieces)         \
+  X(aria2_download_handle_get_connections)        \
+  X(aria2_download_handle_get_timings)            \
+  X(aria2_download_handle_get_available_ranges)   \
+  X(aria2_download_handle_get_error_code)         \
+  X(aria2_download_handle_get_followed_by)        \
+  X(aria2_download_handle_get_following)          \
+  X(aria2_download_handle_get_belongs_to)         \
+  X(aria2_download_handle_get_dir)                \
+  X(aria2_download_handle_get_files)              \
+  X(aria2_download_handle_get_num_files)          \
+  X(aria2_download_handle_get_file)               \
+  X(aria2_download_handle_get_bt_meta_info)       \
+  X(aria2_download_handle_get_option)             \
+  X(aria2_download_handle_get_options)            \
+  X(aria2_download_handle_get_option_int64)       \
+  X(aria2_download_handle_get_option_bool)        \
+  X(aria2_download_handle_view_dir)               \
+  X(aria2_download_handle_view_option)            \
+  X(aria2_download_handle_view_bitfield)          \
+  X(aria2_download_handle_view_info_hash)         \
+  X(aria2_download_handle_view_bt_meta_info)      \
+  X(aria2_download_handle_view_announce_tier)     \
+  X(aria2_arena_new)                              \
+  X(aria2_arena_reset)                            \
+  X(aria2_arena_free)                             \
+  X(aria2_get_global_option_arena)                \
+  X(aria2_get_global_options_arena)               \
+  X(aria2_download_handle_get_dir_arena)          \
+  X(aria2_download_handle_get_files_arena)        \
+  X(aria2_download_handle_get_file_arena)         \
+  X(aria2_download_handle_get_bt_meta_info_arena) \
+  X(aria2_download_handle_get_option_arena)       \
+  X(aria2_download_handle_get_options_arena)      \
+  X(aria2_bitfield_stats)                         \
+  X(aria2_bitfield_runs)                          \
+  X(aria2_get_bitfield_delta)                     \
+  X(aria2_set_download_memory_target)             \
+  X(aria2_watch_range)                            \
+  X(aria2_set_download_digests)                   \
+  X(aria2_download_handle_get_digests)            \
+  X(aria2_download_handle_take_buffer)            \
+  X(aria2_free)                                   \
+  X(aria2_free_key_vals)                          \
+  X(aria2_free_uri_data_array)                    \
+  X(aria2_free_file_data)                         \
+  X(aria2_free_file_data_array)                   \
+  X(aria2_free_string_list)                       \
+  X(aria2_free_string_list_array)                 \
+  X(aria2_free_bt_meta_info_data)                 \
+  X(aria2_free_binary)                            \
+  X(aria2_free_status_snapshot)
+
+enum aria2_api_id {
+#define ARIA2_API_ID(name) ARIA2_API_##name,
+  ARIA2_API_TABLE(ARIA2_API_ID)
+#undef ARIA2_API_ID
+  ARIA2_API_COUNT
+};
+
+#if !defined(ARIA2_C_API_NO_METRICS)
+// 每个线程固定写入一个分片，分片内使用 relaxed 原子操作累加。
+struct aria2_api_counter {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> total_ns{0};
+  std::atomic<uint64_t> max_ns{0};
+  std::atomic<uint64_t> buckets[ARIA2_API_LATENCY_BUCKETS] = {};
+};
+
+struct alignas(64) aria2_api_shard {
+  aria2_api_counter counters[ARIA2_API_COUNT];
+};
+
+static const size_t ARIA2_API_SHARDS = 16;
+static aria2_api_shard g_api_shards[ARIA2_API_SHARDS];
+static std::atomic<bool> g_api_metrics_enabled{false};
+static std::atomic<size_t> g_api_next_shard{0};
+
+static uint64_t aria2_api_now_ns()
+{
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+static void aria2_api_record(aria2_api_id id, uint64_t ns)
+{
+  static thread_local size_t shard =
+      g_api_next_shard.fetch_add(1, std::memory_order_relaxed) %
+      ARIA2_API_SHARDS;
+  aria2_api_counter& counter = g_api_shards[shard].counters[id];
+  size_t bucket =
+      ns ? static_cast<size_t>(63 - __builtin_clzll(ns)) : 0;
+  bucket = std::min(bucket, static_cast<size_t>(ARIA2_API_LATENCY_BUCKETS - 1));
+  counter.calls.fetch_add(1, std::memory_order_relaxed);
+  counter.total_ns.fetch_add(ns, std::memory_order_relaxed);
+  counter.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  uint64_t max = counter.max_ns.load(std::memory_order_relaxed);
+  while (ns > max && !counter.max_ns.compare_exchange_weak(
+                         max, ns, std::memory_order_relaxed)) {
+  }
+}
+
+class aria2_api_scope {
+public:
+  explicit aria2_api_scope(aria2_api_id id)
+      : id_(id),
+        enabled_(g_api_metrics_enabled.load(std::memory_order_relaxed)),
+        start_(enabled_ ? aria2_api_now_ns() : 0)
+  {
+  }
+
+  ~aria2_api_scope()
+  {
+    if (enabled_) {
+      aria2_api_record(id_, aria2_api_now_ns() - start_);
+    }
+  }
+
+  aria2_api_scope(const aria2_api_scope&) = delete;
+  aria2_api_scope& operator=(const aria2_api_scope&) = delete;
+
+private:
+  aria2_api_id id_;
+  bool enabled_;
+  uint64_t start_;
+};
+
+#  define ARIA2_API_SCOPE(name) aria2_api_scope aria2_api_scope_(ARIA2_API_##name)
+#else
+#  define ARIA2_API_SCOPE(name) ((void)0)
+#endif
+
 struct aria2_callback_ctx {
   aria2_download_event_callback callback;
   void* user_data;
   aria2_session_t* c_session;
 };
 
+struct aria2_arena_block {
+  uint8_t* data;
+  size_t size;
+};
+
+struct aria2_arena_t {
+  size_t block_size;
+  std::vector<aria2_arena_block> blocks;
+  size_t current;
+  size_t offset;
+};
+
+struct aria2_option_set_t {
+  aria2::KeyVals options;
+  // 添加下载时安装的接收回调，callback 为 NULL 表示未设置。
+  aria2_sink_t sink{};
+  // 添加下载时设置的内存目标上限，0 表示未设置。
+  int64_t memory_target = 0;
+  // 添加下载时设置的摘要类型，0 表示未设置。
+  int digests = 0;
+};
+
+struct aria2_change_record {
+  uint64_t version;
+  aria2_download_status_t status;
+  int64_t completed_length;
+  int download_speed;
+};
+
+// 已注册的轮询者，cursor 为其已读到的版本。
+struct aria2_change_poller {
+  uint64_t cursor;
+  std::chrono::steady_clock::time_point last_poll;
+};
+
+// 每个 gid 只保留最新记录；log 按版本递增，被覆盖的旧条目在
+// 轮询时跳过，并在其数量过多时压缩。
+struct aria2_change_feed {
+  uint64_t version = 0;
+  std::unordered_map<aria2::A2Gid, aria2_change_record> records;
+  std::vector<std::pair<uint64_t, aria2::A2Gid>> log;
+  // 按停止顺序排列的已停止下载，aria2 也按此顺序清除下载结果。
+  std::deque<aria2::A2Gid> stopped;
+  // aria2 已不再保留、等待所有轮询者读过后删除的记录。
+  std::vector<aria2::A2Gid> gone;
+  // 按编号区分的已注册轮询者。
+  std::unordered_map<uint64_t, aria2_change_poller> pollers;
+  uint64_t next_poller = 0;
+  // 活动下载的进度，每次轮询时复用。
+  std::vector<aria2::DownloadProgress> progress;
+  // 已删除记录的最大版本。
+  uint64_t floor = 0;
+};
+
+// 可以用 poll 等待的通知描述符：Linux 上为 eventfd，其他 POSIX 系统上为
+// 非阻塞管道，Windows 上不可用，两端均为 -1。
+struct aria2_notifier {
+  std::atomic<bool> signaled{false};
+  int read_fd = -1;
+  int write_fd = -1;
+};
+
+// 单生产者（驱动下载的线程）单消费者的有界环形缓冲区。
+struct aria2_event_queue {
+  std::vector<aria2_event_t> ring;
+  size_t mask = 0;
+  std::atomic<size_t> head{0};
+  std::atomic<size_t> tail{0};
+  std::atomic<uint64_t> dropped{0};
+  aria2_notifier notifier;
+};
+
+// 每个下载保存的位图和最近若干个版本的翻转区间，每次迭代最多从
+// aria2 刷新一次。
+struct aria2_bitfield_track {
+  std::string bits;
+  size_t num_pieces = 0;
+  int64_t piece_length = 0;
+  int64_t total = 0;
+  // 已完成长度不变时不重新取得位图。
+  int64_t completed = -1;
+  aria2::DownloadStatus status = aria2::DOWNLOAD_WAITING;
+  // 最近一次刷新时的 aria2_session_t::iteration。
+  uint64_t refreshed = 0;
+  // aria2_get_bitfield_delta 使用此记录，区间等待结束后仍保留。
+  bool delta = false;
+  uint64_t version = 0;
+  std::deque<std::pair<uint64_t, std::vector<aria2_piece_range_t>>> history;
+};
+
+// 接收回调的暂存数据和限速状态，只在事件循环线程上访问。
+struct aria2_sink_state {
+  aria2_sink_t config;
+  std::deque<std::pair<int64_t, std::vector<uint8_t>>> backlog;
+  int64_t backlog_bytes = 0;
+  // 已写入的最大偏移。
+  int64_t end = 0;
+  // 限速前的 max-download-limit。
+  std::string saved_limit;
+  bool throttled = false;
+  // 下载已完成，暂存的数据交付后发送结束调用。
+  bool ended = false;
+};
+
+#if defined(ARIA2_C_API_BUNDLED_SHA)
+// SHA-1 与 SHA-256 共用的 64 字节分组状态。
+struct aria2_md_state {
+  uint32_t h[8];
+  uint8_t block[64];
+  size_t used;
+  uint64_t length;
+};
+#endif
+
+// SHA-1 或 SHA-256 的增量计算状态，type 为 0 表示未使用。
+struct aria2_hash {
+  int type = 0;
+#if defined(ARIA2_C_API_OPENSSL)
+  EVP_MD_CTX* ctx = nullptr;
+#elif defined(ARIA2_C_API_COMMON_CRYPTO)
+  CC_SHA1_CTX sha1;
+  CC_SHA256_CTX sha256;
+#elif defined(ARIA2_C_API_BCRYPT)
+  BCRYPT_ALG_HANDLE algorithm = nullptr;
+  BCRYPT_HASH_HANDLE handle = nullptr;
+#else
+  aria2_md_state md;
+#endif
+
+  aria2_hash() = default;
+  ~aria2_hash();
+  aria2_hash(const aria2_hash&) = delete;
+  aria2_hash& operator=(const aria2_hash&) = delete;
+};
+
+struct aria2_xxh64_state {
+  uint64_t v[4];
+  uint8_t block[32];
+  size_t used;
+  uint64_t length;
+};
+
+// 下载内容摘要的增量计算状态，只在事件循环线程上访问。length 为已计入
+// 摘要的连续前缀。
+struct aria2_digest_state {
+  int types = 0;
+  int64_t length = 0;
+  bool finished = false;
+  // 下载已完成，等待补算乱序写入的区间。
+  bool ended = false;
+  // 只交给接收回调的下载没有可读回的副本，乱序写入的数据按偏移保留。
+  bool hold = false;
+  std::map<int64_t, std::vector<uint8_t>> held;
+  // 已写入文件或内存目标但尚未计入摘要的区间，起点到终点。
+  std::map<int64_t, int64_t> pending;
+  // aria2 写入的文件，补算时从这里读取。
+  std::string path;
+  aria2_hash sha1;
+  aria2_hash sha256;
+  aria2_xxh64_state xxh64;
+  aria2_download_digests_t result{};
+};
+
+// 等待中的字节区间，只在事件循环线程上访问。
+struct aria2_range_watch {
+  int64_t begin;
+  int64_t end;
+  aria2_range_callback callback;
+  void* user_data;
+  // 已按当前位图检查过，位图和状态不变时不再检查。
+  bool checked;
+};
+
+// 内存目标下载，只在事件循环线程上访问。buffer.data 由 malloc 分配，
+// buffer.length 为已写入的最大偏移。
+struct aria2_memory_target {
+  int64_t max_bytes = 0;
+  // aria2 打开输出时报告的总长度，未知时为 0。
+  int64_t total = 0;
+  aria2_binary_t buffer{};
+  size_t capacity = 0;
+  bool spilled = false;
+  bool complete = false;
+};
+
+// 单个下载各阶段的时间点，0 表示尚未发生。
+struct aria2_timing_record {
+  std::chrono::steady_clock::time_point added;
+  std::chrono::steady_clock::time_point started;
+  std::chrono::steady_clock::time_point first_byte;
+  std::chrono::steady_clock::time_point last_byte;
+  std::chrono::steady_clock::time_point finished;
+  // 经过本库写入路径的下载最近一次写入的时间，完成时作为 last_byte。
+  std::chrono::steady_clock::time_point last_write;
+};
+
+// 下载阶段时间记录，只在事件循环线程上访问。
+struct aria2_timings {
+  std::unordered_map<aria2::A2Gid, aria2_timing_record> records;
+  // 尚未收齐数据、也没有经过写入路径的已开始下载，定期采样其进度。
+  std::vector<aria2::A2Gid> in_flight;
+  std::deque<aria2::A2Gid> finished;
+  std::chrono::steady_clock::time_point next_sample;
+};
+
+static const std::chrono::milliseconds ARIA2_TIMINGS_SAMPLE_INTERVAL(100);
+
+struct aria2_trace_event {
+  int64_t ts_us;
+  int64_t dur_us;
+  const char* name;
+  char phase;
+  uint32_t tid;
+  aria2::A2Gid gid;
+  int64_t arg;
+};
+
+struct aria2_trace_track {
+  uint32_t tid;
+  const char* open;
+};
+
+// Chrome trace-event 记录器，只在事件循环线程上访问。
+// 每个下载占用一行（tid），事件循环迭代位于 tid 0。
+struct aria2_trace {
+  FILE* file = nullptr;
+  std::chrono::steady_clock::time_point origin;
+  std::vector<aria2_trace_event> events;
+  std::unordered_map<aria2::A2Gid, aria2_trace_track> tracks;
+  uint32_t next_tid = 1;
+  bool first = true;
+};
+
+// 全局统计样本的环形缓冲区，只在事件循环线程上访问。
+struct aria2_stats_ring {
+  std::chrono::milliseconds interval;
+  std::chrono::steady_clock::time_point next_sample;
+  std::vector<aria2_global_stat_sample_t> samples;
+  size_t head = 0;
+  size_t size = 0;
+};
+
+struct aria2_command {
+  std::atomic<aria2_command*> next;
+  void (*run)(aria2_command* command);
+};
+
+// 多生产者单消费者的无锁队列（Vyukov 算法）。任意线程可 push，
+// 只有事件循环线程 pop。
+struct aria2_command_queue {
+  aria2_command stub;
+  std::atomic<aria2_command*> head;
+  aria2_command* tail;
+
+  aria2_command_queue() : head(&stub), tail(&stub)
+  {
+    stub.next.store(nullptr, std::memory_order_relaxed);
+    stub.run = nullptr;
+  }
+
+  void push(aria2_command* command)
+  {
+    command->next.store(nullptr, std::memory_order_relaxed);
+    aria2_command* prev = head.exchange(command, std::memory_order_acq_rel);
+    prev->next.store(command, std::memory_order_release);
+  }
+
+  aria2_command* pop()
+  {
+    aria2_command* first = tail;
+    aria2_command* next = first->next.load(std::memory_order_acquire);
+    if (first == &stub) {
+      if (!next) {
+        return nullptr;
+      }
+      tail = next;
+      first = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+      tail = next;
+      return first;
+    }
+    if (first != head.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    push(&stub);
+    next = first->next.load(std::memory_order_acquire);
+    if (next) {
+      tail = next;
+      return first;
+    }
+    return nullptr;
+  }
+};
+
+struct aria2_loop {
+  std::thread thread;
+  std::atomic<std::thread::id> owner;
+  aria2_command_queue queue;
+  std::atomic<size_t> pending{0};
+  std::atomic<bool> stop{false};
+  std::atomic<bool> sleeping{false};
+  // aria2_session_final 已开始，之后的命令不再入队。pushers 为正在入队
+  // 的线程数，aria2_session_final 等待其归零后再处理剩余命令。
+  std::atomic<bool> closing{false};
+  std::atomic<int> pushers{0};
+  std::mutex mutex;
+  std::condition_variable cond;
+  int cpu = -1;
+};
+
+// 共享句柄缓存中的底层句柄，由缓存和每个持有者各持有一个引用。
+struct aria2_handle_core {
+  aria2::DownloadHandle* handle;
+  std::atomic<int> refs{1};
+};
+
+struct aria2_option_cache {
+  bool enabled = false;
+  bool valid[ARIA2_OPT_COUNT] = {};
+  int64_t values[ARIA2_OPT_COUNT] = {};
+};
+
 struct aria2_session_t {
-  aria2::Session* session;
-  aria2_callback_ctx* callback_ctx;
+  aria2::Session* session = nullptr;
+  aria2_callback_ctx* callback_ctx = nullptr;
+  aria2_change_feed* change_feed = nullptr;
+  aria2_loop* loop = nullptr;
+  aria2_event_queue* event_queue = nullptr;
+  aria2_stats_ring* stats = nullptr;
+  aria2_timings* timings = nullptr;
+  aria2_trace* trace = nullptr;
+  std::atomic<bool> wakeup{false};
+  // 已完成的事件循环迭代次数，只在事件循环线程上访问。
+  uint64_t iteration = 0;
+  // aria2 等待网络事件时一并等待的描述符，aria2_wakeup 和线程模式下
+  // 命令入队时使其可读。
+  aria2_notifier wake;
+  aria2::LoopHook hook{};
+  aria2_option_cache option_cache;
+  std::unordered_map<aria2::A2Gid, aria2_bitfield_track> bitfields;
+  std::unordered_map<aria2::A2Gid, aria2_sink_state> sinks;
+  std::unordered_map<aria2::A2Gid, aria2_memory_target> memory_targets;
+  std::unordered_map<aria2::A2Gid, std::vector<aria2_range_watch>>
+      range_watches;
+  std::unordered_map<aria2::A2Gid, aria2_digest_state> digests;
+  std::deque<aria2::A2Gid> finished_digests;
+  // 尚未完成的摘要，每次迭代后补算乱序写入的区间。
+  std::unordered_set<aria2::A2Gid> active_digests;
+  std::vector<uint8_t> digest_buffer;
+  // 活动下载的共享句柄缓存，缓存本身持有一个引用。
+  std::mutex handle_cache_mutex;
+  std::unordered_map<aria2::A2Gid, aria2_handle_core*> handle_cache;
+  // 已释放的共享句柄持有者，供下次获取复用。
+  std::vector<aria2_download_handle_t*> handle_pool;
+  // 尚未释放的共享句柄持有者数，不为 0 时 aria2_session_final 失败。
+  std::atomic<size_t> handle_holders{0};
 };
 
 struct aria2_download_handle_t {
   aria2::DownloadHandle* handle;
+  aria2_session_t* session;
+  aria2::A2Gid gid;
+  // 由 aria2_acquire_download_handle 返回时指向共享的底层句柄。
+  aria2_handle_core* core = nullptr;
+  // 借用视图所引用的缓存数据，每个持有者各自一份。
+  std::string bitfield;
+  aria2::BtMetaInfoData bt_meta_info;
+  bool has_bt_meta_info = false;
+  std::vector<std::vector<aria2_str_view_t>> announce_views;
+  // 线程模式下按引用返回的数据复制到这里，view_option 按选项名分别保存。
+  std::string dir;
+  std::string info_hash;
+  std::unordered_map<std::string, std::string> options;
+};
+
+static void aria2_notifier_open(aria2_notifier* notifier)
+{
+#if defined(__linux__)
+  notifier->read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  notifier->write_fd = notifier->read_fd;
+#elif !defined(_WIN32)
+  int fds[2];
+  if (pipe(fds) == 0) {
+    for (int fd : fds) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    notifier->read_fd = fds[0];
+    notifier->write_fd = fds[1];
+  }
+#else
+  (void)notifier;
+#endif
+}
+
+static void aria2_notifier_close(aria2_notifier* notifier)
+{
+#if !defined(_WIN32)
+  if (notifier->read_fd != -1) {
+    close(notifier->read_fd);
+  }
+  if (notifier->write_fd != -1 && notifier->write_fd != notifier->read_fd) {
+    close(notifier->write_fd);
+  }
+#endif
+  notifier->read_fd = -1;
+  notifier->write_fd = -1;
+}
+
+// 使读端可读，已可读时不重复写入。
+static void aria2_notifier_signal(aria2_notifier* notifier)
+{
+  if (notifier->signaled.exchange(true)) {
+    return;
+  }
+#if defined(__linux__)
+  uint64_t one = 1;
+  ssize_t rv = write(notifier->write_fd, &one, sizeof(one));
+  (void)rv;
+#elif !defined(_WIN32)
+  char one = 1;
+  ssize_t rv = write(notifier->write_fd, &one, sizeof(one));
+  (void)rv;
+#endif
+}
+
+static void aria2_notifier_clear(aria2_notifier* notifier)
+{
+  notifier->signaled.store(false);
+#if !defined(_WIN32)
+  if (notifier->read_fd == -1) {
+    return;
+  }
+  uint64_t buf[8];
+  while (read(notifier->read_fd, buf, sizeof(buf)) > 0) {
+  }
+#endif
+}
+
+// 把命令交给事件循环线程，会话正在结束时返回 false。
+static bool aria2_loop_push(aria2_session_t* session, aria2_command* command)
+{
+  aria2_loop* loop = session->loop;
+  loop->pushers.fetch_add(1);
+  if (loop->closing.load()) {
+    loop->pushers.fetch_sub(1);
+    return false;
+  }
+  loop->queue.push(command);
+  loop->pending.fetch_add(1);
+  if (loop->sleeping.load()) {
+    std::lock_guard<std::mutex> lock(loop->mutex);
+    loop->cond.notify_one();
+  }
+  else {
+    aria2_notifier_signal(&session->wake);
+  }
+  loop->pushers.fetch_sub(1);
+  return true;
+}
+
+static void aria2_after_iteration(aria2_session_t* session);
+
+// aria2 每次迭代后在其内部调用：已读空唤醒描述符，允许下一次唤醒重新
+// 写入，再做迭代结束后的处理。
+static void aria2_wake_hook(void* user_data)
+{
+  auto* session = static_cast<aria2_session_t*>(user_data);
+  session->wake.signaled.store(false);
+  aria2_after_iteration(session);
+}
+
+static void aria2_loop_drain(aria2_loop* loop)
+{
+  while (aria2_command* command = loop->queue.pop()) {
+    loop->pending.fetch_sub(1);
+    command->run(command);
+  }
+}
+
+template <typename F>
+struct aria2_sync_command : aria2_command {
+  using result_type = decltype(std::declval<F&>()());
+
+  explicit aria2_sync_command(F* fn) : fn(fn)
+  {
+    run = &aria2_sync_command::invoke;
+  }
+
+  static void invoke(aria2_command* base)
+  {
+    auto* self = static_cast<aria2_sync_command*>(base);
+    self->result = (*self->fn)();
+    std::lock_guard<std::mutex> lock(self->mutex);
+    self->done = true;
+    self->cond.notify_one();
+  }
+
+  F* fn;
+  result_type result{};
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool done = false;
+};
+
+// 会话正在结束、调用无法转发时的返回值。
+template <typename R>
+static R aria2_call_failed()
+{
+  return R{};
+}
+
+template <>
+int aria2_call_failed<int>()
+{
+  return -1;
+}
+
+// 线程模式下把调用转发到事件循环线程执行并等待结果；
+// 非线程模式或已在事件循环线程上时直接调用。
+template <typename F>
+static auto aria2_session_call(aria2_session_t* session, F fn) -> decltype(fn())
+{
+  aria2_loop* loop = session->loop;
+  if (!loop || loop->owner.load() == std::this_thread::get_id()) {
+    return fn();
+  }
+  aria2_sync_command<F> command(&fn);
+  if (!aria2_loop_push(session, &command)) {
+    return aria2_call_failed<decltype(fn())>();
+  }
+  std::unique_lock<std::mutex> lock(command.mutex);
+  command.cond.wait(lock, [&] { return command.done; });
+  return command.result;
+}
+
+struct aria2_task_command : aria2_command {
+  aria2_session_task_t task;
+  aria2_session_t* session;
+  void* user_data;
+
+  static void invoke(aria2_command* base)
+  {
+    auto* self = static_cast<aria2_task_command*>(base);
+    self->task(self->session, self->user_data);
+    delete self;
+  }
 };
 
-static char* aria2_strdup(const std::string& value)
+static void aria2_stats_sample(aria2_session_t* session)
+{
+  aria2_stats_ring* ring = session->stats;
+  auto now = std::chrono::steady_clock::now();
+  if (now < ring->next_sample) {
+    return;
+  }
+  ring->next_sample = std::max(ring->next_sample + ring->interval, now);
+  aria2::GlobalStat cpp_stat = aria2::getGlobalStat(session->session);
+  aria2_global_stat_sample_t& sample =
+      ring->samples[(ring->head + ring->size) % ring->samples.size()];
+  sample.timestamp_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          now.time_since_epoch())
+          .count();
+  sample.stat.download_speed = cpp_stat.downloadSpeed;
+  sample.stat.upload_speed = cpp_stat.uploadSpeed;
+  sample.stat.num_active = cpp_stat.numActive;
+  sample.stat.num_waiting = cpp_stat.numWaiting;
+  sample.stat.num_stopped = cpp_stat.numStopped;
+  if (ring->size < ring->samples.size()) {
+    ++ring->size;
+  }
+  else {
+    ring->head = (ring->head + 1) % ring->samples.size();
+  }
+}
+
+// 每隔 ARIA2_TIMINGS_SAMPLE_INTERVAL 检查没有经过写入路径的已开始下载
+// 的进度，记录首字节和全部数据到达的时间。
+static void aria2_timings_scan(aria2_session_t* session)
+{
+  aria2_timings* timings = session->timings;
+  if (timings->in_flight.empty()) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (now < timings->next_sample) {
+    return;
+  }
+  timings->next_sample = now + ARIA2_TIMINGS_SAMPLE_INTERVAL;
+  size_t kept = 0;
+  for (aria2::A2Gid gid : timings->in_flight) {
+    auto it = timings->records.find(gid);
+    if (it == timings->records.end() ||
+        it->second.finished.time_since_epoch().count() ||
+        it->second.last_write.time_since_epoch().count()) {
+      continue;
+    }
+    aria2_timing_record& record = it->second;
+    aria2::DownloadHandle* handle =
+        aria2::getDownloadHandle(session->session, gid);
+    if (handle) {
+      int64_t completed = handle->getCompletedLength();
+      int64_t total = handle->getTotalLength();
+      aria2::deleteDownloadHandle(handle);
+      if (completed > 0 && !record.first_byte.time_since_epoch().count()) {
+        record.first_byte = now;
+      }
+      if (total > 0 && completed >= total) {
+        record.last_byte = now;
+        continue;
+      }
+    }
+    timings->in_flight[kept++] = gid;
+  }
+  timings->in_flight.resize(kept);
+}
+
+// 写入路径上的每次写入，首字节和数据到达时间由此精确得出。
+static void aria2_timings_write(aria2_session_t* session, aria2::A2Gid gid)
+{
+  auto it = session->timings->records.find(gid);
+  if (it == session->timings->records.end()) {
+    return;
+  }
+  aria2_timing_record& record = it->second;
+  record.last_write = std::chrono::steady_clock::now();
+  if (!record.first_byte.time_since_epoch().count()) {
+    record.first_byte = record.last_write;
+  }
+}
+
+static void aria2_timings_added(aria2_session_t* session, aria2::A2Gid gid)
+{
+  if (!session->timings) {
+    return;
+  }
+  session->timings->records[gid].added = std::chrono::steady_clock::now();
+}
+
+static void aria2_timings_event(aria2_session_t* session,
+                                aria2::DownloadEvent event,
+                                aria2::A2Gid gid)
+{
+  aria2_timings* timings = session->timings;
+  if (!timings) {
+    return;
+  }
+  const size_t max_finished = 1000;
+  auto now = std::chrono::steady_clock::now();
+  aria2_timing_record& record = timings->records[gid];
+  switch (event) {
+  case aria2::EVENT_ON_DOWNLOAD_START:
+    // 暂停后恢复也会触发开始事件，只记录第一次。
+    if (!record.started.time_since_epoch().count()) {
+      record.started = now;
+      timings->in_flight.push_back(gid);
+    }
+    break;
+  case aria2::EVENT_ON_DOWNLOAD_STOP:
+  case aria2::EVENT_ON_DOWNLOAD_COMPLETE:
+  case aria2::EVENT_ON_DOWNLOAD_ERROR:
+  case aria2::EVENT_ON_BT_DOWNLOAD_COMPLETE:
+    if (record.finished.time_since_epoch().count()) {
+      break;
+    }
+    record.finished = now;
+    if (event == aria2::EVENT_ON_DOWNLOAD_COMPLETE ||
+        event == aria2::EVENT_ON_BT_DOWNLOAD_COMPLETE) {
+      if (!record.last_byte.time_since_epoch().count()) {
+        record.last_byte = record.last_write.time_since_epoch().count()
+                               ? record.last_write
+                               : now;
+      }
+      if (!record.first_byte.time_since_epoch().count()) {
+        record.first_byte = record.last_byte;
+      }
+    }
+    timings->finished.push_back(gid);
+    if (timings->finished.size() > max_finished) {
+      timings->records.erase(timings->finished.front());
+      timings->finished.pop_front();
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static const size_t ARIA2_TRACE_FLUSH_EVENTS = 4096;
+
+static void aria2_trace_flush(aria2_trace* trace)
+{
+  std::string out;
+  char buf[256];
+  for (const aria2_trace_event& event : trace->events) {
+    int n;
+    switch (event.phase) {
+    case 'M':
+      // tid 0 是事件循环，其余行以 gid 命名。
+      n = event.tid ? std::snprintf(buf, sizeof(buf),
+                                    "{\"name\":\"thread_name\",\"ph\":\"M\","
+                                    "\"pid\":1,\"tid\":%u,"
+                                    "\"args\":{\"name\":\"%s%016llx\"}}",
+                                    event.tid, event.name,
+                                    static_cast<unsigned long long>(event.gid))
+                    : std::snprintf(buf, sizeof(buf),
+                                    "{\"name\":\"thread_name\",\"ph\":\"M\","
+                                    "\"pid\":1,\"tid\":0,"
+                                    "\"args\":{\"name\":\"%s\"}}",
+                                    event.name);
+      break;
+    case 'X':
+      n = std::snprintf(buf, sizeof(buf),
+                        "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,"
+                        "\"dur\":%lld,\"pid\":1,\"tid\":%u,"
+                        "\"args\":{\"result\":%lld}}",
+                        event.name, static_cast<long long>(event.ts_us),
+                        static_cast<long long>(event.dur_us), event.tid,
+                        static_cast<long long>(event.arg));
+      break;
+    case 'i':
+      n = std::snprintf(buf, sizeof(buf),
+                        "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+                        "\"ts\":%lld,\"pid\":1,\"tid\":%u,"
+                        "\"args\":{\"value\":%lld}}",
+                        event.name, static_cast<long long>(event.ts_us),
+                        event.tid, static_cast<long long>(event.arg));
+      break;
+    default:
+      n = std::snprintf(buf, sizeof(buf),
+                        "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,"
+                        "\"pid\":1,\"tid\":%u}",
+                        event.name, event.phase,
+                        static_cast<long long>(event.ts_us), event.tid);
+      break;
+    }
+    if (!trace->first) {
+      out += ",\n";
+    }
+    trace->first = false;
+    out.append(buf, static_cast<size_t>(std::max(n, 0)));
+  }
+  trace->events.clear();
+  std::fwrite(out.data(), 1, out.size(), trace->file);
+  std::fflush(trace->file);
+}
+
+static void aria2_trace_push(aria2_trace* trace, const aria2_trace_event& event)
+{
+  trace->events.push_back(event);
+  if (trace->events.size() >= ARIA2_TRACE_FLUSH_EVENTS) {
+    aria2_trace_flush(trace);
+  }
+}
+
+static int64_t aria2_trace_now(const aria2_trace* trace,
+                               std::chrono::steady_clock::time_point t)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(t -
+                                                               trace->origin)
+      .count();
+}
+
+static aria2_trace* aria2_trace_open(const char* path)
+{
+  auto* trace = new (std::nothrow) aria2_trace();
+  if (!trace) {
+    return nullptr;
+  }
+  trace->file = std::fopen(path, "w");
+  if (!trace->file) {
+    delete trace;
+    return nullptr;
+  }
+  trace->origin = std::chrono::steady_clock::now();
+  std::fputs("{\"traceEvents\":[\n", trace->file);
+  trace->events.reserve(ARIA2_TRACE_FLUSH_EVENTS);
+  trace->events.push_back(
+      aria2_trace_event{0, 0, "run loop", 'M', 0, 0, 0});
+  return trace;
+}
+
+static void aria2_trace_close(aria2_trace* trace)
+{
+  if (!trace) {
+    return;
+  }
+  aria2_trace_flush(trace);
+  std::fputs("\n]}\n", trace->file);
+  std::fclose(trace->file);
+  delete trace;
+}
+
+// 结束下载当前所处的阶段并进入 next 阶段；next 为 NULL 时下载结束，
+// 此时以 name 记录一个瞬时事件。
+static void aria2_trace_phase(aria2_session_t* session,
+                              aria2::A2Gid gid,
+                              const char* next,
+                              const char* name = nullptr)
+{
+  aria2_trace* trace = session->trace;
+  if (!trace) {
+    return;
+  }
+  int64_t ts = aria2_trace_now(trace, std::chrono::steady_clock::now());
+  auto it = trace->tracks.find(gid);
+  if (it == trace->tracks.end()) {
+    if (!next) {
+      return;
+    }
+    it = trace->tracks.emplace(gid, aria2_trace_track{trace->next_tid++,
+                                                      nullptr})
+             .first;
+    aria2_trace_push(trace, aria2_trace_event{0, 0, "gid ", 'M',
+                                              it->second.tid, gid, 0});
+  }
+  aria2_trace_track& track = it->second;
+  if (track.open) {
+    aria2_trace_push(trace, aria2_trace_event{ts, 0, track.open, 'E',
+                                              track.tid, gid, 0});
+  }
+  if (next) {
+    aria2_trace_push(trace,
+                     aria2_trace_event{ts, 0, next, 'B', track.tid, gid, 0});
+    track.open = next;
+  }
+  else {
+    aria2_trace_push(trace,
+                     aria2_trace_event{ts, 0, name, 'i', track.tid, gid, 0});
+    trace->tracks.erase(it);
+  }
+}
+
+static void aria2_trace_instant(aria2_session_t* session,
+                                aria2::A2Gid gid,
+                                const char* name,
+                                int64_t arg)
+{
+  aria2_trace* trace = session->trace;
+  if (!trace) {
+    return;
+  }
+  auto it = trace->tracks.find(gid);
+  if (it == trace->tracks.end()) {
+    return;
+  }
+  aria2_trace_push(
+      trace,
+      aria2_trace_event{aria2_trace_now(trace, std::chrono::steady_clock::now()),
+                        0, name, 'i', it->second.tid, gid, arg});
+}
+
+static void aria2_trace_download_event(aria2_session_t* session,
+                                       aria2::DownloadEvent event,
+                                       aria2::A2Gid gid)
+{
+  switch (event) {
+  case aria2::EVENT_ON_DOWNLOAD_START:
+    aria2_trace_phase(session, gid, "active");
+    break;
+  case aria2::EVENT_ON_DOWNLOAD_PAUSE:
+    aria2_trace_phase(session, gid, "paused");
+    break;
+  case aria2::EVENT_ON_BT_DOWNLOAD_COMPLETE:
+    aria2_trace_phase(session, gid, "seeding");
+    break;
+  case aria2::EVENT_ON_DOWNLOAD_STOP:
+    aria2_trace_phase(session, gid, nullptr, "stopped");
+    break;
+  case aria2::EVENT_ON_DOWNLOAD_COMPLETE:
+    aria2_trace_phase(session, gid, nullptr, "complete");
+    break;
+  case aria2::EVENT_ON_DOWNLOAD_ERROR:
+    aria2_trace_phase(session, gid, nullptr, "error");
+    break;
+  default:
+    break;
+  }
+}
+
+static bool aria2_digest_pump(aria2_session_t* session);
+static bool aria2_sink_pump(aria2_session_t* session);
+static void aria2_range_watch_scan(aria2_session_t* session);
+
+// 每次迭代结束后的处理。安装了唤醒钩子时在 aria2 内部调用，aria2_run
+// 以默认方式运行时也会执行，否则在 aria2::run 返回后调用。
+static void aria2_after_iteration(aria2_session_t* session)
+{
+  ++session->iteration;
+  if (!session->range_watches.empty()) {
+    aria2_range_watch_scan(session);
+  }
+}
+
+// 在 aria2 的网络等待中加入唤醒描述符，等待最长 timeout_ms，
+// 为负时使用 aria2 默认的 1 秒。
+static void aria2_install_wake_hook(aria2_session_t* session, int timeout_ms)
+{
+  if (session->hook.fd == -1) {
+    return;
+  }
+  session->hook.timeoutMs = timeout_ms;
+  aria2::installLoopHook(session->session, &session->hook);
+}
+
+// 执行一次事件循环迭代，等待网络事件最长 timeout_ms。所有由本库驱动的
+// 循环都经过这里。
+static int aria2_run_once(aria2_session_t* session, int timeout_ms = -1)
+{
+  auto start = session->trace ? std::chrono::steady_clock::now()
+                              : std::chrono::steady_clock::time_point();
+  aria2_install_wake_hook(session, timeout_ms);
+  int rv = aria2::run(session->session, aria2::RUN_ONCE);
+  if (!session->hook.installed) {
+    aria2_after_iteration(session);
+  }
+  if (aria2_trace* trace = session->trace) {
+    auto end = std::chrono::steady_clock::now();
+    aria2_trace_push(trace,
+                     aria2_trace_event{aria2_trace_now(trace, start),
+                                       aria2_trace_now(trace, end) -
+                                           aria2_trace_now(trace, start),
+                                       "run_once", 'X', 0, 0, rv});
+  }
+  if (session->stats) {
+    aria2_stats_sample(session);
+  }
+  if (session->timings) {
+    aria2_timings_scan(session);
+  }
+  if (!session->active_digests.empty() && aria2_digest_pump(session) &&
+      rv == 0) {
+    rv = 1;
+  }
+  if (!session->sinks.empty() && aria2_sink_pump(session) && rv == 0) {
+    rv = 1;
+  }
+  return rv;
+}
+
+// 把当前线程绑定到指定 CPU，失败或不支持时保持原样。
+static void aria2_pin_current_thread(int cpu)
+{
+#if defined(__linux__)
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)cpu;
+#endif
+}
+
+static void aria2_loop_main(aria2_session_t* session)
+{
+  aria2_loop* loop = session->loop;
+  loop->owner.store(std::this_thread::get_id());
+  if (loop->cpu >= 0) {
+    aria2_pin_current_thread(loop->cpu);
+  }
+  while (!loop->stop.load()) {
+    aria2_loop_drain(loop);
+    if (aria2_run_once(session) == 1) {
+      continue;
+    }
+    // 没有可执行的下载，等待新命令或停止请求。
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    loop->sleeping.store(true);
+    loop->cond.wait(lock, [&] {
+      return loop->stop.load() || loop->pending.load() > 0;
+    });
+    loop->sleeping.store(false);
+  }
+}
+
+// 线程模式下的下载句柄：所有访问都转发到事件循环线程。
+// 按引用返回的数据复制到调用线程的局部存储中，引用在该线程再次调用
+// 同一方法前有效；共享句柄在不同线程上的持有者互不干扰。
+class aria2_loop_download_handle : public aria2::DownloadHandle {
+public:
+  aria2_loop_download_handle(aria2_session_t* session,
+                             aria2::DownloadHandle* handle)
+      : session_(session), handle_(handle)
+  {
+  }
+
+  ~aria2_loop_download_handle() override
+  {
+    call([&] {
+      aria2::deleteDownloadHandle(handle_);
+      return 0;
+    });
+  }
+
+  aria2::DownloadStatus getStatus() override
+  {
+    return call([&] { return handle_->getStatus(); });
+  }
+
+  int64_t getTotalLength() override
+  {
+    return call([&] { return handle_->getTotalLength(); });
+  }
+
+  int64_t getCompletedLength() override
+  {
+    return call([&] { return handle_->getCompletedLength(); });
+  }
+
+  int64_t getUploadLength() override
+  {
+    return call([&] { return handle_->getUploadLength(); });
+  }
+
+  std::string getBitfield() override
+  {
+    return call([&] { return handle_->getBitfield(); });
+  }
+
+  int getDownloadSpeed() override
+  {
+    return call([&] { return handle_->getDownloadSpeed(); });
+  }
+
+  int getUploadSpeed() override
+  {
+    return call([&] { return handle_->getUploadSpeed(); });
+  }
+
+  const std::string& getInfoHash() override
+  {
+    thread_local std::string info_hash;
+    info_hash = call([&] { return handle_->getInfoHash(); });
+    return info_hash;
+  }
+
+  size_t getPieceLength() override
+  {
+    return call([&] { return handle_->getPieceLength(); });
+  }
+
+  int getNumPieces() override
+  {
+    return call([&] { return handle_->getNumPieces(); });
+  }
+
+  int getConnections() override
+  {
+    return call([&] { return handle_->getConnections(); });
+  }
+
+  int getErrorCode() override
+  {
+    return call([&] { return handle_->getErrorCode(); });
+  }
+
+  const std::vector<aria2::A2Gid>& getFollowedBy() override
+  {
+    thread_local std::vector<aria2::A2Gid> followed_by;
+    followed_by = call([&] { return handle_->getFollowedBy(); });
+    return followed_by;
+  }
+
+  aria2::A2Gid getFollowing() override
+  {
+    return call([&] { return handle_->getFollowing(); });
+  }
+
+  aria2::A2Gid getBelongsTo() override
+  {
+    return call([&] { return handle_->getBelongsTo(); });
+  }
+
+  const std::string& getDir() override
+  {
+    thread_local std::string dir;
+    dir = call([&] { return handle_->getDir(); });
+    return dir;
+  }
+
+  std::vector<aria2::FileData> getFiles() override
+  {
+    return call([&] { return handle_->getFiles(); });
+  }
+
+  int getNumFiles() override
+  {
+    return call([&] { return handle_->getNumFiles(); });
+  }
+
+  aria2::FileData getFile(int index) override
+  {
+    return call([&] { return handle_->getFile(index); });
+  }
+
+  aria2::BtMetaInfoData getBtMetaInfo() override
+  {
+    return call([&] { return handle_->getBtMetaInfo(); });
+  }
+
+  const std::string& getOption(const std::string& name) override
+  {
+    thread_local std::string option;
+    option = call([&] { return handle_->getOption(name); });
+    return option;
+  }
+
+  aria2::KeyVals getOptions() override
+  {
+    return call([&] { return handle_->getOptions(); });
+  }
+
+private:
+  template <typename F>
+  auto call(F fn) -> typename std::decay<decltype(fn())>::type
+  {
+    return aria2_session_call(
+        session_, [&]() -> typename std::decay<decltype(fn())>::type {
+          return fn();
+        });
+  }
+
+  aria2_session_t* session_;
+  aria2::DownloadHandle* handle_;
+};
+
+static char* aria2_strdup(const std::string& value)
+{
+  char* out = static_cast<char*>(std::malloc(value.size() + 1));
+  if (!out) {
+    return nullptr;
+  }
+  if (!value.empty()) {
+    std::memcpy(out, value.data(), value.size());
+  }
+  out[value.size()] = '\0';
+  return out;
+}
+
+static aria2_binary_t aria2_make_binary(const std::string& value)
+{
+  aria2_binary_t bin{};
+  if (value.empty()) {
+    return bin;
+  }
+  bin.data = static_cast<uint8_t*>(std::malloc(value.size()));
+  if (!bin.data) {
+    return bin;
+  }
+  std::memcpy(bin.data, value.data(), value.size());
+  bin.length = value.size();
+  return bin;
+}
+
+static aria2::KeyVals aria2_to_key_vals(const aria2_key_val_t* options,
+                                        size_t options_count)
+{
+  aria2::KeyVals result;
+  if (!options || options_count == 0) {
+    return result;
+  }
+  result.reserve(options_count);
+  for (size_t i = 0; i < options_count; ++i) {
+    const char* key = options[i].key ? options[i].key : "";
+    const char* value = options[i].value ? options[i].value : "";
+    result.emplace_back(key, value);
+  }
+  return result;
+}
+
+static std::vector<std::string> aria2_to_string_vector(const char** values,
+                                                       size_t count)
+{
+  std::vector<std::string> result;
+  if (!values || count == 0) {
+    return result;
+  }
+  result.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    result.emplace_back(values[i] ? values[i] : "");
+  }
+  return result;
+}
+
+static int aria2_copy_gid_vector(const std::vector<aria2::A2Gid>& gids,
+                                 aria2_gid_t** out_gids,
+                                 size_t* out_gids_count)
+{
+  if (!out_gids || !out_gids_count) {
+    return -1;
+  }
+  *out_gids = nullptr;
+  *out_gids_count = 0;
+  if (gids.empty()) {
+    return 0;
+  }
+  auto* data =
+      static_cast<aria2_gid_t*>(std::malloc(sizeof(aria2_gid_t) * gids.size()));
+  if (!data) {
+    return -1;
+  }
+  for (size_t i = 0; i < gids.size(); ++i) {
+    data[i] = static_cast<aria2_gid_t>(gids[i]);
+  }
+  *out_gids = data;
+  *out_gids_count = gids.size();
+  return 0;
+}
+
+static int aria2_copy_key_vals(const aria2::KeyVals& options,
+                               aria2_key_val_t** out_options,
+                               size_t* out_options_count)
+{
+  if (!out_options || !out_options_count) {
+    return -1;
+  }
+  *out_options = nullptr;
+  *out_options_count = 0;
+  if (options.empty()) {
+    return 0;
+  }
+  auto* data =
+      static_cast<aria2_key_val_t*>(std::malloc(sizeof(aria2_key_val_t) * options.size()));
+  if (!data) {
+    return -1;
+  }
+  for (size_t i = 0; i < options.size(); ++i) {
+    data[i].key = aria2_strdup(options[i].first);
+    data[i].value = aria2_strdup(options[i].second);
+    if ((options[i].first.size() && !data[i].key) ||
+        (options[i].second.size() && !data[i].value)) {
+      for (size_t j = 0; j <= i; ++j) {
+        std::free(data[j].key);
+        std::free(data[j].value);
+      }
+      std::free(data);
+      return -1;
+    }
+  }
+  *out_options = data;
+  *out_options_count = options.size();
+  return 0;
+}
+
+static int aria2_copy_uri_data(const std::vector<aria2::UriData>& uris,
+                               aria2_uri_data_t** out_uris,
+                               size_t* out_uris_count)
+{
+  if (!out_uris || !out_uris_count) {
+    return -1;
+  }
+  *out_uris = nullptr;
+  *out_uris_count = 0;
+  if (uris.empty()) {
+    return 0;
+  }
+  auto* data = static_cast<aria2_uri_data_t*>(
+      std::malloc(sizeof(aria2_uri_data_t) * uris.size()));
+  if (!data) {
+    return -1;
+  }
+  for (size_t i = 0; i < uris.size(); ++i) {
+    data[i].uri = aria2_strdup(uris[i].uri);
+    data[i].status = static_cast<aria2_uri_status_t>(uris[i].status);
+    if (uris[i].uri.size() && !data[i].uri) {
+      for (size_t j = 0; j <= i; ++j) {
+        std::free(data[j].uri);
+      }
+      std::free(data);
+      return -1;
+    }
+  }
+  *out_uris = data;
+  *out_uris_count = uris.size();
+  return 0;
+}
+
+static int aria2_copy_file_data(const aria2::FileData& file,
+                                aria2_file_data_t* out_file)
+{
+  if (!out_file) {
+    return -1;
+  }
+  *out_file = aria2_file_data_t{};
+  out_file->index = file.index;
+  out_file->path = aria2_strdup(file.path);
+  out_file->length = file.length;
+  out_file->completed_length = file.completedLength;
+  out_file->selected = file.selected ? 1 : 0;
+  if (file.path.size() && !out_file->path) {
+    return -1;
+  }
+  if (aria2_copy_uri_data(file.uris, &out_file->uris,
+                          &out_file->uris_count) != 0) {
+    std::free(out_file->path);
+    *out_file = aria2_file_data_t{};
+    return -1;
+  }
+  return 0;
+}
+
+static int aria2_copy_file_data_vector(
+    const std::vector<aria2::FileData>& files,
+    aria2_file_data_t** out_files,
+    size_t* out_files_count)
+{
+  if (!out_files || !out_files_count) {
+    return -1;
+  }
+  *out_files = nullptr;
+  *out_files_count = 0;
+  if (files.empty()) {
+    return 0;
+  }
+  auto* data = static_cast<aria2_file_data_t*>(
+      std::malloc(sizeof(aria2_file_data_t) * files.size()));
+  if (!data) {
+    return -1;
+  }
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (aria2_copy_file_data(files[i], &data[i]) != 0) {
+      for (size_t j = 0; j < i; ++j) {
+        aria2_free_file_data(&data[j]);
+      }
+      std::free(data);
+      return -1;
+    }
+  }
+  *out_files = data;
+  *out_files_count = files.size();
+  return 0;
+}
+
+static int aria2_copy_string_list(const std::vector<std::string>& values,
+                                  aria2_string_list_t* out_list)
+{
+  if (!out_list) {
+    return -1;
+  }
+  out_list->values = nullptr;
+  out_list->count = 0;
+  if (values.empty()) {
+    return 0;
+  }
+  auto* data =
+      static_cast<char**>(std::malloc(sizeof(char*) * values.size()));
+  if (!data) {
+    return -1;
+  }
+  for (size_t i = 0; i < values.size(); ++i) {
+    data[i] = aria2_strdup(values[i]);
+    if (values[i].size() && !data[i]) {
+      for (size_t j = 0; j <= i; ++j) {
+        std::free(data[j]);
+      }
+      std::free(data);
+      return -1;
+    }
+  }
+  out_list->values = data;
+  out_list->count = values.size();
+  return 0;
+}
+
+static int aria2_copy_string_list_array(
+    const std::vector<std::vector<std::string>>& lists,
+    aria2_string_list_t** out_lists,
+    size_t* out_lists_count)
+{
+  if (!out_lists || !out_lists_count) {
+    return -1;
+  }
+  *out_lists = nullptr;
+  *out_lists_count = 0;
+  if (lists.empty()) {
+    return 0;
+  }
+  auto* data = static_cast<aria2_string_list_t*>(
+      std::malloc(sizeof(aria2_string_list_t) * lists.size()));
+  if (!data) {
+    return -1;
+  }
+  for (size_t i = 0; i < lists.size(); ++i) {
+    if (aria2_copy_string_list(lists[i], &data[i]) != 0) {
+      for (size_t j = 0; j < i; ++j) {
+        aria2_free_string_list(&data[j]);
+      }
+      std::free(data);
+      return -1;
+    }
+  }
+  *out_lists = data;
+  *out_lists_count = lists.size();
+  return 0;
+}
+
+static bool aria2_status_stopped(aria2_download_status_t status)
+{
+  return status == ARIA2_DOWNLOAD_COMPLETE || status == ARIA2_DOWNLOAD_ERROR ||
+         status == ARIA2_DOWNLOAD_REMOVED;
+}
+
+// 被覆盖或已删除的 log 条目过多时按现有记录重建 log。
+static void aria2_change_feed_compact_log(aria2_change_feed* feed)
+{
+  if (feed->log.size() <= 2 * feed->records.size() + 64) {
+    return;
+  }
+  feed->log.clear();
+  for (const auto& entry : feed->records) {
+    feed->log.emplace_back(entry.second.version, entry.first);
+  }
+  std::sort(feed->log.begin(), feed->log.end());
+}
+
+static void aria2_change_feed_update(aria2_change_feed* feed,
+                                     aria2::A2Gid gid,
+                                     aria2_download_status_t status,
+                                     int64_t completed_length,
+                                     int download_speed)
+{
+  auto it = feed->records.find(gid);
+  if (it != feed->records.end()) {
+    const aria2_change_record& record = it->second;
+    if (record.status == status &&
+        record.completed_length == completed_length &&
+        record.download_speed == download_speed) {
+      return;
+    }
+  }
+  bool was_stopped =
+      it != feed->records.end() && aria2_status_stopped(it->second.status);
+  uint64_t version = ++feed->version;
+  feed->records[gid] =
+      aria2_change_record{version, status, completed_length, download_speed};
+  feed->log.emplace_back(version, gid);
+  if (!was_stopped && aria2_status_stopped(status)) {
+    feed->stopped.push_back(gid);
+  }
+  aria2_change_feed_compact_log(feed);
+}
+
+// 删除 aria2 已清除且所有轮询者都已读过的下载记录。轮询者超过
+// ARIA2_CHANGE_POLLER_TIMEOUT 未再轮询时不再阻止删除。每次轮询和注销
+// 轮询者时调用。
+static void aria2_change_feed_collect(aria2_session_t* session)
+{
+  static const std::chrono::seconds ARIA2_CHANGE_POLLER_TIMEOUT(60);
+  aria2_change_feed* feed = session->change_feed;
+  // aria2 按停止顺序清除超出 max-download-result 的结果，
+  // 只需检查队首。
+  while (!feed->stopped.empty()) {
+    aria2::A2Gid gid = feed->stopped.front();
+    aria2::DownloadHandle* handle =
+        aria2::getDownloadHandle(session->session, gid);
+    if (handle) {
+      aria2::deleteDownloadHandle(handle);
+      break;
+    }
+    feed->stopped.pop_front();
+    feed->gone.push_back(gid);
+  }
+  if (feed->gone.empty()) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  uint64_t low = feed->version;
+  for (const auto& entry : feed->pollers) {
+    if (now - entry.second.last_poll <= ARIA2_CHANGE_POLLER_TIMEOUT) {
+      low = std::min(low, entry.second.cursor);
+    }
+  }
+  size_t kept = 0;
+  for (aria2::A2Gid gid : feed->gone) {
+    auto it = feed->records.find(gid);
+    if (it == feed->records.end()) {
+      continue;
+    }
+    if (it->second.version > low) {
+      feed->gone[kept++] = gid;
+      continue;
+    }
+    feed->floor = std::max(feed->floor, it->second.version);
+    feed->records.erase(it);
+  }
+  feed->gone.resize(kept);
+  aria2_change_feed_compact_log(feed);
+}
+
+static void aria2_change_feed_touch(aria2_session_t* session,
+                                    aria2::A2Gid gid,
+                                    aria2_download_status_t fallback)
+{
+  if (!session->change_feed) {
+    return;
+  }
+  aria2::DownloadHandle* handle =
+      aria2::getDownloadHandle(session->session, gid);
+  if (!handle) {
+    auto it = session->change_feed->records.find(gid);
+    if (it != session->change_feed->records.end()) {
+      aria2_change_feed_update(session->change_feed, gid, fallback,
+                               it->second.completed_length, 0);
+    }
+    return;
+  }
+  aria2_change_feed_update(
+      session->change_feed, gid,
+      static_cast<aria2_download_status_t>(handle->getStatus()),
+      handle->getCompletedLength(), handle->getDownloadSpeed());
+  aria2::deleteDownloadHandle(handle);
+}
+
+// 下载事件带来的变化，状态以事件为准。已完成长度沿用上次的记录，
+// 下载停止时从 aria2 取得最终值。
+static void aria2_change_feed_event(aria2_session_t* session,
+                                    aria2::A2Gid gid,
+                                    aria2_download_status_t status)
+{
+  aria2_change_feed* feed = session->change_feed;
+  if (!feed) {
+    return;
+  }
+  auto it = feed->records.find(gid);
+  int64_t completed_length =
+      it == feed->records.end() ? 0 : it->second.completed_length;
+  int download_speed = it == feed->records.end() ||
+                               status != ARIA2_DOWNLOAD_ACTIVE
+                           ? 0
+                           : it->second.download_speed;
+  if (aria2_status_stopped(status)) {
+    aria2::DownloadHandle* handle =
+        aria2::getDownloadHandle(session->session, gid);
+    if (handle) {
+      completed_length = handle->getCompletedLength();
+      aria2::deleteDownloadHandle(handle);
+    }
+  }
+  aria2_change_feed_update(feed, gid, status, completed_length,
+                           download_speed);
+}
+
+// 新下载加入队列后更新会话内的各项记录。
+static void aria2_download_added(aria2_session_t* session, aria2::A2Gid gid)
+{
+  aria2_change_feed_touch(session, gid, ARIA2_DOWNLOAD_WAITING);
+  aria2_timings_added(session, gid);
+  aria2_trace_phase(session, gid, "waiting");
+}
+
+static uint64_t aria2_popcount_scalar(const uint8_t* data, size_t length)
+{
+  uint64_t total = 0;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    total += static_cast<uint64_t>(__builtin_popcountll(word));
+  }
+  for (; i < length; ++i) {
+    total += static_cast<uint64_t>(__builtin_popcount(data[i]));
+  }
+  return total;
+}
+
+#if defined(ARIA2_C_API_X86_64)
+__attribute__((target("avx2"))) static uint64_t
+aria2_popcount_avx2(const uint8_t* data, size_t length)
+{
+  // 以 4 位为索引查表计数，再用 SAD 按 64 位累加。
+  const __m256i lookup =
+      _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1,
+                       1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i count = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                    _mm256_shuffle_epi8(lookup, hi));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(count, zero));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         aria2_popcount_scalar(data + i, length - i);
+}
+#endif
+
+static uint64_t aria2_popcount(const uint8_t* data, size_t length)
+{
+#if defined(ARIA2_C_API_X86_64)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2) {
+    return aria2_popcount_avx2(data, length);
+  }
+  return aria2_popcount_scalar(data, length);
+#elif defined(ARIA2_C_API_NEON)
+  uint64_t total = 0;
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    total += vaddvq_u8(vcntq_u8(vld1q_u8(data + i)));
+  }
+  return total + aria2_popcount_scalar(data + i, length - i);
+#else
+  return aria2_popcount_scalar(data, length);
+#endif
+}
+
+// 以大端序读取第 index 个 64 位字，使最高位对应序号最小的分片；
+// 超出位图长度的部分按 0 处理。
+static uint64_t aria2_load_bitfield_word(const uint8_t* bits,
+                                         size_t length,
+                                         size_t index)
+{
+  size_t offset = index * 8;
+  uint8_t bytes[8] = {};
+  if (offset < length) {
+    std::memcpy(bytes, bits + offset, std::min<size_t>(8, length - offset));
+  }
+  uint64_t word = 0;
+  for (uint8_t byte : bytes) {
+    word = (word << 8) | byte;
+  }
+  return word;
+}
+
+// 对由 load(w) 给出第 w 个 64 位字的位串中每个连续的 1 区间
+// [begin, end) 调用 fn。
+template <typename L, typename F>
+static void aria2_for_each_word_run(size_t num_pieces, L load, F fn)
+{
+  const size_t none = static_cast<size_t>(-1);
+  size_t run_begin = none;
+  size_t words = (num_pieces + 63) / 64;
+  for (size_t w = 0; w < words; ++w) {
+    uint64_t word = load(w);
+    size_t base = w * 64;
+    if (base + 64 > num_pieces) {
+      word &= ~UINT64_C(0) << (base + 64 - num_pieces);
+    }
+    // 整字全 0 或全 1 时无需逐位处理。
+    if ((run_begin == none && word == 0) ||
+        (run_begin != none && word == ~UINT64_C(0))) {
+      continue;
+    }
+    size_t pos = 0;
+    while (pos < 64) {
+      if (run_begin == none) {
+        uint64_t rest = word << pos;
+        if (rest == 0) {
+          break;
+        }
+        pos += static_cast<size_t>(__builtin_clzll(rest));
+        run_begin = base + pos;
+      }
+      else {
+        uint64_t rest = ~word << pos;
+        if (rest == 0) {
+          break;
+        }
+        pos += static_cast<size_t>(__builtin_clzll(rest));
+        fn(run_begin, base + pos);
+        run_begin = none;
+      }
+    }
+  }
+  if (run_begin != none) {
+    fn(run_begin, num_pieces);
+  }
+}
+
+// 对位图中每个连续的 1 区间 [begin, end) 调用 fn。
+template <typename F>
+static void aria2_for_each_run(const uint8_t* bits,
+                               size_t length,
+                               size_t num_pieces,
+                               F fn)
+{
+  aria2_for_each_word_run(
+      num_pieces,
+      [&](size_t w) { return aria2_load_bitfield_word(bits, length, w); }, fn);
+}
+
+static size_t aria2_collect_runs(const uint8_t* bits,
+                                 size_t length,
+                                 size_t num_pieces,
+                                 std::vector<aria2_piece_range_t>* out)
+{
+  size_t count = 0;
+  aria2_for_each_run(bits, length, num_pieces, [&](size_t begin, size_t end) {
+    out->push_back(aria2_piece_range_t{static_cast<uint32_t>(begin),
+                                       static_cast<uint32_t>(end)});
+    ++count;
+  });
+  return count;
+}
+
+// 用新取得的位图更新 track。与保存的位图逐字节比较，相同时不做任何事；
+// 不同时按字异或得出翻转区间，记录为新版本后换入新位图。返回位图是否
+// 变化。
+static bool aria2_bitfield_track_update(aria2_bitfield_track& track,
+                                        std::string& bits,
+                                        size_t num_pieces)
+{
+  const size_t max_history = 32;
+  track.num_pieces = num_pieces;
+  if (track.version != 0 && bits.size() == track.bits.size() &&
+      std::memcmp(bits.data(), track.bits.data(), bits.size()) == 0) {
+    return false;
+  }
+  std::vector<aria2_piece_range_t> flipped;
+  if (track.version != 0) {
+    auto now = reinterpret_cast<const uint8_t*>(bits.data());
+    auto old = reinterpret_cast<const uint8_t*>(track.bits.data());
+    size_t common = std::min(bits.size(), track.bits.size());
+    size_t length = std::max(bits.size(), track.bits.size());
+    aria2_for_each_word_run(
+        length * 8,
+        [&](size_t w) -> uint64_t {
+          size_t offset = w * 8;
+          if (offset + 8 <= common &&
+              std::memcmp(now + offset, old + offset, 8) == 0) {
+            return 0;
+          }
+          return aria2_load_bitfield_word(now, bits.size(), w) ^
+                 aria2_load_bitfield_word(old, track.bits.size(), w);
+        },
+        [&](size_t begin, size_t end) {
+          flipped.push_back(aria2_piece_range_t{static_cast<uint32_t>(begin),
+                                                static_cast<uint32_t>(end)});
+        });
+  }
+  track.bits.swap(bits);
+  ++track.version;
+  track.history.emplace_back(track.version, std::move(flipped));
+  if (track.history.size() > max_history) {
+    track.history.pop_front();
+  }
+  return true;
+}
+
+// 在本次迭代中尚未刷新时从 aria2 取得 gid 的状态并更新保存的记录，
+// 已完成长度和状态都没有变化时不重新取得位图。下载不存在时返回 false。
+// 只在事件循环线程上调用。
+static bool aria2_bitfield_refresh(aria2_session_t* session, aria2::A2Gid gid)
+{
+  auto it = session->bitfields.find(gid);
+  if (it != session->bitfields.end() &&
+      it->second.refreshed == session->iteration) {
+    return true;
+  }
+  aria2::DownloadHandle* handle = aria2::getDownloadHandle(session->session, gid);
+  if (!handle) {
+    return false;
+  }
+  aria2_bitfield_track& track = session->bitfields[gid];
+  track.refreshed = session->iteration;
+  int64_t completed = handle->getCompletedLength();
+  aria2::DownloadStatus status = handle->getStatus();
+  if (track.version != 0 && completed == track.completed &&
+      status == track.status) {
+    aria2::deleteDownloadHandle(handle);
+    return true;
+  }
+  track.completed = completed;
+  track.status = status;
+  track.piece_length = static_cast<int64_t>(handle->getPieceLength());
+  track.total = handle->getTotalLength();
+  std::string bits = handle->getBitfield();
+  size_t num_pieces =
+      std::min(static_cast<size_t>(std::max(handle->getNumPieces(), 0)),
+               bits.size() * 8);
+  aria2::deleteDownloadHandle(handle);
+  aria2_bitfield_track_update(track, bits, num_pieces);
+  return true;
+}
+
+static aria2_event_queue* aria2_event_queue_new(size_t capacity)
+{
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  auto* queue = new (std::nothrow) aria2_event_queue();
+  if (!queue) {
+    return nullptr;
+  }
+  try {
+    queue->ring.resize(size);
+  }
+  catch (const std::bad_alloc&) {
+    delete queue;
+    return nullptr;
+  }
+  queue->mask = size - 1;
+  aria2_notifier_open(&queue->notifier);
+  return queue;
+}
+
+static void aria2_event_queue_delete(aria2_event_queue* queue)
+{
+  if (!queue) {
+    return;
+  }
+  aria2_notifier_close(&queue->notifier);
+  delete queue;
+}
+
+static void aria2_event_queue_push(aria2_event_queue* queue,
+                                   aria2::DownloadEvent event,
+                                   aria2::A2Gid gid)
+{
+  size_t tail = queue->tail.load(std::memory_order_relaxed);
+  size_t head = queue->head.load(std::memory_order_acquire);
+  if (tail - head == queue->ring.size()) {
+    queue->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  queue->ring[tail & queue->mask] =
+      aria2_event_t{static_cast<aria2_download_event_t>(event),
+                    static_cast<aria2_gid_t>(gid)};
+  queue->tail.store(tail + 1, std::memory_order_release);
+  aria2_notifier_signal(&queue->notifier);
+}
+
+static aria2_download_status_t aria2_event_status(aria2::DownloadEvent event)
+{
+  switch (event) {
+  case aria2::EVENT_ON_DOWNLOAD_PAUSE:
+    return ARIA2_DOWNLOAD_PAUSED;
+  case aria2::EVENT_ON_DOWNLOAD_STOP:
+    return ARIA2_DOWNLOAD_REMOVED;
+  case aria2::EVENT_ON_DOWNLOAD_COMPLETE:
+    return ARIA2_DOWNLOAD_COMPLETE;
+  case aria2::EVENT_ON_DOWNLOAD_ERROR:
+    return ARIA2_DOWNLOAD_ERROR;
+  default:
+    return ARIA2_DOWNLOAD_ACTIVE;
+  }
+}
+
+static aria2_str_view_t aria2_make_str_view(const std::string& value)
+{
+  return aria2_str_view_t{value.data(), value.size()};
+}
+
+static aria2_bytes_view_t aria2_make_bytes_view(const std::string& value)
+{
+  return aria2_bytes_view_t{
+      reinterpret_cast<const uint8_t*>(value.data()), value.size()};
+}
+
+static void aria2_cache_bt_meta_info(aria2_download_handle_t* dh)
+{
+  if (dh->has_bt_meta_info) {
+    return;
+  }
+  dh->bt_meta_info = dh->handle->getBtMetaInfo();
+  dh->announce_views.resize(dh->bt_meta_info.announceList.size());
+  for (size_t i = 0; i < dh->announce_views.size(); ++i) {
+    const auto& tier = dh->bt_meta_info.announceList[i];
+    dh->announce_views[i].reserve(tier.size());
+    for (const auto& uri : tier) {
+      dh->announce_views[i].push_back(aria2_make_str_view(uri));
+    }
+  }
+  dh->has_bt_meta_info = true;
+}
+
+static void* aria2_arena_alloc(aria2_arena_t* arena,
+                               size_t size,
+                               size_t alignment)
+{
+  while (arena->current < arena->blocks.size()) {
+    const aria2_arena_block& block = arena->blocks[arena->current];
+    size_t offset = (arena->offset + alignment - 1) & ~(alignment - 1);
+    if (offset + size <= block.size) {
+      arena->offset = offset + size;
+      return block.data + offset;
+    }
+    ++arena->current;
+    arena->offset = 0;
+  }
+  size_t block_size = std::max(arena->block_size, size + alignment);
+  auto* data = static_cast<uint8_t*>(std::malloc(block_size));
+  if (!data) {
+    return nullptr;
+  }
+  arena->blocks.push_back(aria2_arena_block{data, block_size});
+  arena->current = arena->blocks.size() - 1;
+  // malloc 返回的地址已满足任意基本类型的对齐要求。
+  arena->offset = size;
+  return data;
+}
+
+template <typename T>
+static T* aria2_arena_array(aria2_arena_t* arena, size_t count)
+{
+  return static_cast<T*>(
+      aria2_arena_alloc(arena, sizeof(T) * count, alignof(T)));
+}
+
+static char* aria2_arena_strdup(aria2_arena_t* arena, const std::string& value)
+{
+  char* out = aria2_arena_array<char>(arena, value.size() + 1);
+  if (!out) {
+    return nullptr;
+  }
+  if (!value.empty()) {
+    std::memcpy(out, value.data(), value.size());
+  }
+  out[value.size()] = '\0';
+  return out;
+}
+
+static int aria2_arena_copy_key_vals(aria2_arena_t* arena,
+                                     const aria2::KeyVals& options,
+                                     aria2_key_val_t** out_options,
+                                     size_t* out_options_count)
+{
+  if (!out_options || !out_options_count) {
+    return -1;
+  }
+  *out_options = nullptr;
+  *out_options_count = 0;
+  if (options.empty()) {
+    return 0;
+  }
+  auto* data = aria2_arena_array<aria2_key_val_t>(arena, options.size());
+  if (!data) {
+    return -1;
+  }
+  for (size_t i = 0; i < options.size(); ++i) {
+    data[i].key = aria2_arena_strdup(arena, options[i].first);
+    data[i].value = aria2_arena_strdup(arena, options[i].second);
+    if (!data[i].key || !data[i].value) {
+      return -1;
+    }
+  }
+  *out_options = data;
+  *out_options_count = options.size();
+  return 0;
+}
+
+static int aria2_arena_copy_file_data(aria2_arena_t* arena,
+                                      const aria2::FileData& file,
+                                      aria2_file_data_t* out_file)
+{
+  if (!out_file) {
+    return -1;
+  }
+  *out_file = aria2_file_data_t{};
+  out_file->index = file.index;
+  out_file->path = aria2_arena_strdup(arena, file.path);
+  out_file->length = file.length;
+  out_file->completed_length = file.completedLength;
+  out_file->selected = file.selected ? 1 : 0;
+  if (!out_file->path) {
+    return -1;
+  }
+  if (file.uris.empty()) {
+    return 0;
+  }
+  auto* uris = aria2_arena_array<aria2_uri_data_t>(arena, file.uris.size());
+  if (!uris) {
+    return -1;
+  }
+  for (size_t i = 0; i < file.uris.size(); ++i) {
+    uris[i].uri = aria2_arena_strdup(arena, file.uris[i].uri);
+    uris[i].status = static_cast<aria2_uri_status_t>(file.uris[i].status);
+    if (!uris[i].uri) {
+      return -1;
+    }
+  }
+  out_file->uris = uris;
+  out_file->uris_count = file.uris.size();
+  return 0;
+}
+
+static int aria2_arena_copy_file_data_vector(
+    aria2_arena_t* arena,
+    const std::vector<aria2::FileData>& files,
+    aria2_file_data_t** out_files,
+    size_t* out_files_count)
+{
+  if (!out_files || !out_files_count) {
+    return -1;
+  }
+  *out_files = nullptr;
+  *out_files_count = 0;
+  if (files.empty()) {
+    return 0;
+  }
+  auto* data = aria2_arena_array<aria2_file_data_t>(arena, files.size());
+  if (!data) {
+    return -1;
+  }
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (aria2_arena_copy_file_data(arena, files[i], &data[i]) != 0) {
+      return -1;
+    }
+  }
+  *out_files = data;
+  *out_files_count = files.size();
+  return 0;
+}
+
+static int aria2_arena_copy_string_list_array(
+    aria2_arena_t* arena,
+    const std::vector<std::vector<std::string>>& lists,
+    aria2_string_list_t** out_lists,
+    size_t* out_lists_count)
+{
+  if (!out_lists || !out_lists_count) {
+    return -1;
+  }
+  *out_lists = nullptr;
+  *out_lists_count = 0;
+  if (lists.empty()) {
+    return 0;
+  }
+  auto* data = aria2_arena_array<aria2_string_list_t>(arena, lists.size());
+  if (!data) {
+    return -1;
+  }
+  for (size_t i = 0; i < lists.size(); ++i) {
+    data[i].values = nullptr;
+    data[i].count = 0;
+    if (lists[i].empty()) {
+      continue;
+    }
+    data[i].values = aria2_arena_array<char*>(arena, lists[i].size());
+    if (!data[i].values) {
+      return -1;
+    }
+    for (size_t j = 0; j < lists[i].size(); ++j) {
+      data[i].values[j] = aria2_arena_strdup(arena, lists[i][j]);
+      if (!data[i].values[j]) {
+        return -1;
+      }
+    }
+    data[i].count = lists[i].size();
+  }
+  *out_lists = data;
+  *out_lists_count = lists.size();
+  return 0;
+}
+
+static void aria2_release_handle_core(aria2_session_t* session,
+                                      aria2_handle_core* core);
+
+// 使缓存中的句柄失效，已取得引用的调用者仍可继续使用。
+static void aria2_invalidate_handle(aria2_session_t* session, aria2::A2Gid gid)
+{
+  aria2_handle_core* core = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(session->handle_cache_mutex);
+    auto it = session->handle_cache.find(gid);
+    if (it == session->handle_cache.end()) {
+      return;
+    }
+    core = it->second;
+    session->handle_cache.erase(it);
+  }
+  aria2_release_handle_core(session, core);
+}
+
+static void aria2_digest_event(aria2_session_t* session,
+                               aria2::DownloadEvent event,
+                               aria2::A2Gid gid);
+static void aria2_memory_target_event(aria2_session_t* session,
+                                      aria2::DownloadEvent event,
+                                      aria2::A2Gid gid);
+static void aria2_sink_event(aria2_session_t* session,
+                             aria2::DownloadEvent event,
+                             aria2::A2Gid gid);
+
+static int aria2_download_event_callback_proxy(aria2::Session* session,
+                                               aria2::DownloadEvent event,
+                                               aria2::A2Gid gid,
+                                               void* userData)
+{
+  (void)session;
+  auto* ctx = static_cast<aria2_callback_ctx*>(userData);
+  if (!ctx) {
+    return 0;
+  }
+  aria2_change_feed_event(ctx->c_session, gid, aria2_event_status(event));
+  aria2_timings_event(ctx->c_session, event, gid);
+  aria2_trace_download_event(ctx->c_session, event, gid);
+  if (!ctx->c_session->active_digests.empty()) {
+    aria2_digest_event(ctx->c_session, event, gid);
+  }
+  if (!ctx->c_session->memory_targets.empty()) {
+    aria2_memory_target_event(ctx->c_session, event, gid);
+  }
+  if (!ctx->c_session->sinks.empty()) {
+    aria2_sink_event(ctx->c_session, event, gid);
+  }
+  if (ctx->c_session->event_queue) {
+    aria2_event_queue_push(ctx->c_session->event_queue, event, gid);
+  }
+  switch (event) {
+  case aria2::EVENT_ON_DOWNLOAD_STOP:
+  case aria2::EVENT_ON_DOWNLOAD_COMPLETE:
+  case aria2::EVENT_ON_DOWNLOAD_ERROR:
+    ctx->c_session->bitfields.erase(gid);
+    aria2_invalidate_handle(ctx->c_session, gid);
+    break;
+  default:
+    break;
+  }
+  if (!ctx->callback) {
+    return 0;
+  }
+  return ctx->callback(ctx->c_session,
+                       static_cast<aria2_download_event_t>(event),
+                       static_cast<aria2_gid_t>(gid),
+                       ctx->user_data);
+}
+
+void aria2_set_api_metrics_enabled(int enabled)
+{
+  ARIA2_API_SCOPE(aria2_set_api_metrics_enabled);
+#if !defined(ARIA2_C_API_NO_METRICS)
+  g_api_metrics_enabled.store(enabled != 0, std::memory_order_relaxed);
+#else
+  (void)enabled;
+#endif
+}
+
+int aria2_get_api_metrics(aria2_api_metric_t** metrics, size_t* metrics_count)
+{
+  ARIA2_API_SCOPE(aria2_get_api_metrics);
+  if (!metrics || !metrics_count) {
+    return -1;
+  }
+  static const char* const names[] = {
+#define ARIA2_API_NAME(name) #name,
+      ARIA2_API_TABLE(ARIA2_API_NAME)
+#undef ARIA2_API_NAME
+  };
+  auto* data = static_cast<aria2_api_metric_t*>(
+      std::calloc(ARIA2_API_COUNT, sizeof(aria2_api_metric_t)));
+  if (!data) {
+    return -1;
+  }
+  for (size_t i = 0; i < ARIA2_API_COUNT; ++i) {
+    data[i].name = names[i];
+#if !defined(ARIA2_C_API_NO_METRICS)
+    for (const aria2_api_shard& shard : g_api_shards) {
+      const aria2_api_counter& counter = shard.counters[i];
+      data[i].calls += counter.calls.load(std::memory_order_relaxed);
+      data[i].total_ns += counter.total_ns.load(std::memory_order_relaxed);
+      data[i].max_ns = std::max(
+          data[i].max_ns, counter.max_ns.load(std::memory_order_relaxed));
+      for (size_t b = 0; b < ARIA2_API_LATENCY_BUCKETS; ++b) {
+        data[i].buckets[b] +=
+            counter.buckets[b].load(std::memory_order_relaxed);
+      }
+    }
+#endif
+  }
+  *metrics = data;
+  *metrics_count = ARIA2_API_COUNT;
+  return 0;
+}
+
+void aria2_reset_api_metrics()
+{
+  ARIA2_API_SCOPE(aria2_reset_api_metrics);
+#if !defined(ARIA2_C_API_NO_METRICS)
+  for (aria2_api_shard& shard : g_api_shards) {
+    for (aria2_api_counter& counter : shard.counters) {
+      counter.calls.store(0, std::memory_order_relaxed);
+      counter.total_ns.store(0, std::memory_order_relaxed);
+      counter.max_ns.store(0, std::memory_order_relaxed);
+      for (auto& bucket : counter.buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+#endif
+}
+
+int aria2_library_init()
+{
+  ARIA2_API_SCOPE(aria2_library_init);
+  return aria2::libraryInit();
+}
+
+int aria2_library_deinit()
+{
+  ARIA2_API_SCOPE(aria2_library_deinit);
+  return aria2::libraryDeinit();
+}
+
+void aria2_session_config_init(aria2_session_config_t* config)
+{
+  ARIA2_API_SCOPE(aria2_session_config_init);
+  if (!config) {
+    return;
+  }
+  aria2::SessionConfig defaults;
+  config->keep_running = defaults.keepRunning ? 1 : 0;
+  config->use_signal_handler = defaults.useSignalHandler ? 1 : 0;
+  config->download_event_callback = nullptr;
+  config->user_data = nullptr;
+  config->enable_change_feed = 0;
+  config->threaded = 0;
+  config->event_queue_capacity = 0;
+  config->stats_interval_ms = 1000;
+  config->stats_capacity = 0;
+  config->enable_timings = 0;
+  config->trace_file = nullptr;
+  config->pin_loop_cpu = 0;
+  config->loop_cpu = 0;
+}
+
+static void aria2_session_release(aria2_session_t* c_session)
+{
+  aria2_notifier_close(&c_session->wake);
+  delete c_session->loop;
+  delete c_session->change_feed;
+  aria2_event_queue_delete(c_session->event_queue);
+  delete c_session->stats;
+  delete c_session->timings;
+  aria2_trace_close(c_session->trace);
+  for (auto& entry : c_session->memory_targets) {
+    std::free(entry.second.buffer.data);
+  }
+  for (aria2_download_handle_t* dh : c_session->handle_pool) {
+    delete dh;
+  }
+  std::free(c_session->callback_ctx);
+  delete c_session;
+}
+
+aria2_session_t* aria2_session_new(const aria2_key_val_t* options,
+                                   size_t options_count,
+                                   const aria2_session_config_t* config)
+{
+  ARIA2_API_SCOPE(aria2_session_new);
+  aria2::KeyVals cpp_options = aria2_to_key_vals(options, options_count);
+  aria2::SessionConfig cpp_config;
+
+  auto* c_session = new (std::nothrow) aria2_session_t();
+  if (!c_session) {
+    return nullptr;
+  }
+  // 没有可用的描述符时（Windows），唤醒和入队的命令最长等到 aria2 的
+  // 下一次迭代才生效。
+  aria2_notifier_open(&c_session->wake);
+  c_session->hook.fd = c_session->wake.read_fd;
+  c_session->hook.callback = aria2_wake_hook;
+  c_session->hook.userData = c_session;
+  c_session->hook.timeoutMs = -1;
+
+  if (config) {
+    cpp_config.keepRunning = config->keep_running != 0;
+    cpp_config.useSignalHandler = config->use_signal_handler != 0;
+    if (config->enable_change_feed) {
+      c_session->change_feed = new (std::nothrow) aria2_change_feed();
+      if (!c_session->change_feed) {
+        aria2_session_release(c_session);
+        return nullptr;
+      }
+    }
+    if (config->threaded) {
+      c_session->loop = new (std::nothrow) aria2_loop();
+      if (!c_session->loop) {
+        aria2_session_release(c_session);
+        return nullptr;
+      }
+      if (config->pin_loop_cpu) {
+        c_session->loop->cpu = config->loop_cpu;
+      }
+    }
+    if (config->event_queue_capacity) {
+      c_session->event_queue =
+          aria2_event_queue_new(config->event_queue_capacity);
+      if (!c_session->event_queue) {
+        aria2_session_release(c_session);
+        return nullptr;
+      }
+    }
+    if (config->stats_capacity) {
+      c_session->stats = new (std::nothrow) aria2_stats_ring();
+      if (!c_session->stats) {
+        aria2_session_release(c_session);
+        return nullptr;
+      }
+      try {
+        c_session->stats->samples.resize(config->stats_capacity);
+      }
+      catch (const std::bad_alloc&) {
+        aria2_session_release(c_session);
+        return nullptr;
+      }
+      c_session->stats->interval =
+          std::chrono::milliseconds(std::max(config->stats_interval_ms, 1));
+    }
+    if (config->enable_timings) {
+      c_session->timings = new (std::nothrow) aria2_timings();
+      if (!c_session->timings) {
+        aria2_session_release(c_session);
+        return nullptr;
+      }
+    }
+    if (config->trace_file) {
+      c_session->trace = aria2_trace_open(config->trace_file);
+      if (!c_session->trace) {
+        aria2_session_release(c_session);
+        return nullptr;
+      }
+    }
+  }
+
+  // 会话内部状态依赖下载事件，因此始终安装事件代理。
+  aria2_callback_ctx* ctx =
+      static_cast<aria2_callback_ctx*>(std::malloc(sizeof(*ctx)));
+  if (!ctx) {
+    aria2_session_release(c_session);
+    return nullptr;
+  }
+  ctx->callback = config ? config->download_event_callback : nullptr;
+  ctx->user_data = config ? config->user_data : nullptr;
+  ctx->c_session = c_session;
+  c_session->callback_ctx = ctx;
+  cpp_config.downloadEventCallback = aria2_download_event_callback_proxy;
+  cpp_config.userData = ctx;
+
+  aria2::Session* session = aria2::sessionNew(cpp_options, cpp_config);
+  if (!session) {
+    aria2_session_release(c_session);
+    return nullptr;
+  }
+  c_session->session = session;
+  // 启用 RPC 时全局选项可能在本 API 之外被修改，不缓存解析结果。
+  c_session->option_cache.enabled =
+      aria2::getGlobalOption(session, "enable-rpc") != "true";
+  if (c_session->loop) {
+    try {
+      c_session->loop->thread = std::thread(aria2_loop_main, c_session);
+    }
+    catch (const std::system_error&) {
+      aria2::sessionFinal(session);
+      aria2_session_release(c_session);
+      return nullptr;
+    }
+  }
+  return c_session;
+}
+
+int aria2_session_final(aria2_session_t* session)
+{
+  ARIA2_API_SCOPE(aria2_session_final);
+  if (!session) {
+    return 0;
+  }
+  // 未释放的共享句柄在会话释放后无法再释放。
+  if (session->handle_holders.load() != 0) {
+    return -1;
+  }
+  if (aria2_loop* loop = session->loop) {
+    // 事件循环线程无法等待自身退出。
+    if (loop->owner.load() == std::this_thread::get_id()) {
+      return -1;
+    }
+    // 此后其他线程的调用失败返回，已入队的命令在下面执行完。
+    loop->closing.store(true);
+    while (loop->pushers.load() != 0) {
+      std::this_thread::yield();
+    }
+    {
+      std::lock_guard<std::mutex> lock(loop->mutex);
+      loop->stop.store(true);
+      loop->cond.notify_one();
+    }
+    loop->thread.join();
+    // 事件循环已退出，剩余命令在当前线程上执行。
+    loop->owner.store(std::this_thread::get_id());
+    aria2_loop_drain(loop);
+  }
+  // 句柄必须在 sessionFinal 之前释放。
+  std::unordered_map<aria2::A2Gid, aria2_handle_core*> handles;
+  {
+    std::lock_guard<std::mutex> lock(session->handle_cache_mutex);
+    handles.swap(session->handle_cache);
+  }
+  for (auto& entry : handles) {
+    aria2_release_handle_core(session, entry.second);
+  }
+  int result = aria2::sessionFinal(session->session);
+  aria2_session_release(session);
+  return result;
+}
+
+int aria2_run(aria2_session_t* session, aria2_run_mode_t mode)
+{
+  ARIA2_API_SCOPE(aria2_run);
+  if (!session || session->loop) {
+    return -1;
+  }
+  if (mode == ARIA2_RUN_ONCE) {
+    return aria2_run_once(session);
+  }
+  if (session->stats || session->timings || session->trace ||
+      !session->active_digests.empty() || !session->sinks.empty() ||
+      (!session->range_watches.empty() && session->hook.fd == -1)) {
+    // 统计、阶段耗时、跟踪、摘要补算、接收回调和区间等待需要在每次迭代后
+    // 处理，逐次运行直到结束。有唤醒钩子时区间等待在 aria2 内部检查。
+    int rv;
+    while ((rv = aria2_run_once(session)) == 1) {
+    }
+    return rv;
+  }
+  // 恢复 aria2 默认的等待时间。
+  aria2_install_wake_hook(session, -1);
+  return aria2::run(session->session, static_cast<aria2::RUN_MODE>(mode));
+}
+
+// 距 deadline 的毫秒数，向上取整，已到期时为 0。
+static int aria2_remaining_ms(std::chrono::steady_clock::time_point deadline)
+{
+  auto remaining = deadline - std::chrono::steady_clock::now();
+  if (remaining <= std::chrono::steady_clock::duration::zero()) {
+    return 0;
+  }
+  auto ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count();
+  if (std::chrono::milliseconds(ms) < remaining) {
+    ++ms;
+  }
+  return static_cast<int>(std::min<int64_t>(ms, 1000));
+}
+
+int aria2_run_for(aria2_session_t* session, int timeout_ms)
+{
+  ARIA2_API_SCOPE(aria2_run_for);
+  if (!session || session->loop) {
+    return -1;
+  }
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(std::max(timeout_ms, 0));
+  for (;;) {
+    int rv = aria2_run_once(session, aria2_remaining_ms(deadline));
+    if (rv != 1) {
+      return rv;
+    }
+    if (session->wakeup.exchange(false) ||
+        std::chrono::steady_clock::now() >= deadline) {
+      return 1;
+    }
+  }
+}
+
+int aria2_run_with_tick(aria2_session_t* session,
+                        int interval_ms,
+                        aria2_tick_callback callback,
+                        void* user_data)
+{
+  ARIA2_API_SCOPE(aria2_run_with_tick);
+  if (!session || session->loop || !callback) {
+    return -1;
+  }
+  auto interval = std::chrono::milliseconds(std::max(interval_ms, 1));
+  auto next_tick = std::chrono::steady_clock::now() + interval;
+  for (;;) {
+    int rv = aria2_run_once(session, aria2_remaining_ms(next_tick));
+    if (rv != 1) {
+      return rv;
+    }
+    if (session->wakeup.exchange(false)) {
+      return 1;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now >= next_tick) {
+      // 落后多个周期时不补发，保持固定的节拍。
+      while (next_tick <= now) {
+        next_tick += interval;
+      }
+      if (callback(session, user_data) != 0) {
+        return 1;
+      }
+    }
+  }
+}
+
+void aria2_wakeup(aria2_session_t* session)
+{
+  ARIA2_API_SCOPE(aria2_wakeup);
+  if (!session) {
+    return;
+  }
+  session->wakeup.store(true);
+  aria2_notifier_signal(&session->wake);
+}
+
+int aria2_session_get_event_fd(aria2_session_t* session)
+{
+  ARIA2_API_SCOPE(aria2_session_get_event_fd);
+  if (!session || !session->event_queue) {
+    return -1;
+  }
+  return session->event_queue->notifier.read_fd;
+}
+
+size_t aria2_drain_events(aria2_session_t* session,
+                          aria2_event_t* events,
+                          size_t capacity)
+{
+  ARIA2_API_SCOPE(aria2_drain_events);
+  if (!session || !session->event_queue || !events) {
+    return 0;
+  }
+  aria2_event_queue* queue = session->event_queue;
+  aria2_notifier_clear(&queue->notifier);
+  size_t head = queue->head.load(std::memory_order_relaxed);
+  size_t tail = queue->tail.load(std::memory_order_acquire);
+  size_t available = tail - head;
+  size_t count = std::min(available, capacity);
+  for (size_t i = 0; i < count; ++i) {
+    events[i] = queue->ring[(head + i) & queue->mask];
+  }
+  queue->head.store(head + count, std::memory_order_release);
+  if (count < available) {
+    // 还有未取出的事件，保持描述符可读。
+    aria2_notifier_signal(&queue->notifier);
+  }
+  return count;
+}
+
+uint64_t aria2_get_dropped_event_count(aria2_session_t* session)
+{
+  ARIA2_API_SCOPE(aria2_get_dropped_event_count);
+  if (!session || !session->event_queue) {
+    return 0;
+  }
+  return session->event_queue->dropped.load(std::memory_order_relaxed);
+}
+
+int aria2_session_post(aria2_session_t* session,
+                       aria2_session_task_t task,
+                       void* user_data)
+{
+  ARIA2_API_SCOPE(aria2_session_post);
+  if (!session || !task) {
+    return -1;
+  }
+  if (!session->loop) {
+    task(session, user_data);
+    return 0;
+  }
+  auto* command = new (std::nothrow) aria2_task_command();
+  if (!command) {
+    return -1;
+  }
+  command->run = &aria2_task_command::invoke;
+  command->task = task;
+  command->session = session;
+  command->user_data = user_data;
+  if (!aria2_loop_push(session, command)) {
+    delete command;
+    return -1;
+  }
+  return 0;
+}
+
+char* aria2_gid_to_hex(aria2_gid_t gid)
+{
+  ARIA2_API_SCOPE(aria2_gid_to_hex);
+  return aria2_strdup(aria2::gidToHex(static_cast<aria2::A2Gid>(gid)));
+}
+
+aria2_gid_t aria2_hex_to_gid(const char* hex)
+{
+  ARIA2_API_SCOPE(aria2_hex_to_gid);
+  if (!hex) {
+    return static_cast<aria2_gid_t>(aria2::A2Gid());
+  }
+  return static_cast<aria2_gid_t>(aria2::hexToGid(hex));
+}
+
+// 把 gid 编码为 16 个小写十六进制字符，不写入结尾的 '\0'。
+static void aria2_encode_gid_hex(uint64_t gid, char* out)
+{
+#if defined(__SSE2__)
+  uint64_t be = __builtin_bswap64(gid);
+  __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&be));
+  __m128i mask = _mm_set1_epi8(0x0f);
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+  __m128i lo = _mm_and_si128(bytes, mask);
+  __m128i nibbles = _mm_unpacklo_epi8(hi, lo);
+  // '0' + n，大于 9 时再加上 'a' - '0' - 10。
+  __m128i letters =
+      _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)),
+                    _mm_set1_epi8('a' - '0' - 10));
+  __m128i ascii =
+      _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out), ascii);
+#else
+  static const char digits[] = "0123456789abcdef";
+  for (int i = 15; i >= 0; --i) {
+    out[i] = digits[gid & 0x0f];
+    gid >>= 4;
+  }
+#endif
+}
+
+// 解码恰好 16 个十六进制字符，含非法字符时返回 false。
+static bool aria2_decode_gid_hex(const char* hex, uint64_t* gid)
+{
+#if defined(__SSE2__)
+  __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hex));
+  __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                   _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+  __m128i is_alpha =
+      _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                    _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+  if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff) {
+    return false;
+  }
+  __m128i nibbles = _mm_or_si128(
+      _mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+      _mm_andnot_si128(is_digit,
+                       _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+  // 每个 16 位通道的低字节是高半字节，高字节是低半字节。
+  __m128i hi = _mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0xff)), 4);
+  __m128i lo = _mm_srli_epi16(nibbles, 8);
+  __m128i bytes = _mm_packus_epi16(_mm_or_si128(hi, lo), _mm_setzero_si128());
+  uint64_t be;
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(&be), bytes);
+  *gid = __builtin_bswap64(be);
+  return true;
+#else
+  uint64_t value = 0;
+  for (int i = 0; i < 16; ++i) {
+    unsigned char ch = static_cast<unsigned char>(hex[i]);
+    unsigned int digit;
+    if (ch >= '0' && ch <= '9') {
+      digit = ch - '0';
+    }
+    else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f') {
+      digit = (ch | 0x20) - 'a' + 10;
+    }
+    else {
+      return false;
+    }
+    value = (value << 4) | digit;
+  }
+  *gid = value;
+  return true;
+#endif
+}
+
+int aria2_gid_to_hex_buf(aria2_gid_t gid, char out[17])
+{
+  ARIA2_API_SCOPE(aria2_gid_to_hex_buf);
+  if (!out) {
+    return -1;
+  }
+  aria2_encode_gid_hex(gid, out);
+  out[16] = '\0';
+  return 0;
+}
+
+int aria2_gids_to_hex_batch(const aria2_gid_t* gids, size_t count, char* out)
+{
+  ARIA2_API_SCOPE(aria2_gids_to_hex_batch);
+  if ((!gids || !out) && count) {
+    return -1;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    aria2_encode_gid_hex(gids[i], out + i * 17);
+    out[i * 17 + 16] = '\0';
+  }
+  return 0;
+}
+
+int aria2_hex_to_gids_batch(const char* const* hex,
+                            size_t count,
+                            aria2_gid_t* out)
+{
+  ARIA2_API_SCOPE(aria2_hex_to_gids_batch);
+  if ((!hex || !out) && count) {
+    return -1;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t gid;
+    // 先确认长度，避免 16 字节加载越过较短字符串的结尾。
+    if (!hex[i] || strnlen(hex[i], 17) != 16 ||
+        !aria2_decode_gid_hex(hex[i], &gid)) {
+      gid = 0;
+    }
+    out[i] = gid;
+  }
+  return 0;
+}
+
+int aria2_is_null(aria2_gid_t gid)
+{
+  ARIA2_API_SCOPE(aria2_is_null);
+  return aria2::isNull(static_cast<aria2::A2Gid>(gid)) ? 1 : 0;
+}
+
+static bool aria2_is_valid_option_name(const char* name)
+{
+  if (!name || !*name) {
+    return false;
+  }
+  for (const char* p = name; *p; ++p) {
+    if (!((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9') ||
+          *p == '-')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+aria2_option_set_t* aria2_option_set_new()
+{
+  ARIA2_API_SCOPE(aria2_option_set_new);
+  return new (std::nothrow) aria2_option_set_t();
+}
+
+int aria2_option_set_set(aria2_option_set_t* option_set,
+                         const char* key,
+                         const char* value)
+{
+  ARIA2_API_SCOPE(aria2_option_set_set);
+  if (!option_set || !aria2_is_valid_option_name(key) || !value) {
+    return -1;
+  }
+  try {
+    for (auto& option : option_set->options) {
+      if (option.first == key) {
+        option.second = value;
+        return 0;
+      }
+    }
+    option_set->options.emplace_back(key, value);
+  }
+  catch (const std::bad_alloc&) {
+    return -1;
+  }
+  return 0;
+}
+
+void aria2_option_set_free(aria2_option_set_t* option_set)
+{
+  ARIA2_API_SCOPE(aria2_option_set_free);
+  delete option_set;
+}
+
+int aria2_option_set_prefix_first(aria2_option_set_t* option_set,
+                                  int64_t head_bytes)
+{
+  ARIA2_API_SCOPE(aria2_option_set_prefix_first);
+  if (!option_set) {
+    return -1;
+  }
+  try {
+    std::string head = "head";
+    if (head_bytes > 0) {
+      head += "=" + std::to_string(head_bytes);
+    }
+    const std::pair<const char*, std::string> values[] = {
+        {"stream-piece-selector", "inorder"}, {"bt-prioritize-piece", head}};
+    for (const auto& value : values) {
+      auto it = std::find_if(
+          option_set->options.begin(), option_set->options.end(),
+          [&](const std::pair<std::string, std::string>& option) {
+            return option.first == value.first;
+          });
+      if (it != option_set->options.end()) {
+        it->second = value.second;
+      }
+      else {
+        option_set->options.emplace_back(value.first, value.second);
+      }
+    }
+  }
+  catch (const std::bad_alloc&) {
+    return -1;
+  }
+  return 0;
+}
+
+int aria2_option_set_set_sink(aria2_option_set_t* option_set,
+                              const aria2_sink_t* sink)
+{
+  ARIA2_API_SCOPE(aria2_option_set_set_sink);
+  if (!option_set || (sink && (!sink->callback || sink->max_backlog < 0 ||
+                                option_set->memory_target > 0))) {
+    return -1;
+  }
+  option_set->sink = sink ? *sink : aria2_sink_t{};
+  return 0;
+}
+
+int aria2_option_set_set_memory_target(aria2_option_set_t* option_set,
+                                       int64_t max_bytes)
+{
+  ARIA2_API_SCOPE(aria2_option_set_set_memory_target);
+  if (!option_set || max_bytes < 0 ||
+      (max_bytes > 0 && option_set->sink.callback)) {
+    return -1;
+  }
+  option_set->memory_target = max_bytes;
+  return 0;
+}
+
+int aria2_option_set_set_digests(aria2_option_set_t* option_set, int types)
+{
+  ARIA2_API_SCOPE(aria2_option_set_set_digests);
+  const int all =
+      ARIA2_DIGEST_SHA1 | ARIA2_DIGEST_SHA256 | ARIA2_DIGEST_XXH64;
+  if (!option_set || (types & ~all)) {
+    return -1;
+  }
+  option_set->digests = types;
+  return 0;
+}
+
+static int aria2_attach_data_writer(aria2_session_t* session,
+                                    aria2::A2Gid gid,
+                                    const aria2_option_set_t* option_set);
+
+// 添加下载并按选项集合安装数据写入器，安装失败时移除刚添加的下载。
+static int aria2_add_uri_locked(aria2_session_t* session,
+                                aria2::A2Gid* gid,
+                                const std::vector<std::string>& uris,
+                                const aria2::KeyVals& options,
+                                const aria2_option_set_t* option_set,
+                                int position)
+{
+  int result = aria2::addUri(session->session, gid, uris, options, position);
+  if (result == 0 &&
+      aria2_attach_data_writer(session, *gid, option_set) != 0) {
+    aria2::removeDownload(session->session, *gid, true);
+    *gid = 0;
+    result = -1;
+  }
+  if (result == 0) {
+    aria2_download_added(session, *gid);
+  }
+  return result;
+}
+
+static int aria2_add_uri_cpp(aria2_session_t* session,
+                             aria2_gid_t* gid,
+                             const std::vector<std::string>& uris,
+                             const aria2::KeyVals& options,
+                             const aria2_option_set_t* option_set,
+                             int position)
+{
+  return aria2_session_call(session, [&]() -> int {
+    aria2::A2Gid cpp_gid{};
+    int result = aria2_add_uri_locked(session, &cpp_gid, uris, options,
+                                      option_set, position);
+    if (gid) {
+      *gid = static_cast<aria2_gid_t>(cpp_gid);
+    }
+    return result;
+  });
+}
+
+int aria2_add_uri(aria2_session_t* session,
+                  aria2_gid_t* gid,
+                  const char** uris,
+                  size_t uris_count,
+                  const aria2_key_val_t* options,
+                  size_t options_count,
+                  int position)
+{
+  ARIA2_API_SCOPE(aria2_add_uri);
+  if (!session) {
+    return -1;
+  }
+  return aria2_add_uri_cpp(session, gid,
+                           aria2_to_string_vector(uris, uris_count),
+                           aria2_to_key_vals(options, options_count), nullptr,
+                           position);
+}
+
+int aria2_add_uri_with_option_set(aria2_session_t* session,
+                                  aria2_gid_t* gid,
+                                  const char** uris,
+                                  size_t uris_count,
+                                  const aria2_option_set_t* option_set,
+                                  int position)
+{
+  ARIA2_API_SCOPE(aria2_add_uri_with_option_set);
+  if (!session || !option_set) {
+    return -1;
+  }
+  return aria2_add_uri_cpp(session, gid,
+                           aria2_to_string_vector(uris, uris_count),
+                           option_set->options, option_set, position);
+}
+
+int aria2_add_uri_batch(aria2_session_t* session,
+                        const aria2_uri_job_t* jobs,
+                        size_t jobs_count,
+                        aria2_gid_t* out_gids,
+                        int* out_results)
+{
+  ARIA2_API_SCOPE(aria2_add_uri_batch);
+  if (!session || (!jobs && jobs_count)) {
+    return -1;
+  }
+  // 在调用线程上完成所有转换，相同的选项数组只转换一次，
+  // 然后在事件循环上一次性插入队列。
+  std::vector<std::vector<std::string>> cpp_uris(jobs_count);
+  std::vector<aria2::KeyVals> cpp_options;
+  std::vector<size_t> option_index(jobs_count);
+  std::unordered_map<const aria2_key_val_t*, size_t> option_cache;
+  for (size_t i = 0; i < jobs_count; ++i) {
+    cpp_uris[i] = aria2_to_string_vector(jobs[i].uris, jobs[i].uris_count);
+    if (jobs[i].option_set) {
+      continue;
+    }
+    const aria2_key_val_t* options =
+        jobs[i].options_count ? jobs[i].options : nullptr;
+    auto it = option_cache.find(options);
+    if (it != option_cache.end() &&
+        jobs[i].options_count == cpp_options[it->second].size()) {
+      option_index[i] = it->second;
+      continue;
+    }
+    option_index[i] = cpp_options.size();
+    option_cache[options] = cpp_options.size();
+    cpp_options.push_back(
+        aria2_to_key_vals(jobs[i].options, jobs[i].options_count));
+  }
+  return aria2_session_call(session, [&]() -> int {
+    int failed = 0;
+    for (size_t i = 0; i < jobs_count; ++i) {
+      aria2::A2Gid cpp_gid{};
+      const aria2::KeyVals& options =
+          jobs[i].option_set ? jobs[i].option_set->options
+                             : cpp_options[option_index[i]];
+      int result =
+          aria2_add_uri_locked(session, &cpp_gid, cpp_uris[i], options,
+                               jobs[i].option_set, jobs[i].position);
+      if (result != 0) {
+        ++failed;
+      }
+      if (out_gids) {
+        out_gids[i] = static_cast<aria2_gid_t>(cpp_gid);
+      }
+      if (out_results) {
+        out_results[i] = result;
+      }
+    }
+    return failed ? -1 : 0;
+  });
+}
+
+int aria2_add_metalink(aria2_session_t* session,
+                       aria2_gid_t** gids,
+                             size_t* gids_count,
+                             const char* metalink_file,
+                             const aria2_key_val_t* options,
+                             size_t options_count,
+                             int position)
+{
+  ARIA2_API_SCOPE(aria2_add_metalink);
+  if (!session) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    auto cpp_options = aria2_to_key_vals(options, options_count);
+    std::vector<aria2::A2Gid> cpp_gids;
+    std::vector<aria2::A2Gid>* cpp_gids_ptr = nullptr;
+    if ((gids && gids_count) || session->change_feed || session->timings ||
+        session->trace) {
+      cpp_gids_ptr = &cpp_gids;
+    }
+    int result = aria2::addMetalink(
+        session->session, cpp_gids_ptr,
+        metalink_file ? metalink_file : "", cpp_options, position);
+    if (result == 0) {
+      for (aria2::A2Gid added : cpp_gids) {
+        aria2_download_added(session, added);
+      }
+    }
+    if (result == 0 && gids && gids_count) {
+      if (aria2_copy_gid_vector(cpp_gids, gids, gids_count) != 0) {
+        return -1;
+      }
+    }
+    return result;
+  });
+}
+
+static int aria2_add_torrent_cpp(aria2_session_t* session,
+                                 aria2_gid_t* gid,
+                                 const char* torrent_file,
+                                 const std::vector<std::string>& webseed_uris,
+                                 const aria2::KeyVals& options,
+                                 int position)
+{
+  return aria2_session_call(session, [&]() -> int {
+    aria2::A2Gid cpp_gid{};
+    int result = aria2::addTorrent(
+        session->session, &cpp_gid,
+        torrent_file ? torrent_file : "", webseed_uris, options, position);
+    if (result == 0) {
+      aria2_download_added(session, cpp_gid);
+    }
+    if (gid) {
+      *gid = static_cast<aria2_gid_t>(cpp_gid);
+    }
+    return result;
+  });
+}
+
+int aria2_add_torrent(aria2_session_t* session,
+                      aria2_gid_t* gid,
+                      const char* torrent_file,
+                      const char** webseed_uris,
+                      size_t webseed_uris_count,
+                      const aria2_key_val_t* options,
+                      size_t options_count,
+                      int position)
+{
+  ARIA2_API_SCOPE(aria2_add_torrent);
+  if (!session) {
+    return -1;
+  }
+  return aria2_add_torrent_cpp(
+      session, gid, torrent_file,
+      aria2_to_string_vector(webseed_uris, webseed_uris_count),
+      aria2_to_key_vals(options, options_count), position);
+}
+
+int aria2_add_torrent_with_option_set(aria2_session_t* session,
+                                      aria2_gid_t* gid,
+                                      const char* torrent_file,
+                                      const char** webseed_uris,
+                                      size_t webseed_uris_count,
+                                      const aria2_option_set_t* option_set,
+                                      int position)
+{
+  ARIA2_API_SCOPE(aria2_add_torrent_with_option_set);
+  // 接收回调、内存目标和摘要只用于单文件的 URI 下载。
+  if (!session || !option_set || option_set->sink.callback ||
+      option_set->memory_target > 0 || option_set->digests) {
+    return -1;
+  }
+  return aria2_add_torrent_cpp(
+      session, gid, torrent_file,
+      aria2_to_string_vector(webseed_uris, webseed_uris_count),
+      option_set->options, position);
+}
+
+int aria2_add_torrent_simple(aria2_session_t* session,
+                             aria2_gid_t* gid,
+                                   const char* torrent_file,
+                                   const aria2_key_val_t* options,
+                                   size_t options_count,
+                                   int position)
+{
+  ARIA2_API_SCOPE(aria2_add_torrent_simple);
+  if (!session) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    auto cpp_options = aria2_to_key_vals(options, options_count);
+    aria2::A2Gid cpp_gid{};
+    int result = aria2::addTorrent(session->session, &cpp_gid,
+                                   torrent_file ? torrent_file : "", cpp_options,
+                                   position);
+    if (result == 0) {
+      aria2_download_added(session, cpp_gid);
+    }
+    if (gid) {
+      *gid = static_cast<aria2_gid_t>(cpp_gid);
+    }
+    return result;
+  });
+}
+
+int aria2_get_active_download(aria2_session_t* session,
+                              aria2_gid_t** gids,
+                                    size_t* gids_count)
+{
+  ARIA2_API_SCOPE(aria2_get_active_download);
+  if (!session) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    auto cpp_gids = aria2::getActiveDownload(session->session);
+    return aria2_copy_gid_vector(cpp_gids, gids, gids_count);
+  });
+}
+
+static size_t aria2_align_up(size_t value, size_t alignment)
+{
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+int aria2_get_status_snapshot(aria2_session_t* session,
+                              const aria2_gid_t* gids,
+                              size_t gids_count,
+                              unsigned int fields,
+                              aria2_status_snapshot_t* snapshot)
+{
+  ARIA2_API_SCOPE(aria2_get_status_snapshot);
+  if (!session || !snapshot) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    *snapshot = aria2_status_snapshot_t{};
+    fields &= ARIA2_SNAPSHOT_ALL;
+    snapshot->fields = fields;
+
+    std::vector<aria2::A2Gid> active;
+    if (!gids) {
+      active = aria2::getActiveDownload(session->session);
+      gids_count = active.size();
+    }
+    if (gids_count == 0) {
+      return 0;
+    }
+
+    // 所有数组按对齐要求从大到小排列在同一块内存中。
+    size_t n = gids_count;
+    size_t size = sizeof(aria2_gid_t) * n;
+    size_t total_off = size;
+    if (fields & ARIA2_SNAPSHOT_TOTAL_LENGTH) {
+      size += sizeof(int64_t) * n;
+    }
+    size_t completed_off = size;
+    if (fields & ARIA2_SNAPSHOT_COMPLETED_LENGTH) {
+      size += sizeof(int64_t) * n;
+    }
+    size = aria2_align_up(size, alignof(aria2_download_status_t));
+    size_t status_off = size;
+    if (fields & ARIA2_SNAPSHOT_STATUS) {
+      size += sizeof(aria2_download_status_t) * n;
+    }
+    size = aria2_align_up(size, alignof(int));
+    size_t int_off = size;
+    size_t int_fields = 0;
+    for (unsigned int f : {ARIA2_SNAPSHOT_DOWNLOAD_SPEED,
+                           ARIA2_SNAPSHOT_UPLOAD_SPEED,
+                           ARIA2_SNAPSHOT_CONNECTIONS,
+                           ARIA2_SNAPSHOT_ERROR_CODE}) {
+      if (fields & f) {
+        ++int_fields;
+      }
+    }
+    size += sizeof(int) * n * int_fields;
+
+    auto* block = static_cast<uint8_t*>(std::malloc(size));
+    if (!block) {
+      return -1;
+    }
+    snapshot->gids = reinterpret_cast<aria2_gid_t*>(block);
+    if (fields & ARIA2_SNAPSHOT_TOTAL_LENGTH) {
+      snapshot->total_length = reinterpret_cast<int64_t*>(block + total_off);
+    }
+    if (fields & ARIA2_SNAPSHOT_COMPLETED_LENGTH) {
+      snapshot->completed_length =
+          reinterpret_cast<int64_t*>(block + completed_off);
+    }
+    if (fields & ARIA2_SNAPSHOT_STATUS) {
+      snapshot->status =
+          reinterpret_cast<aria2_download_status_t*>(block + status_off);
+    }
+    int* next_int = reinterpret_cast<int*>(block + int_off);
+    if (fields & ARIA2_SNAPSHOT_DOWNLOAD_SPEED) {
+      snapshot->download_speed = next_int;
+      next_int += n;
+    }
+    if (fields & ARIA2_SNAPSHOT_UPLOAD_SPEED) {
+      snapshot->upload_speed = next_int;
+      next_int += n;
+    }
+    if (fields & ARIA2_SNAPSHOT_CONNECTIONS) {
+      snapshot->connections = next_int;
+      next_int += n;
+    }
+    if (fields & ARIA2_SNAPSHOT_ERROR_CODE) {
+      snapshot->error_code = next_int;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+      aria2::A2Gid gid =
+          gids ? static_cast<aria2::A2Gid>(gids[i]) : active[i];
+      aria2::DownloadHandle* handle =
+          aria2::getDownloadHandle(session->session, gid);
+      if (!handle) {
+        continue;
+      }
+      snapshot->gids[count] = static_cast<aria2_gid_t>(gid);
+      if (snapshot->status) {
+        snapshot->status[count] =
+            static_cast<aria2_download_status_t>(handle->getStatus());
+      }
+      if (snapshot->total_length) {
+        snapshot->total_length[count] = handle->getTotalLength();
+      }
+      if (snapshot->completed_length) {
+        snapshot->completed_length[count] = handle->getCompletedLength();
+      }
+      if (snapshot->download_speed) {
+        snapshot->download_speed[count] = handle->getDownloadSpeed();
+      }
+      if (snapshot->upload_speed) {
+        snapshot->upload_speed[count] = handle->getUploadSpeed();
+      }
+      if (snapshot->connections) {
+        snapshot->connections[count] = handle->getConnections();
+      }
+      if (snapshot->error_code) {
+        snapshot->error_code[count] = handle->getErrorCode();
+      }
+      aria2::deleteDownloadHandle(handle);
+      ++count;
+    }
+    snapshot->count = count;
+    return 0;
+  });
+}
+
+uint64_t aria2_register_change_poller(aria2_session_t* session)
+{
+  ARIA2_API_SCOPE(aria2_register_change_poller);
+  if (!session || !session->change_feed) {
+    return 0;
+  }
+  return aria2_session_call(session, [&]() -> uint64_t {
+    aria2_change_feed* feed = session->change_feed;
+    uint64_t poller = ++feed->next_poller;
+    try {
+      feed->pollers[poller] =
+          aria2_change_poller{0, std::chrono::steady_clock::now()};
+    }
+    catch (const std::bad_alloc&) {
+      return 0;
+    }
+    return poller;
+  });
+}
+
+int aria2_unregister_change_poller(aria2_session_t* session, uint64_t poller)
+{
+  ARIA2_API_SCOPE(aria2_unregister_change_poller);
+  if (!session || !session->change_feed) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    if (session->change_feed->pollers.erase(poller) == 0) {
+      return -1;
+    }
+    aria2_change_feed_collect(session);
+    return 0;
+  });
+}
+
+int aria2_poll_changes(aria2_session_t* session,
+                       uint64_t poller,
+                       aria2_change_t* changes,
+                       size_t capacity,
+                       size_t* changes_count)
+{
+  ARIA2_API_SCOPE(aria2_poll_changes);
+  if (!session || !session->change_feed || !changes_count ||
+      (!changes && capacity)) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    aria2_change_feed* feed = session->change_feed;
+    *changes_count = 0;
+    auto poller_it = feed->pollers.find(poller);
+    if (poller_it == feed->pollers.end()) {
+      return -1;
+    }
+    uint64_t& cursor = poller_it->second.cursor;
+
+    // 状态变化由事件和 API 调用记录，这里只需一次取得全部活动下载的
+    // 进度，不为每个下载创建句柄。
+    try {
+      aria2::getActiveProgress(session->session, feed->progress);
+    }
+    catch (const std::bad_alloc&) {
+      return -1;
+    }
+    for (const aria2::DownloadProgress& progress : feed->progress) {
+      aria2_change_feed_update(feed, progress.gid, ARIA2_DOWNLOAD_ACTIVE,
+                               progress.completedLength,
+                               progress.downloadSpeed);
+    }
+
+    // 游标早于已删除的记录时，其间被 aria2 清除的下载已无法返回。
+    int result = cursor && cursor < feed->floor ? 1 : 0;
+    auto it = std::upper_bound(
+        feed->log.begin(), feed->log.end(),
+        std::make_pair(cursor, ~static_cast<aria2::A2Gid>(0)));
+    size_t count = 0;
+    uint64_t last = cursor;
+    for (; it != feed->log.end(); ++it) {
+      auto record_it = feed->records.find(it->second);
+      if (record_it == feed->records.end() ||
+          record_it->second.version != it->first) {
+        continue;
+      }
+      const aria2_change_record& record = record_it->second;
+      if (count == capacity) {
+        break;
+      }
+      aria2_change_t& change = changes[count++];
+      change.gid = static_cast<aria2_gid_t>(it->second);
+      change.status = record.status;
+      change.completed_length = record.completed_length;
+      change.download_speed = record.download_speed;
+      change.version = record.version;
+      last = record.version;
+    }
+    cursor = it == feed->log.end() ? feed->version : last;
+    poller_it->second.last_poll = std::chrono::steady_clock::now();
+    *changes_count = count;
+    aria2_change_feed_collect(session);
+    return result;
+  });
+}
+
+int aria2_remove_download(aria2_session_t* session,
+                          aria2_gid_t gid,
+                                int force)
+{
+  ARIA2_API_SCOPE(aria2_remove_download);
+  if (!session) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    int result = aria2::removeDownload(session->session,
+                                       static_cast<aria2::A2Gid>(gid),
+                                       force != 0);
+    if (result == 0) {
+      aria2_change_feed_touch(session, static_cast<aria2::A2Gid>(gid),
+                              ARIA2_DOWNLOAD_REMOVED);
+      aria2_invalidate_handle(session, static_cast<aria2::A2Gid>(gid));
+    }
+    return result;
+  });
+}
+
+int aria2_pause_download(aria2_session_t* session,
+                         aria2_gid_t gid,
+                               int force)
+{
+  ARIA2_API_SCOPE(aria2_pause_download);
+  if (!session) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    int result = aria2::pauseDownload(session->session,
+                                      static_cast<aria2::A2Gid>(gid),
+                                      force != 0);
+    if (result == 0) {
+      aria2_change_feed_touch(session, static_cast<aria2::A2Gid>(gid),
+                              ARIA2_DOWNLOAD_PAUSED);
+    }
+    return result;
+  });
+}
+
+int aria2_unpause_download(aria2_session_t* session,
+                           aria2_gid_t gid)
+{
+  ARIA2_API_SCOPE(aria2_unpause_download);
+  if (!session) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    int result = aria2::unpauseDownload(session->session,
+                                        static_cast<aria2::A2Gid>(gid));
+    if (result == 0) {
+      aria2_change_feed_touch(session, static_cast<aria2::A2Gid>(gid),
+                              ARIA2_DOWNLOAD_WAITING);
+      aria2_trace_phase(session, static_cast<aria2::A2Gid>(gid), "waiting");
+    }
+    return result;
+  });
+}
+
+static int aria2_change_option_cpp(aria2_session_t* session,
+                                   aria2_gid_t gid,
+                                   const aria2::KeyVals& options)
+{
+  return aria2_session_call(session, [&]() -> int {
+    return aria2::changeOption(session->session,
+                               static_cast<aria2::A2Gid>(gid), options);
+  });
+}
+
+int aria2_change_option(aria2_session_t* session,
+                        aria2_gid_t gid,
+                        const aria2_key_val_t* options,
+                        size_t options_count)
+{
+  ARIA2_API_SCOPE(aria2_change_option);
+  if (!session) {
+    return -1;
+  }
+  return aria2_change_option_cpp(session, gid,
+                                 aria2_to_key_vals(options, options_count));
+}
+
+int aria2_change_option_with_option_set(aria2_session_t* session,
+                                        aria2_gid_t gid,
+                                        const aria2_option_set_t* option_set)
+{
+  ARIA2_API_SCOPE(aria2_change_option_with_option_set);
+  if (!session || !option_set) {
+    return -1;
+  }
+  return aria2_change_option_cpp(session, gid, option_set->options);
+}
+
+char* aria2_get_global_option(aria2_session_t* session, const char* name)
+{
+  ARIA2_API_SCOPE(aria2_get_global_option);
+  if (!session || !name) {
+    return nullptr;
+  }
+  return aria2_session_call(session, [&]() -> char* {
+    const auto& value = aria2::getGlobalOption(session->session, name);
+    return aria2_strdup(value);
+  });
+}
+
+int aria2_get_global_options(aria2_session_t* session,
+                             aria2_key_val_t** options,
+                                   size_t* options_count)
+{
+  ARIA2_API_SCOPE(aria2_get_global_options);
+  if (!session) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    auto cpp_options = aria2::getGlobalOptions(session->session);
+    return aria2_copy_key_vals(cpp_options, options, options_count);
+  });
+}
+
+static int aria2_change_global_option_cpp(aria2_session_t* session,
+                                          const aria2::KeyVals& options)
+{
+  return aria2_session_call(session, [&]() -> int {
+    int result = aria2::changeGlobalOption(session->session, options);
+    std::fill(std::begin(session->option_cache.valid),
+              std::end(session->option_cache.valid), false);
+    return result;
+  });
+}
+
+int aria2_change_global_option(aria2_session_t* session,
+                               const aria2_key_val_t* options,
+                               size_t options_count)
+{
+  ARIA2_API_SCOPE(aria2_change_global_option);
+  if (!session) {
+    return -1;
+  }
+  return aria2_change_global_option_cpp(
+      session, aria2_to_key_vals(options, options_count));
+}
+
+int aria2_change_global_option_with_option_set(
+    aria2_session_t* session,
+    const aria2_option_set_t* option_set)
+{
+  ARIA2_API_SCOPE(aria2_change_global_option_with_option_set);
+  if (!session || !option_set) {
+    return -1;
+  }
+  return aria2_change_global_option_cpp(session, option_set->options);
+}
+
+static const std::string& aria2_option_key(aria2_option_id_t id)
+{
+  static const std::string names[] = {
+#define ARIA2_OPTION_NAME(id, name) name,
+      ARIA2_OPTION_TABLE(ARIA2_OPTION_NAME)
+#undef ARIA2_OPTION_NAME
+  };
+  return names[id];
+}
+
+static bool aria2_is_valid_option_id(aria2_option_id_t id)
+{
+  return static_cast<int>(id) >= 0 && id < ARIA2_OPT_COUNT;
+}
+
+// 解析数值选项，接受 aria2 的 K/M 后缀；布尔值解析为 0 或 1。
+static bool aria2_parse_option_value(const std::string& text, int64_t* value)
+{
+  if (text == "true") {
+    *value = 1;
+    return true;
+  }
+  if (text == "false") {
+    *value = 0;
+    return true;
+  }
+  if (text.empty()) {
+    return false;
+  }
+  char* end = nullptr;
+  errno = 0;
+  long long number = std::strtoll(text.c_str(), &end, 10);
+  if (end == text.c_str() || errno == ERANGE) {
+    return false;
+  }
+  int64_t factor = 1;
+  if (*end == 'K' || *end == 'k') {
+    factor = 1024;
+    ++end;
+  }
+  else if (*end == 'M' || *end == 'm') {
+    factor = 1024 * 1024;
+    ++end;
+  }
+  if (*end != '\0' || number > INT64_MAX / factor ||
+      number < INT64_MIN / factor) {
+    return false;
+  }
+  *value = static_cast<int64_t>(number) * factor;
+  return true;
+}
+
+const char* aria2_option_name(aria2_option_id_t id)
+{
+  ARIA2_API_SCOPE(aria2_option_name);
+  return aria2_is_valid_option_id(id) ? aria2_option_key(id).c_str()
+                                      : nullptr;
+}
+
+int aria2_get_option_int64(aria2_session_t* session,
+                           aria2_option_id_t id,
+                           int64_t* value)
+{
+  ARIA2_API_SCOPE(aria2_get_option_int64);
+  if (!session || !value || !aria2_is_valid_option_id(id)) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    aria2_option_cache& cache = session->option_cache;
+    if (cache.enabled && cache.valid[id]) {
+      *value = cache.values[id];
+      return 0;
+    }
+    const std::string& text =
+        aria2::getGlobalOption(session->session, aria2_option_key(id));
+    if (!aria2_parse_option_value(text, value)) {
+      return -1;
+    }
+    if (cache.enabled) {
+      cache.values[id] = *value;
+      cache.valid[id] = true;
+    }
+    return 0;
+  });
+}
+
+int aria2_get_option_bool(aria2_session_t* session,
+                          aria2_option_id_t id,
+                          int* value)
+{
+  ARIA2_API_SCOPE(aria2_get_option_bool);
+  if (!value) {
+    return -1;
+  }
+  int64_t number = 0;
+  if (aria2_get_option_int64(session, id, &number) != 0) {
+    return -1;
+  }
+  *value = number != 0;
+  return 0;
+}
+
+static int aria2_set_option_text(aria2_session_t* session,
+                                 aria2_option_id_t id,
+                                 std::string text)
+{
+  if (!session || !aria2_is_valid_option_id(id)) {
+    return -1;
+  }
+  aria2::KeyVals options;
+  options.emplace_back(aria2_option_key(id), std::move(text));
+  return aria2_change_global_option_cpp(session, options);
+}
+
+int aria2_set_option_int64(aria2_session_t* session,
+                           aria2_option_id_t id,
+                           int64_t value)
+{
+  ARIA2_API_SCOPE(aria2_set_option_int64);
+  return aria2_set_option_text(session, id, std::to_string(value));
+}
+
+int aria2_set_option_bool(aria2_session_t* session,
+                          aria2_option_id_t id,
+                          int value)
+{
+  ARIA2_API_SCOPE(aria2_set_option_bool);
+  return aria2_set_option_text(session, id, value ? "true" : "false");
+}
+
+int aria2_download_handle_get_option_int64(aria2_download_handle_t* dh,
+                                           aria2_option_id_t id,
+                                           int64_t* value)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_option_int64);
+  if (!dh || !value || !aria2_is_valid_option_id(id)) {
+    return -1;
+  }
+  return aria2_parse_option_value(dh->handle->getOption(aria2_option_key(id)),
+                                  value)
+             ? 0
+             : -1;
+}
+
+int aria2_download_handle_get_option_bool(aria2_download_handle_t* dh,
+                                          aria2_option_id_t id,
+                                          int* value)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_option_bool);
+  if (!value) {
+    return -1;
+  }
+  int64_t number = 0;
+  if (aria2_download_handle_get_option_int64(dh, id, &number) != 0) {
+    return -1;
+  }
+  *value = number != 0;
+  return 0;
+}
+
+aria2_global_stat_t aria2_get_global_stat(aria2_session_t* session)
+{
+  ARIA2_API_SCOPE(aria2_get_global_stat);
+  aria2_global_stat_t stat{};
+  if (!session) {
+    return stat;
+  }
+  auto cpp_stat = aria2_session_call(
+      session, [&] { return aria2::getGlobalStat(session->session); });
+  stat.download_speed = cpp_stat.downloadSpeed;
+  stat.upload_speed = cpp_stat.uploadSpeed;
+  stat.num_active = cpp_stat.numActive;
+  stat.num_waiting = cpp_stat.numWaiting;
+  stat.num_stopped = cpp_stat.numStopped;
+  return stat;
+}
+
+// 取窗口内的样本，按时间先后排列。
+static std::vector<aria2_global_stat_sample_t>
+aria2_stats_window(const aria2_stats_ring* ring, int64_t window_ms)
+{
+  std::vector<aria2_global_stat_sample_t> result;
+  result.reserve(ring->size);
+  for (size_t i = 0; i < ring->size; ++i) {
+    result.push_back(ring->samples[(ring->head + i) % ring->samples.size()]);
+  }
+  if (window_ms > 0 && !result.empty()) {
+    int64_t since = result.back().timestamp_ms - window_ms;
+    auto first = std::find_if(result.begin(), result.end(),
+                              [&](const aria2_global_stat_sample_t& sample) {
+                                return sample.timestamp_ms > since;
+                              });
+    result.erase(result.begin(), first);
+  }
+  return result;
+}
+
+static aria2_stat_summary_t aria2_summarize(std::vector<double>& values)
+{
+  aria2_stat_summary_t summary{};
+  if (values.empty()) {
+    return summary;
+  }
+  std::sort(values.begin(), values.end());
+  // 最近秩法取百分位数。
+  auto rank = [&](double p) {
+    size_t index = static_cast<size_t>(p * values.size() + 0.999999);
+    return values[std::min(std::max<size_t>(index, 1), values.size()) - 1];
+  };
+  double total = 0;
+  for (double value : values) {
+    total += value;
+  }
+  summary.min = values.front();
+  summary.max = values.back();
+  summary.mean = total / values.size();
+  summary.p50 = rank(0.50);
+  summary.p95 = rank(0.95);
+  summary.p99 = rank(0.99);
+  return summary;
+}
+
+int aria2_get_global_stat_series(aria2_session_t* session,
+                                 int64_t window_ms,
+                                 aria2_global_stat_sample_t** samples,
+                                 size_t* samples_count)
+{
+  ARIA2_API_SCOPE(aria2_get_global_stat_series);
+  if (!session || !samples || !samples_count) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    if (!session->stats) {
+      return -1;
+    }
+    auto window = aria2_stats_window(session->stats, window_ms);
+    auto* data = static_cast<aria2_global_stat_sample_t*>(
+        std::malloc(std::max<size_t>(window.size(), 1) *
+                    sizeof(aria2_global_stat_sample_t)));
+    if (!data) {
+      return -1;
+    }
+    std::copy(window.begin(), window.end(), data);
+    *samples = data;
+    *samples_count = window.size();
+    return 0;
+  });
+}
+
+int aria2_get_global_stat_summary(aria2_session_t* session,
+                                  int64_t window_ms,
+                                  aria2_global_stat_summary_t* summary)
+{
+  ARIA2_API_SCOPE(aria2_get_global_stat_summary);
+  if (!session || !summary) {
+    return -1;
+  }
+  auto window = aria2_session_call(
+      session, [&]() -> std::vector<aria2_global_stat_sample_t> {
+        if (!session->stats) {
+          return {};
+        }
+        return aria2_stats_window(session->stats, window_ms);
+      });
+  if (!session->stats) {
+    return -1;
+  }
+  *summary = aria2_global_stat_summary_t{};
+  summary->samples = window.size();
+  std::vector<double> values(window.size());
+  auto summarize = [&](int aria2_global_stat_t::*field) {
+    for (size_t i = 0; i < window.size(); ++i) {
+      values[i] = window[i].stat.*field;
+    }
+    return aria2_summarize(values);
+  };
+  summary->download_speed = summarize(&aria2_global_stat_t::download_speed);
+  summary->upload_speed = summarize(&aria2_global_stat_t::upload_speed);
+  summary->num_active = summarize(&aria2_global_stat_t::num_active);
+  summary->num_waiting = summarize(&aria2_global_stat_t::num_waiting);
+  summary->num_stopped = summarize(&aria2_global_stat_t::num_stopped);
+  return 0;
+}
+
+int aria2_change_position(aria2_session_t* session,
+                          aria2_gid_t gid,
+                                int pos,
+                                aria2_offset_mode_t how)
+{
+  ARIA2_API_SCOPE(aria2_change_position);
+  if (!session) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    int result = aria2::changePosition(session->session,
+                                       static_cast<aria2::A2Gid>(gid),
+                                       pos,
+                                       static_cast<aria2::OffsetMode>(how));
+    if (result >= 0) {
+      aria2_trace_instant(session, static_cast<aria2::A2Gid>(gid),
+                          "change_position", result);
+    }
+    return result;
+  });
+}
+
+int aria2_shutdown(aria2_session_t* session, int force)
+{
+  ARIA2_API_SCOPE(aria2_shutdown);
+  if (!session) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    return aria2::shutdown(session->session, force != 0);
+  });
+}
+
+static void aria2_delete_cpp_handle(aria2_session_t* session,
+                                    aria2::DownloadHandle* handle)
+{
+  if (session->loop) {
+    delete handle;
+  }
+  else {
+    aria2::deleteDownloadHandle(handle);
+  }
+}
+
+aria2_download_handle_t* aria2_get_download_handle(aria2_session_t* session,
+                                                   aria2_gid_t gid)
+{
+  ARIA2_API_SCOPE(aria2_get_download_handle);
+  if (!session) {
+    return nullptr;
+  }
+  aria2::DownloadHandle* handle = aria2_session_call(session, [&] {
+    return aria2::getDownloadHandle(session->session,
+                                    static_cast<aria2::A2Gid>(gid));
+  });
+  if (!handle) {
+    return nullptr;
+  }
+  if (session->loop) {
+    auto* loop_handle =
+        new (std::nothrow) aria2_loop_download_handle(session, handle);
+    if (!loop_handle) {
+      aria2_session_call(session, [&] {
+        aria2::deleteDownloadHandle(handle);
+        return 0;
+      });
+      return nullptr;
+    }
+    handle = loop_handle;
+  }
+  auto* c_handle = new (std::nothrow) aria2_download_handle_t();
+  if (!c_handle) {
+    aria2_delete_cpp_handle(session, handle);
+    return nullptr;
+  }
+  c_handle->handle = handle;
+  c_handle->session = session;
+  c_handle->gid = static_cast<aria2::A2Gid>(gid);
+  return c_handle;
+}
+
+static void aria2_release_shared_handle(aria2_download_handle_t* dh);
+
+void aria2_delete_download_handle(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_delete_download_handle);
+  if (!dh) {
+    return;
+  }
+  if (dh->core) {
+    aria2_release_shared_handle(dh);
+    return;
+  }
+  aria2_delete_cpp_handle(dh->session, dh->handle);
+  delete dh;
+}
+
+static void aria2_release_handle_core(aria2_session_t* session,
+                                      aria2_handle_core* core)
+{
+  if (core->refs.fetch_sub(1) == 1) {
+    aria2_delete_cpp_handle(session, core->handle);
+    delete core;
+  }
+}
+
+// 为共享句柄创建一个持有者，优先复用已释放的持有者。调用时需持有
+// handle_cache_mutex。
+static aria2_download_handle_t* aria2_new_handle_holder(
+    aria2_session_t* session,
+    aria2::A2Gid gid,
+    aria2_handle_core* core)
+{
+  aria2_download_handle_t* dh;
+  if (!session->handle_pool.empty()) {
+    dh = session->handle_pool.back();
+    session->handle_pool.pop_back();
+  }
+  else {
+    dh = new (std::nothrow) aria2_download_handle_t();
+    if (!dh) {
+      return nullptr;
+    }
+  }
+  core->refs.fetch_add(1);
+  session->handle_holders.fetch_add(1);
+  dh->handle = core->handle;
+  dh->session = session;
+  dh->gid = gid;
+  dh->core = core;
+  return dh;
+}
+
+aria2_download_handle_t* aria2_acquire_download_handle(aria2_session_t* session,
+                                                       aria2_gid_t gid)
+{
+  ARIA2_API_SCOPE(aria2_acquire_download_handle);
+  if (!session) {
+    return nullptr;
+  }
+  auto key = static_cast<aria2::A2Gid>(gid);
+  {
+    std::lock_guard<std::mutex> lock(session->handle_cache_mutex);
+    auto it = session->handle_cache.find(key);
+    if (it != session->handle_cache.end()) {
+      return aria2_new_handle_holder(session, key, it->second);
+    }
+  }
+  // 在事件循环线程上创建并登记，与事件代理中的失效处理串行执行。
+  return aria2_session_call(session, [&]() -> aria2_download_handle_t* {
+    std::lock_guard<std::mutex> lock(session->handle_cache_mutex);
+    auto it = session->handle_cache.find(key);
+    if (it != session->handle_cache.end()) {
+      return aria2_new_handle_holder(session, key, it->second);
+    }
+    aria2::DownloadHandle* handle =
+        aria2::getDownloadHandle(session->session, key);
+    if (!handle) {
+      return nullptr;
+    }
+    if (session->loop) {
+      auto* loop_handle =
+          new (std::nothrow) aria2_loop_download_handle(session, handle);
+      if (!loop_handle) {
+        aria2::deleteDownloadHandle(handle);
+        return nullptr;
+      }
+      handle = loop_handle;
+    }
+    auto* core = new (std::nothrow) aria2_handle_core();
+    if (!core) {
+      aria2_delete_cpp_handle(session, handle);
+      return nullptr;
+    }
+    core->handle = handle;
+    aria2_download_handle_t* dh = aria2_new_handle_holder(session, key, core);
+    // 已结束的下载不会再收到失效事件，不放入缓存。
+    if (dh && handle->getStatus() <= aria2::DOWNLOAD_PAUSED) {
+      session->handle_cache.emplace(key, core);
+    }
+    else {
+      aria2_release_handle_core(session, core);
+    }
+    return dh;
+  });
+}
+
+void aria2_release_download_handle(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_release_download_handle);
+  if (!dh) {
+    return;
+  }
+  // aria2_get_download_handle 返回的句柄没有共享部分。
+  if (!dh->core) {
+    aria2_delete_cpp_handle(dh->session, dh->handle);
+    delete dh;
+    return;
+  }
+  aria2_release_shared_handle(dh);
+}
+
+static void aria2_release_shared_handle(aria2_download_handle_t* dh)
+{
+  static const size_t max_pooled = 256;
+  aria2_session_t* session = dh->session;
+  aria2_handle_core* core = dh->core;
+  dh->core = nullptr;
+  dh->bitfield.clear();
+  dh->bt_meta_info = aria2::BtMetaInfoData();
+  dh->has_bt_meta_info = false;
+  dh->announce_views.clear();
+  dh->dir.clear();
+  dh->info_hash.clear();
+  dh->options.clear();
+  {
+    std::lock_guard<std::mutex> lock(session->handle_cache_mutex);
+    if (session->handle_pool.size() < max_pooled) {
+      session->handle_pool.push_back(dh);
+      dh = nullptr;
+    }
+  }
+  delete dh;
+  aria2_release_handle_core(session, core);
+  session->handle_holders.fetch_sub(1);
+}
+
+aria2_download_status_t
+aria2_download_handle_get_status(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_status);
+  if (!dh) {
+    return ARIA2_DOWNLOAD_ERROR;
+  }
+  return static_cast<aria2_download_status_t>(dh->handle->getStatus());
+}
+
+int64_t aria2_download_handle_get_total_length(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_total_length);
+  return dh ? dh->handle->getTotalLength() : 0;
+}
+
+int64_t aria2_download_handle_get_completed_length(
+    aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_completed_length);
+  return dh ? dh->handle->getCompletedLength() : 0;
+}
+
+// aria2 的下载句柄在创建时计算速度和上传量，之后不再更新。共享句柄
+// 长期缓存，读取这些值时从新的句柄取得；下载已不存在时使用缓存的值。
+template <typename F>
+static auto aria2_fresh_stat(aria2_download_handle_t* dh, F fn)
+    -> decltype(fn(dh->handle))
+{
+  if (!dh->core) {
+    return fn(dh->handle);
+  }
+  aria2_session_t* session = dh->session;
+  return aria2_session_call(session, [&] {
+    aria2::DownloadHandle* handle =
+        aria2::getDownloadHandle(session->session, dh->gid);
+    if (!handle) {
+      return fn(dh->handle);
+    }
+    auto value = fn(handle);
+    aria2::deleteDownloadHandle(handle);
+    return value;
+  });
+}
+
+int64_t aria2_download_handle_get_upload_length(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_upload_length);
+  if (!dh) {
+    return 0;
+  }
+  return aria2_fresh_stat(dh, [](aria2::DownloadHandle* handle) {
+    return handle->getUploadLength();
+  });
+}
+
+aria2_binary_t aria2_download_handle_get_bitfield(
+    aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_bitfield);
+  if (!dh) {
+    return aria2_binary_t{};
+  }
+  return aria2_make_binary(dh->handle->getBitfield());
+}
+
+int aria2_download_handle_get_download_speed(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_download_speed);
+  if (!dh) {
+    return 0;
+  }
+  return aria2_fresh_stat(dh, [](aria2::DownloadHandle* handle) {
+    return handle->getDownloadSpeed();
+  });
+}
+
+int aria2_download_handle_get_upload_speed(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_upload_speed);
+  if (!dh) {
+    return 0;
+  }
+  return aria2_fresh_stat(dh, [](aria2::DownloadHandle* handle) {
+    return handle->getUploadSpeed();
+  });
+}
+
+aria2_binary_t aria2_download_handle_get_info_hash(
+    aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_info_hash);
+  if (!dh) {
+    return aria2_binary_t{};
+  }
+  return aria2_make_binary(dh->handle->getInfoHash());
+}
+
+size_t aria2_download_handle_get_piece_length(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_piece_length);
+  return dh ? dh->handle->getPieceLength() : 0;
+}
+
+int aria2_download_handle_get_num_pieces(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_num_pieces);
+  return dh ? dh->handle->getNumPieces() : 0;
+}
+
+int aria2_download_handle_get_connections(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_connections);
+  return dh ? dh->handle->getConnections() : 0;
+}
+
+// 把已完成的分片区间换算为字节区间，末尾按 total 截断。
+static void aria2_piece_runs_to_bytes(const std::string& bits,
+                                      size_t num_pieces,
+                                      int64_t piece_length,
+                                      int64_t total,
+                                      std::vector<aria2_byte_range_t>* out)
+{
+  aria2_for_each_run(reinterpret_cast<const uint8_t*>(bits.data()),
+                     bits.size(), num_pieces, [&](size_t begin, size_t end) {
+                       int64_t from = static_cast<int64_t>(begin) * piece_length;
+                       int64_t to = std::min(
+                           static_cast<int64_t>(end) * piece_length, total);
+                       if (from < to) {
+                         out->push_back(aria2_byte_range_t{from, to});
+                       }
+                     });
+}
+
+int aria2_download_handle_get_available_ranges(aria2_download_handle_t* dh,
+                                               aria2_byte_range_t** ranges,
+                                               size_t* ranges_count)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_available_ranges);
+  if (!dh || !ranges || !ranges_count) {
+    return -1;
+  }
+  *ranges = nullptr;
+  *ranges_count = 0;
+  aria2::DownloadHandle* handle = dh->handle;
+  int64_t total = handle->getTotalLength();
+  std::vector<aria2_byte_range_t> result;
+  if (handle->getStatus() == aria2::DOWNLOAD_COMPLETE) {
+    if (total > 0) {
+      result.push_back(aria2_byte_range_t{0, total});
+    }
+  }
+  else {
+    std::string bits = handle->getBitfield();
+    size_t num_pieces =
+        std::min(static_cast<size_t>(std::max(handle->getNumPieces(), 0)),
+                 bits.size() * 8);
+    aria2_piece_runs_to_bytes(bits, num_pieces,
+                              static_cast<int64_t>(handle->getPieceLength()),
+                              total, &result);
+  }
+  if (result.empty()) {
+    return 0;
+  }
+  auto* data = static_cast<aria2_byte_range_t*>(
+      std::malloc(result.size() * sizeof(aria2_byte_range_t)));
+  if (!data) {
+    return -1;
+  }
+  std::memcpy(data, result.data(), result.size() * sizeof(aria2_byte_range_t));
+  *ranges = data;
+  *ranges_count = result.size();
+  return 0;
+}
+
+int aria2_download_handle_get_timings(aria2_download_handle_t* dh,
+                                      aria2_download_timings_t* timings)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_timings);
+  if (!dh || !timings || !dh->session->timings) {
+    return -1;
+  }
+  aria2_session_t* session = dh->session;
+  return aria2_session_call(session, [&]() -> int {
+    auto it = session->timings->records.find(dh->gid);
+    if (it == session->timings->records.end()) {
+      return -1;
+    }
+    const aria2_timing_record& record = it->second;
+    auto span = [](std::chrono::steady_clock::time_point from,
+                   std::chrono::steady_clock::time_point to) -> int64_t {
+      if (!from.time_since_epoch().count() || !to.time_since_epoch().count()) {
+        return -1;
+      }
+      return std::chrono::duration_cast<std::chrono::milliseconds>(to - from)
+          .count();
+    };
+    timings->queued_ms = span(record.added, record.started);
+    timings->first_byte_ms = span(record.started, record.first_byte);
+    timings->transfer_ms = span(record.first_byte, record.last_byte);
+    timings->finalize_ms = span(record.last_byte, record.finished);
+    timings->total_ms = span(record.added, record.finished);
+    return 0;
+  });
+}
+
+int aria2_download_handle_get_error_code(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_error_code);
+  return dh ? dh->handle->getErrorCode() : 0;
+}
+
+int aria2_download_handle_get_followed_by(aria2_download_handle_t* dh,
+                                          aria2_gid_t** gids,
+                                                size_t* gids_count)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_followed_by);
+  if (!dh) {
+    return -1;
+  }
+  return aria2_copy_gid_vector(dh->handle->getFollowedBy(), gids,
+                                     gids_count);
+}
+
+aria2_gid_t aria2_download_handle_get_following(
+    aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_following);
+  return dh ? static_cast<aria2_gid_t>(dh->handle->getFollowing()) : 0;
+}
+
+aria2_gid_t aria2_download_handle_get_belongs_to(
+    aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_belongs_to);
+  return dh ? static_cast<aria2_gid_t>(dh->handle->getBelongsTo()) : 0;
+}
+
+char* aria2_download_handle_get_dir(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_dir);
+  return dh ? aria2_strdup(dh->handle->getDir()) : nullptr;
+}
+
+int aria2_download_handle_get_files(aria2_download_handle_t* dh,
+                                    aria2_file_data_t** files,
+                                          size_t* files_count)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_files);
+  if (!dh) {
+    return -1;
+  }
+  return aria2_copy_file_data_vector(dh->handle->getFiles(), files,
+                                           files_count);
+}
+
+int aria2_download_handle_get_num_files(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_num_files);
+  return dh ? dh->handle->getNumFiles() : 0;
+}
+
+aria2_file_data_t aria2_download_handle_get_file(
+    aria2_download_handle_t* dh,
+    int index)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_file);
+  aria2_file_data_t result{};
+  if (!dh) {
+    return result;
+  }
+  aria2::FileData file = dh->handle->getFile(index);
+  if (aria2_copy_file_data(file, &result) != 0) {
+    return aria2_file_data_t{};
+  }
+  return result;
+}
+
+aria2_bt_meta_info_data_t
+aria2_download_handle_get_bt_meta_info(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_bt_meta_info);
+  aria2_bt_meta_info_data_t result{};
+  if (!dh) {
+    return result;
+  }
+  aria2::BtMetaInfoData info = dh->handle->getBtMetaInfo();
+  result.comment = aria2_strdup(info.comment);
+  result.creation_date = static_cast<int64_t>(info.creationDate);
+  result.mode = static_cast<aria2_bt_file_mode_t>(info.mode);
+  result.name = aria2_strdup(info.name);
+  if (aria2_copy_string_list_array(info.announceList,
+                                   &result.announce_list,
+                                   &result.announce_list_count) != 0) {
+    aria2_free_bt_meta_info_data(&result);
+    return aria2_bt_meta_info_data_t{};
+  }
+  return result;
+}
+
+char* aria2_download_handle_get_option(aria2_download_handle_t* dh,
+                                       const char* name)
 {
-  char* out = static_cast<char*>(std::malloc(value.size() + 1));
-  if (!out) {
+  ARIA2_API_SCOPE(aria2_download_handle_get_option);
+  if (!dh || !name) {
     return nullptr;
   }
-  if (!value.empty()) {
-    std::memcpy(out, value.data(), value.size());
-  }
-  out[value.size()] = '\0';
-  return out;
+  const auto& value = dh->handle->getOption(name);
+  return aria2_strdup(value);
 }
 
-static aria2_binary_t aria2_make_binary(const std::string& value)
+int aria2_download_handle_get_options(aria2_download_handle_t* dh,
+                                      aria2_key_val_t** options,
+                                            size_t* options_count)
 {
-  aria2_binary_t bin{};
-  if (value.empty()) {
-    return bin;
-  }
-  bin.data = static_cast<uint8_t*>(std::malloc(value.size()));
-  if (!bin.data) {
-    return bin;
+  ARIA2_API_SCOPE(aria2_download_handle_get_options);
+  if (!dh) {
+    return -1;
   }
-  std::memcpy(bin.data, value.data(), value.size());
-  bin.length = value.size();
-  return bin;
+  auto cpp_options = dh->handle->getOptions();
+  return aria2_copy_key_vals(cpp_options, options, options_count);
 }
 
-static aria2::KeyVals aria2_to_key_vals(const aria2_key_val_t* options,
-                                        size_t options_count)
+aria2_str_view_t aria2_download_handle_view_dir(aria2_download_handle_t* dh)
 {
-  aria2::KeyVals result;
-  if (!options || options_count == 0) {
-    return result;
+  ARIA2_API_SCOPE(aria2_download_handle_view_dir);
+  if (!dh) {
+    return aria2_str_view_t{};
   }
-  result.reserve(options_count);
-  for (size_t i = 0; i < options_count; ++i) {
-    const char* key = options[i].key ? options[i].key : "";
-    const char* value = options[i].value ? options[i].value : "";
-    result.emplace_back(key, value);
+  if (dh->session->loop) {
+    dh->dir = dh->handle->getDir();
+    return aria2_make_str_view(dh->dir);
   }
-  return result;
+  return aria2_make_str_view(dh->handle->getDir());
 }
 
-static std::vector<std::string> aria2_to_string_vector(const char** values,
-                                                       size_t count)
+aria2_str_view_t aria2_download_handle_view_option(aria2_download_handle_t* dh,
+                                                   const char* name)
 {
-  std::vector<std::string> result;
-  if (!values || count == 0) {
-    return result;
+  ARIA2_API_SCOPE(aria2_download_handle_view_option);
+  if (!dh || !name) {
+    return aria2_str_view_t{};
   }
-  result.reserve(count);
-  for (size_t i = 0; i < count; ++i) {
-    result.emplace_back(values[i] ? values[i] : "");
+  if (dh->session->loop) {
+    std::string& value = dh->options[name];
+    value = dh->handle->getOption(name);
+    return aria2_make_str_view(value);
   }
-  return result;
+  return aria2_make_str_view(dh->handle->getOption(name));
 }
 
-static int aria2_copy_gid_vector(const std::vector<aria2::A2Gid>& gids,
-                                 aria2_gid_t** out_gids,
-                                 size_t* out_gids_count)
+aria2_bytes_view_t aria2_download_handle_view_bitfield(
+    aria2_download_handle_t* dh)
 {
-  if (!out_gids || !out_gids_count) {
-    return -1;
-  }
-  *out_gids = nullptr;
-  *out_gids_count = 0;
-  if (gids.empty()) {
-    return 0;
-  }
-  auto* data =
-      static_cast<aria2_gid_t*>(std::malloc(sizeof(aria2_gid_t) * gids.size()));
-  if (!data) {
-    return -1;
-  }
-  for (size_t i = 0; i < gids.size(); ++i) {
-    data[i] = static_cast<aria2_gid_t>(gids[i]);
+  ARIA2_API_SCOPE(aria2_download_handle_view_bitfield);
+  if (!dh) {
+    return aria2_bytes_view_t{};
   }
-  *out_gids = data;
-  *out_gids_count = gids.size();
-  return 0;
+  dh->bitfield = dh->handle->getBitfield();
+  return aria2_make_bytes_view(dh->bitfield);
 }
 
-static int aria2_copy_key_vals(const aria2::KeyVals& options,
-                               aria2_key_val_t** out_options,
-                               size_t* out_options_count)
+aria2_bytes_view_t aria2_download_handle_view_info_hash(
+    aria2_download_handle_t* dh)
 {
-  if (!out_options || !out_options_count) {
-    return -1;
-  }
-  *out_options = nullptr;
-  *out_options_count = 0;
-  if (options.empty()) {
-    return 0;
+  ARIA2_API_SCOPE(aria2_download_handle_view_info_hash);
+  if (!dh) {
+    return aria2_bytes_view_t{};
   }
-  auto* data =
-      static_cast<aria2_key_val_t*>(std::malloc(sizeof(aria2_key_val_t) * options.size()));
-  if (!data) {
-    return -1;
+  if (dh->session->loop) {
+    dh->info_hash = dh->handle->getInfoHash();
+    return aria2_make_bytes_view(dh->info_hash);
   }
-  for (size_t i = 0; i < options.size(); ++i) {
-    data[i].key = aria2_strdup(options[i].first);
-    data[i].value = aria2_strdup(options[i].second);
-    if ((options[i].first.size() && !data[i].key) ||
-        (options[i].second.size() && !data[i].value)) {
-      for (size_t j = 0; j <= i; ++j) {
-        std::free(data[j].key);
-        std::free(data[j].value);
-      }
-      std::free(data);
-      return -1;
-    }
+  return aria2_make_bytes_view(dh->handle->getInfoHash());
+}
+
+aria2_bt_meta_info_view_t
+aria2_download_handle_view_bt_meta_info(aria2_download_handle_t* dh)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_view_bt_meta_info);
+  aria2_bt_meta_info_view_t result{};
+  if (!dh) {
+    return result;
   }
-  *out_options = data;
-  *out_options_count = options.size();
-  return 0;
+  aria2_cache_bt_meta_info(dh);
+  const aria2::BtMetaInfoData& info = dh->bt_meta_info;
+  result.name = aria2_make_str_view(info.name);
+  result.comment = aria2_make_str_view(info.comment);
+  result.creation_date = static_cast<int64_t>(info.creationDate);
+  result.mode = static_cast<aria2_bt_file_mode_t>(info.mode);
+  result.announce_list_count = info.announceList.size();
+  return result;
 }
 
-static int aria2_copy_uri_data(const std::vector<aria2::UriData>& uris,
-                               aria2_uri_data_t** out_uris,
-                               size_t* out_uris_count)
+size_t aria2_download_handle_view_announce_tier(aria2_download_handle_t* dh,
+                                                size_t tier,
+                                                const aria2_str_view_t** uris)
 {
-  if (!out_uris || !out_uris_count) {
-    return -1;
+  ARIA2_API_SCOPE(aria2_download_handle_view_announce_tier);
+  if (uris) {
+    *uris = nullptr;
   }
-  *out_uris = nullptr;
-  *out_uris_count = 0;
-  if (uris.empty()) {
+  if (!dh || !uris) {
     return 0;
   }
-  auto* data = static_cast<aria2_uri_data_t*>(
-      std::malloc(sizeof(aria2_uri_data_t) * uris.size()));
-  if (!data) {
-    return -1;
-  }
-  for (size_t i = 0; i < uris.size(); ++i) {
-    data[i].uri = aria2_strdup(uris[i].uri);
-    data[i].status = static_cast<aria2_uri_status_t>(uris[i].status);
-    if (uris[i].uri.size() && !data[i].uri) {
-      for (size_t j = 0; j <= i; ++j) {
-        std::free(data[j].uri);
-      }
-      std::free(data);
-      return -1;
-    }
+  aria2_cache_bt_meta_info(dh);
+  if (tier >= dh->announce_views.size() || dh->announce_views[tier].empty()) {
+    return 0;
   }
-  *out_uris = data;
-  *out_uris_count = uris.size();
-  return 0;
+  *uris = dh->announce_views[tier].data();
+  return dh->announce_views[tier].size();
 }
 
-static int aria2_copy_file_data(const aria2::FileData& file,
-                                aria2_file_data_t* out_file)
+aria2_arena_t* aria2_arena_new(size_t block_size)
 {
-  if (!out_file) {
-    return -1;
-  }
-  *out_file = aria2_file_data_t{};
-  out_file->index = file.index;
-  out_file->path = aria2_strdup(file.path);
-  out_file->length = file.length;
-  out_file->completed_length = file.completedLength;
-  out_file->selected = file.selected ? 1 : 0;
-  if (file.path.size() && !out_file->path) {
-    return -1;
-  }
-  if (aria2_copy_uri_data(file.uris, &out_file->uris,
-                          &out_file->uris_count) != 0) {
-    std::free(out_file->path);
-    *out_file = aria2_file_data_t{};
-    return -1;
+  ARIA2_API_SCOPE(aria2_arena_new);
+  auto* arena = new (std::nothrow) aria2_arena_t();
+  if (!arena) {
+    return nullptr;
   }
-  return 0;
+  arena->block_size = block_size ? block_size : 64 * 1024;
+  arena->current = 0;
+  arena->offset = 0;
+  return arena;
 }
 
-static int aria2_copy_file_data_vector(
-    const std::vector<aria2::FileData>& files,
-    aria2_file_data_t** out_files,
-    size_t* out_files_count)
+void aria2_arena_reset(aria2_arena_t* arena)
 {
-  if (!out_files || !out_files_count) {
-    return -1;
+  ARIA2_API_SCOPE(aria2_arena_reset);
+  if (!arena) {
+    return;
   }
-  *out_files = nullptr;
-  *out_files_count = 0;
-  if (files.empty()) {
-    return 0;
+  arena->current = 0;
+  arena->offset = 0;
+}
+
+void aria2_arena_free(aria2_arena_t* arena)
+{
+  ARIA2_API_SCOPE(aria2_arena_free);
+  if (!arena) {
+    return;
   }
-  auto* data = static_cast<aria2_file_data_t*>(
-      std::malloc(sizeof(aria2_file_data_t) * files.size()));
-  if (!data) {
-    return -1;
+  for (const aria2_arena_block& block : arena->blocks) {
+    std::free(block.data);
   }
-  for (size_t i = 0; i < files.size(); ++i) {
-    if (aria2_copy_file_data(files[i], &data[i]) != 0) {
-      for (size_t j = 0; j < i; ++j) {
-        aria2_free_file_data(&data[j]);
-      }
-      std::free(data);
-      return -1;
-    }
+  delete arena;
+}
+
+char* aria2_get_global_option_arena(aria2_session_t* session,
+                                    aria2_arena_t* arena,
+                                    const char* name)
+{
+  ARIA2_API_SCOPE(aria2_get_global_option_arena);
+  if (!session || !arena || !name) {
+    return nullptr;
   }
-  *out_files = data;
-  *out_files_count = files.size();
-  return 0;
+  return aria2_session_call(session, [&]() -> char* {
+    return aria2_arena_strdup(arena,
+                              aria2::getGlobalOption(session->session, name));
+  });
 }
 
-static int aria2_copy_string_list(const std::vector<std::string>& values,
-                                  aria2_string_list_t* out_list)
+int aria2_get_global_options_arena(aria2_session_t* session,
+                                   aria2_arena_t* arena,
+                                   aria2_key_val_t** options,
+                                   size_t* options_count)
 {
-  if (!out_list) {
+  ARIA2_API_SCOPE(aria2_get_global_options_arena);
+  if (!session || !arena) {
     return -1;
   }
-  out_list->values = nullptr;
-  out_list->count = 0;
-  if (values.empty()) {
-    return 0;
+  return aria2_session_call(session, [&]() -> int {
+    return aria2_arena_copy_key_vals(arena,
+                                     aria2::getGlobalOptions(session->session),
+                                     options, options_count);
+  });
+}
+
+char* aria2_download_handle_get_dir_arena(aria2_download_handle_t* dh,
+                                          aria2_arena_t* arena)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_dir_arena);
+  if (!dh || !arena) {
+    return nullptr;
   }
-  auto* data =
-      static_cast<char**>(std::malloc(sizeof(char*) * values.size()));
-  if (!data) {
+  return aria2_arena_strdup(arena, dh->handle->getDir());
+}
+
+int aria2_download_handle_get_files_arena(aria2_download_handle_t* dh,
+                                          aria2_arena_t* arena,
+                                          aria2_file_data_t** files,
+                                          size_t* files_count)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_files_arena);
+  if (!dh || !arena) {
     return -1;
   }
-  for (size_t i = 0; i < values.size(); ++i) {
-    data[i] = aria2_strdup(values[i]);
-    if (values[i].size() && !data[i]) {
-      for (size_t j = 0; j <= i; ++j) {
-        std::free(data[j]);
-      }
-      std::free(data);
-      return -1;
-    }
-  }
-  out_list->values = data;
-  out_list->count = values.size();
-  return 0;
+  return aria2_arena_copy_file_data_vector(arena, dh->handle->getFiles(),
+                                           files, files_count);
 }
 
-static int aria2_copy_string_list_array(
-    const std::vector<std::vector<std::string>>& lists,
-    aria2_string_list_t** out_lists,
-    size_t* out_lists_count)
+int aria2_download_handle_get_file_arena(aria2_download_handle_t* dh,
+                                         aria2_arena_t* arena,
+                                         int index,
+                                         aria2_file_data_t* file)
 {
-  if (!out_lists || !out_lists_count) {
+  ARIA2_API_SCOPE(aria2_download_handle_get_file_arena);
+  if (!dh || !arena) {
     return -1;
   }
-  *out_lists = nullptr;
-  *out_lists_count = 0;
-  if (lists.empty()) {
-    return 0;
-  }
-  auto* data = static_cast<aria2_string_list_t*>(
-      std::malloc(sizeof(aria2_string_list_t) * lists.size()));
-  if (!data) {
+  return aria2_arena_copy_file_data(arena, dh->handle->getFile(index), file);
+}
+
+int aria2_download_handle_get_bt_meta_info_arena(
+    aria2_download_handle_t* dh,
+    aria2_arena_t* arena,
+    aria2_bt_meta_info_data_t* meta)
+{
+  ARIA2_API_SCOPE(aria2_download_handle_get_bt_meta_info_arena);
+  if (!dh || !arena || !meta) {
     return -1;
   }
-  for (size_t i = 0; i < lists.size(); ++i) {
-    if (aria2_copy_string_list(lists[i], &data[i]) != 0) {
-      for (size_t j = 0; j < i; ++j) {
-        aria2_free_string_list(&data[j]);
-      }
-      std::free(data);
-      return -1;
-    }
+  *meta = aria2_bt_meta_info_data_t{};
+  aria2::BtMetaInfoData info = dh->handle->getBtMetaInfo();
+  meta->comment = aria2_arena_strdup(arena, info.comment);
+  meta->creation_date = static_cast<int64_t>(info.creationDate);
+  meta->mode = static_cast<aria2_bt_file_mode_t>(info.mode);
+  meta->name = aria2_arena_strdup(arena, info.name);
+  if (!meta->comment || !meta->name ||
+      aria2_arena_copy_string_list_array(arena, info.announceList,
+                                         &meta->announce_list,
+                                         &meta->announce_list_count) != 0) {
+    *meta = aria2_bt_meta_info_data_t{};
+    return -1;
   }
-  *out_lists = data;
-  *out_lists_count = lists.size();
   return 0;
 }
 
-static int aria2_download_event_callback_proxy(aria2::Session* session,
-                                               aria2::DownloadEvent event,
-                                               aria2::A2Gid gid,
-                                               void* userData)
+char* aria2_download_handle_get_option_arena(aria2_download_handle_t* dh,
+                                             aria2_arena_t* arena,
+                                             const char* name)
 {
-  (void)session;
-  auto* ctx = static_cast<aria2_callback_ctx*>(userData);
-  if (!ctx || !ctx->callback) {
-    return 0;
+  ARIA2_API_SCOPE(aria2_download_handle_get_option_arena);
+  if (!dh || !arena || !name) {
+    return nullptr;
   }
-  return ctx->callback(ctx->c_session,
-                       static_cast<aria2_download_event_t>(event),
-                       static_cast<aria2_gid_t>(gid),
-                       ctx->user_data);
+  return aria2_arena_strdup(arena, dh->handle->getOption(name));
 }
 
-int aria2_library_init()
+int aria2_download_handle_get_options_arena(aria2_download_handle_t* dh,
+                                            aria2_arena_t* arena,
+                                            aria2_key_val_t** options,
+                                            size_t* options_count)
 {
-  return aria2::libraryInit();
+  ARIA2_API_SCOPE(aria2_download_handle_get_options_arena);
+  if (!dh || !arena) {
+    return -1;
+  }
+  return aria2_arena_copy_key_vals(arena, dh->handle->getOptions(), options,
+                                   options_count);
 }
 
-int aria2_library_deinit()
+int aria2_bitfield_stats(const uint8_t* bitfield,
+                         size_t length,
+                         size_t num_pieces,
+                         aria2_bitfield_stats_t* stats)
 {
-  return aria2::libraryDeinit();
+  ARIA2_API_SCOPE(aria2_bitfield_stats);
+  if (!stats || (!bitfield && length)) {
+    return -1;
+  }
+  *stats = aria2_bitfield_stats_t{};
+  num_pieces = std::min(num_pieces, length * 8);
+  size_t full_bytes = num_pieces / 8;
+  stats->completed_pieces =
+      static_cast<size_t>(aria2_popcount(bitfield, full_bytes));
+  if (num_pieces % 8) {
+    uint8_t mask = static_cast<uint8_t>(0xff << (8 - num_pieces % 8));
+    stats->completed_pieces += static_cast<size_t>(
+        __builtin_popcount(bitfield[full_bytes] & mask));
+  }
+  stats->first_missing = 0;
+  aria2_for_each_run(bitfield, length, num_pieces,
+                     [&](size_t begin, size_t end) {
+                       if (begin == 0) {
+                         stats->first_missing = end;
+                       }
+                       ++stats->num_runs;
+                       stats->longest_run =
+                           std::max(stats->longest_run, end - begin);
+                     });
+  return 0;
 }
 
-void aria2_session_config_init(aria2_session_config_t* config)
+int aria2_bitfield_runs(const uint8_t* bitfield,
+                        size_t length,
+                        size_t num_pieces,
+                        aria2_piece_range_t* ranges,
+                        size_t capacity,
+                        size_t* ranges_count)
 {
-  if (!config) {
-    return;
+  ARIA2_API_SCOPE(aria2_bitfield_runs);
+  if (!ranges_count || (!bitfield && length) || (!ranges && capacity)) {
+    return -1;
   }
-  aria2::SessionConfig defaults;
-  config->keep_running = defaults.keepRunning ? 1 : 0;
-  config->use_signal_handler = defaults.useSignalHandler ? 1 : 0;
-  config->download_event_callback = nullptr;
-  config->user_data = nullptr;
+  num_pieces = std::min(num_pieces, length * 8);
+  size_t count = 0;
+  aria2_for_each_run(bitfield, length, num_pieces,
+                     [&](size_t begin, size_t end) {
+                       if (count < capacity) {
+                         ranges[count] =
+                             aria2_piece_range_t{static_cast<uint32_t>(begin),
+                                                 static_cast<uint32_t>(end)};
+                       }
+                       ++count;
+                     });
+  *ranges_count = count;
+  return 0;
 }
 
-aria2_session_t* aria2_session_new(const aria2_key_val_t* options,
-                                   size_t options_count,
-                                   const aria2_session_config_t* config)
+int aria2_get_bitfield_delta(aria2_session_t* session,
+                             aria2_gid_t gid,
+                             uint64_t since_version,
+                             uint64_t* version,
+                             aria2_piece_range_t* ranges,
+                             size_t capacity,
+                             size_t* ranges_count)
 {
-  aria2::KeyVals cpp_options = aria2_to_key_vals(options, options_count);
-  aria2::SessionConfig cpp_config;
-
-  aria2_session_t* c_session =
-      static_cast<aria2_session_t*>(std::malloc(sizeof(aria2_session_t)));
-  if (!c_session) {
-    return nullptr;
+  ARIA2_API_SCOPE(aria2_get_bitfield_delta);
+  if (!session || !version || !ranges_count || (!ranges && capacity)) {
+    return -1;
   }
-  c_session->session = nullptr;
-  c_session->callback_ctx = nullptr;
+  return aria2_session_call(session, [&]() -> int {
+    aria2::A2Gid key = static_cast<aria2::A2Gid>(gid);
+    if (!aria2_bitfield_refresh(session, key)) {
+      return -1;
+    }
+    aria2_bitfield_track& track = session->bitfields[key];
+    track.delta = true;
+    size_t num_pieces = track.num_pieces;
+    *version = track.version;
 
-  if (config) {
-    cpp_config.keepRunning = config->keep_running != 0;
-    cpp_config.useSignalHandler = config->use_signal_handler != 0;
-    if (config->download_event_callback) {
-      aria2_callback_ctx* ctx =
-          static_cast<aria2_callback_ctx*>(std::malloc(sizeof(*ctx)));
-      if (!ctx) {
-        std::free(c_session);
-        return nullptr;
+    std::vector<aria2_piece_range_t> result;
+    int rv = 0;
+    // history 的第一个条目记录的是相对其前一版本的变化。
+    if (since_version == 0 || since_version > track.version ||
+        since_version + 1 < track.history.front().first) {
+      aria2_collect_runs(reinterpret_cast<const uint8_t*>(track.bits.data()),
+                         track.bits.size(), num_pieces, &result);
+      rv = 1;
+    }
+    else {
+      for (const auto& entry : track.history) {
+        if (entry.first > since_version) {
+          result.insert(result.end(), entry.second.begin(),
+                        entry.second.end());
+        }
       }
-      ctx->callback = config->download_event_callback;
-      ctx->user_data = config->user_data;
-      ctx->c_session = c_session;
-      c_session->callback_ctx = ctx;
-      cpp_config.downloadEventCallback = aria2_download_event_callback_proxy;
-      cpp_config.userData = ctx;
-    } else {
-      cpp_config.userData = config->user_data;
+      std::sort(result.begin(), result.end(),
+                [](const aria2_piece_range_t& a,
+                   const aria2_piece_range_t& b) { return a.begin < b.begin; });
+      size_t merged = 0;
+      for (const auto& range : result) {
+        if (merged && result[merged - 1].end >= range.begin) {
+          result[merged - 1].end = std::max(result[merged - 1].end, range.end);
+        }
+        else {
+          result[merged++] = range;
+        }
+      }
+      result.resize(merged);
     }
-  }
+    for (size_t i = 0; i < result.size() && i < capacity; ++i) {
+      ranges[i] = result[i];
+    }
+    *ranges_count = result.size();
+    return rv;
+  });
+}
 
-  aria2::Session* session = aria2::sessionNew(cpp_options, cpp_config);
-  if (!session) {
-    std::free(c_session->callback_ctx);
-    std::free(c_session);
-    return nullptr;
-  }
-  c_session->session = session;
-  return c_session;
+static uint64_t aria2_rotl64(uint64_t x, int n)
+{
+  return (x << n) | (x >> (64 - n));
 }
 
-int aria2_session_final(aria2_session_t* session)
+static uint64_t aria2_load_le64(const uint8_t* p)
 {
-  if (!session) {
-    return 0;
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; --i) {
+    value = value << 8 | p[i];
   }
-  int result = aria2::sessionFinal(session->session);
-  std::free(session->callback_ctx);
-  std::free(session);
-  return result;
+  return value;
 }
 
-int aria2_run(aria2_session_t* session, aria2_run_mode_t mode)
+#if defined(ARIA2_C_API_BUNDLED_SHA)
+static uint32_t aria2_rotl32(uint32_t x, int n)
 {
-  if (!session) {
-    return -1;
-  }
-  return aria2::run(session->session, static_cast<aria2::RUN_MODE>(mode));
+  return (x << n) | (x >> (32 - n));
 }
 
-char* aria2_gid_to_hex(aria2_gid_t gid)
+static uint32_t aria2_load_be32(const uint8_t* p)
 {
-  return aria2_strdup(aria2::gidToHex(static_cast<aria2::A2Gid>(gid)));
+  return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+         static_cast<uint32_t>(p[2]) << 8 | p[3];
 }
 
-aria2_gid_t aria2_hex_to_gid(const char* hex)
+static void aria2_sha1_block(uint32_t* h, const uint8_t* p)
 {
-  if (!hex) {
-    return static_cast<aria2_gid_t>(aria2::A2Gid());
+  uint32_t w[80];
+  for (int i = 0; i < 16; ++i) {
+    w[i] = aria2_load_be32(p + i * 4);
   }
-  return static_cast<aria2_gid_t>(aria2::hexToGid(hex));
+  for (int i = 16; i < 80; ++i) {
+    w[i] = aria2_rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+  for (int i = 0; i < 80; ++i) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    }
+    else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    }
+    else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    }
+    else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t t = aria2_rotl32(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = aria2_rotl32(b, 30);
+    b = a;
+    a = t;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
 }
 
-int aria2_is_null(aria2_gid_t gid)
+static void aria2_sha256_block(uint32_t* h, const uint8_t* p)
 {
-  return aria2::isNull(static_cast<aria2::A2Gid>(gid)) ? 1 : 0;
+  static const uint32_t k[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+  uint32_t w[64];
+  for (int i = 0; i < 16; ++i) {
+    w[i] = aria2_load_be32(p + i * 4);
+  }
+  for (int i = 16; i < 64; ++i) {
+    uint32_t s0 = aria2_rotl32(w[i - 15], 25) ^ aria2_rotl32(w[i - 15], 14) ^
+                  (w[i - 15] >> 3);
+    uint32_t s1 = aria2_rotl32(w[i - 2], 15) ^ aria2_rotl32(w[i - 2], 13) ^
+                  (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+  uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+  for (int i = 0; i < 64; ++i) {
+    uint32_t s1 =
+        aria2_rotl32(e, 26) ^ aria2_rotl32(e, 21) ^ aria2_rotl32(e, 7);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = hh + s1 + ch + k[i] + w[i];
+    uint32_t s0 =
+        aria2_rotl32(a, 30) ^ aria2_rotl32(a, 19) ^ aria2_rotl32(a, 10);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+    hh = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+  h[5] += f;
+  h[6] += g;
+  h[7] += hh;
 }
 
-int aria2_add_uri(aria2_session_t* session,
-                  aria2_gid_t* gid,
-                        const char** uris,
-                        size_t uris_count,
-                        const aria2_key_val_t* options,
-                        size_t options_count,
-                        int position)
+static void aria2_sha1_init(aria2_md_state* md)
 {
-  if (!session) {
-    return -1;
+  static const uint32_t iv[5] = {0x67452301, 0xefcdab89, 0x98badcfe,
+                                 0x10325476, 0xc3d2e1f0};
+  std::memcpy(md->h, iv, sizeof(iv));
+  md->used = 0;
+  md->length = 0;
+}
+
+static void aria2_sha256_init(aria2_md_state* md)
+{
+  static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                 0x1f83d9ab, 0x5be0cd19};
+  std::memcpy(md->h, iv, sizeof(iv));
+  md->used = 0;
+  md->length = 0;
+}
+
+static void aria2_md_update(aria2_md_state* md,
+                            void (*compress)(uint32_t*, const uint8_t*),
+                            const uint8_t* data,
+                            size_t size)
+{
+  md->length += size;
+  if (md->used) {
+    size_t n = std::min(size, sizeof(md->block) - md->used);
+    std::memcpy(md->block + md->used, data, n);
+    md->used += n;
+    data += n;
+    size -= n;
+    if (md->used < sizeof(md->block)) {
+      return;
+    }
+    compress(md->h, md->block);
+    md->used = 0;
   }
-  auto cpp_uris = aria2_to_string_vector(uris, uris_count);
-  auto cpp_options = aria2_to_key_vals(options, options_count);
-  aria2::A2Gid cpp_gid{};
-  int result =
-      aria2::addUri(session->session, gid ? &cpp_gid : nullptr, cpp_uris,
-                    cpp_options, position);
-  if (gid) {
-    *gid = static_cast<aria2_gid_t>(cpp_gid);
+  for (; size >= 64; data += 64, size -= 64) {
+    compress(md->h, data);
   }
-  return result;
+  std::memcpy(md->block, data, size);
+  md->used = size;
 }
 
-int aria2_add_metalink(aria2_session_t* session,
-                       aria2_gid_t** gids,
-                             size_t* gids_count,
-                             const char* metalink_file,
-                             const aria2_key_val_t* options,
-                             size_t options_count,
-                             int position)
+// 填充并输出 words 个大端序字。
+static void aria2_md_final(aria2_md_state* md,
+                           void (*compress)(uint32_t*, const uint8_t*),
+                           uint8_t* out,
+                           int words)
 {
-  if (!session) {
-    return -1;
+  uint64_t bits = md->length * 8;
+  md->block[md->used++] = 0x80;
+  if (md->used > 56) {
+    std::memset(md->block + md->used, 0, 64 - md->used);
+    compress(md->h, md->block);
+    md->used = 0;
   }
-  auto cpp_options = aria2_to_key_vals(options, options_count);
-  std::vector<aria2::A2Gid> cpp_gids;
-  std::vector<aria2::A2Gid>* cpp_gids_ptr = nullptr;
-  if (gids && gids_count) {
-    cpp_gids_ptr = &cpp_gids;
+  std::memset(md->block + md->used, 0, 56 - md->used);
+  for (int i = 0; i < 8; ++i) {
+    md->block[56 + i] = static_cast<uint8_t>(bits >> (56 - i * 8));
   }
-  int result = aria2::addMetalink(
-      session->session, cpp_gids_ptr,
-      metalink_file ? metalink_file : "", cpp_options, position);
-  if (result == 0 && cpp_gids_ptr) {
-    if (aria2_copy_gid_vector(cpp_gids, gids, gids_count) != 0) {
-      return -1;
+  compress(md->h, md->block);
+  for (int i = 0; i < words; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      out[i * 4 + j] = static_cast<uint8_t>(md->h[i] >> (24 - j * 8));
     }
   }
-  return result;
 }
+#endif
 
-int aria2_add_torrent(aria2_session_t* session,
-                      aria2_gid_t* gid,
-                            const char* torrent_file,
-                            const char** webseed_uris,
-                            size_t webseed_uris_count,
-                            const aria2_key_val_t* options,
-                            size_t options_count,
-                            int position)
+static void aria2_hash_release(aria2_hash* hash)
 {
-  if (!session) {
-    return -1;
+#if defined(ARIA2_C_API_OPENSSL)
+  EVP_MD_CTX_free(hash->ctx);
+  hash->ctx = nullptr;
+#elif defined(ARIA2_C_API_BCRYPT)
+  if (hash->handle) {
+    BCryptDestroyHash(hash->handle);
+    hash->handle = nullptr;
   }
-  auto cpp_webseed = aria2_to_string_vector(webseed_uris, webseed_uris_count);
-  auto cpp_options = aria2_to_key_vals(options, options_count);
-  aria2::A2Gid cpp_gid{};
-  int result = aria2::addTorrent(
-      session->session, gid ? &cpp_gid : nullptr,
-      torrent_file ? torrent_file : "", cpp_webseed, cpp_options, position);
-  if (gid) {
-    *gid = static_cast<aria2_gid_t>(cpp_gid);
+  if (hash->algorithm) {
+    BCryptCloseAlgorithmProvider(hash->algorithm, 0);
+    hash->algorithm = nullptr;
   }
-  return result;
+#endif
+  hash->type = 0;
 }
 
-int aria2_add_torrent_simple(aria2_session_t* session,
-                             aria2_gid_t* gid,
-                                   const char* torrent_file,
-                                   const aria2_key_val_t* options,
-                                   size_t options_count,
-                                   int position)
+aria2_hash::~aria2_hash()
 {
-  if (!session) {
-    return -1;
+  aria2_hash_release(this);
+}
+
+// 开始计算 type 指定的摘要，加密库初始化失败时返回 false。
+static bool aria2_hash_init(aria2_hash* hash, int type)
+{
+  hash->type = type;
+  bool sha1 = type == ARIA2_DIGEST_SHA1;
+#if defined(ARIA2_C_API_OPENSSL)
+  hash->ctx = EVP_MD_CTX_new();
+  return hash->ctx &&
+         EVP_DigestInit_ex(hash->ctx, sha1 ? EVP_sha1() : EVP_sha256(),
+                           nullptr) == 1;
+#elif defined(ARIA2_C_API_COMMON_CRYPTO)
+  if (sha1) {
+    CC_SHA1_Init(&hash->sha1);
   }
-  auto cpp_options = aria2_to_key_vals(options, options_count);
-  aria2::A2Gid cpp_gid{};
-  int result = aria2::addTorrent(session->session, gid ? &cpp_gid : nullptr,
-                                 torrent_file ? torrent_file : "", cpp_options,
-                                 position);
-  if (gid) {
-    *gid = static_cast<aria2_gid_t>(cpp_gid);
+  else {
+    CC_SHA256_Init(&hash->sha256);
   }
-  return result;
+  return true;
+#elif defined(ARIA2_C_API_BCRYPT)
+  return BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(
+             &hash->algorithm,
+             sha1 ? BCRYPT_SHA1_ALGORITHM : BCRYPT_SHA256_ALGORITHM, nullptr,
+             0)) &&
+         BCRYPT_SUCCESS(BCryptCreateHash(hash->algorithm, &hash->handle,
+                                         nullptr, 0, nullptr, 0, 0));
+#else
+  if (sha1) {
+    aria2_sha1_init(&hash->md);
+  }
+  else {
+    aria2_sha256_init(&hash->md);
+  }
+  return true;
+#endif
 }
 
-int aria2_get_active_download(aria2_session_t* session,
-                              aria2_gid_t** gids,
-                                    size_t* gids_count)
+static void aria2_hash_update(aria2_hash* hash,
+                              const uint8_t* data,
+                              size_t size)
 {
-  if (!session) {
-    return -1;
+#if defined(ARIA2_C_API_OPENSSL)
+  EVP_DigestUpdate(hash->ctx, data, size);
+#elif defined(ARIA2_C_API_COMMON_CRYPTO) || defined(ARIA2_C_API_BCRYPT)
+  // 长度参数只有 32 位。
+  while (size > 0) {
+    uint32_t n = static_cast<uint32_t>(std::min<size_t>(size, 1u << 30));
+#  if defined(ARIA2_C_API_COMMON_CRYPTO)
+    if (hash->type == ARIA2_DIGEST_SHA1) {
+      CC_SHA1_Update(&hash->sha1, data, n);
+    }
+    else {
+      CC_SHA256_Update(&hash->sha256, data, n);
+    }
+#  else
+    BCryptHashData(hash->handle, const_cast<PUCHAR>(data), n, 0);
+#  endif
+    data += n;
+    size -= n;
   }
-  auto cpp_gids = aria2::getActiveDownload(session->session);
-  return aria2_copy_gid_vector(cpp_gids, gids, gids_count);
+#else
+  aria2_md_update(&hash->md,
+                  hash->type == ARIA2_DIGEST_SHA1 ? aria2_sha1_block
+                                                  : aria2_sha256_block,
+                  data, size);
+#endif
 }
 
-int aria2_remove_download(aria2_session_t* session,
-                          aria2_gid_t gid,
-                                int force)
+// 输出摘要并释放加密库资源。
+static void aria2_hash_final(aria2_hash* hash, uint8_t* out)
 {
-  if (!session) {
-    return -1;
+#if defined(ARIA2_C_API_OPENSSL)
+  unsigned int length = 0;
+  EVP_DigestFinal_ex(hash->ctx, out, &length);
+#elif defined(ARIA2_C_API_COMMON_CRYPTO)
+  if (hash->type == ARIA2_DIGEST_SHA1) {
+    CC_SHA1_Final(out, &hash->sha1);
+  }
+  else {
+    CC_SHA256_Final(out, &hash->sha256);
   }
-  return aria2::removeDownload(session->session,
-                               static_cast<aria2::A2Gid>(gid),
-                               force != 0);
+#elif defined(ARIA2_C_API_BCRYPT)
+  BCryptFinishHash(hash->handle, out,
+                   hash->type == ARIA2_DIGEST_SHA1 ? 20 : 32, 0);
+#else
+  bool sha1 = hash->type == ARIA2_DIGEST_SHA1;
+  aria2_md_final(&hash->md, sha1 ? aria2_sha1_block : aria2_sha256_block, out,
+                 sha1 ? 5 : 8);
+#endif
+  aria2_hash_release(hash);
 }
 
-int aria2_pause_download(aria2_session_t* session,
-                         aria2_gid_t gid,
-                               int force)
+static const uint64_t ARIA2_XXH_P1 = 0x9e3779b185ebca87ULL;
+static const uint64_t ARIA2_XXH_P2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t ARIA2_XXH_P3 = 0x165667b19e3779f9ULL;
+static const uint64_t ARIA2_XXH_P4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t ARIA2_XXH_P5 = 0x27d4eb2f165667c5ULL;
+
+static uint64_t aria2_xxh64_round(uint64_t acc, uint64_t input)
 {
-  if (!session) {
-    return -1;
+  return aria2_rotl64(acc + input * ARIA2_XXH_P2, 31) * ARIA2_XXH_P1;
+}
+
+static void aria2_xxh64_init(aria2_xxh64_state* state)
+{
+  state->v[0] = ARIA2_XXH_P1 + ARIA2_XXH_P2;
+  state->v[1] = ARIA2_XXH_P2;
+  state->v[2] = 0;
+  state->v[3] = 0 - ARIA2_XXH_P1;
+  state->used = 0;
+  state->length = 0;
+}
+
+static void aria2_xxh64_stripe(uint64_t* v, const uint8_t* p)
+{
+  for (int i = 0; i < 4; ++i) {
+    v[i] = aria2_xxh64_round(v[i], aria2_load_le64(p + i * 8));
   }
-  return aria2::pauseDownload(session->session,
-                              static_cast<aria2::A2Gid>(gid),
-                              force != 0);
 }
 
-int aria2_unpause_download(aria2_session_t* session,
-                           aria2_gid_t gid)
+static void aria2_xxh64_update(aria2_xxh64_state* state,
+                               const uint8_t* data,
+                               size_t size)
 {
-  if (!session) {
-    return -1;
+  state->length += size;
+  if (state->used) {
+    size_t n = std::min(size, sizeof(state->block) - state->used);
+    std::memcpy(state->block + state->used, data, n);
+    state->used += n;
+    data += n;
+    size -= n;
+    if (state->used < sizeof(state->block)) {
+      return;
+    }
+    aria2_xxh64_stripe(state->v, state->block);
+    state->used = 0;
+  }
+  for (; size >= 32; data += 32, size -= 32) {
+    aria2_xxh64_stripe(state->v, data);
   }
-  return aria2::unpauseDownload(session->session,
-                                static_cast<aria2::A2Gid>(gid));
+  std::memcpy(state->block, data, size);
+  state->used = size;
 }
 
-int aria2_change_option(aria2_session_t* session,
-                        aria2_gid_t gid,
-                        const aria2_key_val_t* options,
-                              size_t options_count)
+static uint64_t aria2_xxh64_final(const aria2_xxh64_state* state)
 {
-  if (!session) {
-    return -1;
+  uint64_t h;
+  if (state->length >= 32) {
+    const uint64_t* v = state->v;
+    h = aria2_rotl64(v[0], 1) + aria2_rotl64(v[1], 7) +
+        aria2_rotl64(v[2], 12) + aria2_rotl64(v[3], 18);
+    for (int i = 0; i < 4; ++i) {
+      h ^= aria2_xxh64_round(0, v[i]);
+      h = h * ARIA2_XXH_P1 + ARIA2_XXH_P4;
+    }
+  }
+  else {
+    h = ARIA2_XXH_P5;
+  }
+  h += state->length;
+  const uint8_t* p = state->block;
+  size_t left = state->used;
+  for (; left >= 8; p += 8, left -= 8) {
+    h ^= aria2_xxh64_round(0, aria2_load_le64(p));
+    h = aria2_rotl64(h, 27) * ARIA2_XXH_P1 + ARIA2_XXH_P4;
   }
-  auto cpp_options = aria2_to_key_vals(options, options_count);
-  return aria2::changeOption(session->session,
-                             static_cast<aria2::A2Gid>(gid),
-                             cpp_options);
+  if (left >= 4) {
+    uint32_t word = static_cast<uint32_t>(p[0]) |
+                    static_cast<uint32_t>(p[1]) << 8 |
+                    static_cast<uint32_t>(p[2]) << 16 |
+                    static_cast<uint32_t>(p[3]) << 24;
+    h ^= word * ARIA2_XXH_P1;
+    h = aria2_rotl64(h, 23) * ARIA2_XXH_P2 + ARIA2_XXH_P3;
+    p += 4;
+    left -= 4;
+  }
+  for (; left > 0; ++p, --left) {
+    h ^= *p * ARIA2_XXH_P5;
+    h = aria2_rotl64(h, 11) * ARIA2_XXH_P1;
+  }
+  h ^= h >> 33;
+  h *= ARIA2_XXH_P2;
+  h ^= h >> 29;
+  h *= ARIA2_XXH_P3;
+  h ^= h >> 32;
+  return h;
 }
 
-char* aria2_get_global_option(aria2_session_t* session, const char* name)
+// 从头开始计算摘要，加密库初始化失败时返回 false。
+static bool aria2_digest_start(aria2_digest_state& state)
 {
-  if (!session || !name) {
-    return nullptr;
+  state.length = 0;
+  state.held.clear();
+  state.pending.clear();
+  aria2_hash_release(&state.sha1);
+  aria2_hash_release(&state.sha256);
+  aria2_xxh64_init(&state.xxh64);
+  return (!(state.types & ARIA2_DIGEST_SHA1) ||
+          aria2_hash_init(&state.sha1, ARIA2_DIGEST_SHA1)) &&
+         (!(state.types & ARIA2_DIGEST_SHA256) ||
+          aria2_hash_init(&state.sha256, ARIA2_DIGEST_SHA256));
+}
+
+// 移除未完成的摘要。
+static void aria2_digest_drop(aria2_session_t* session, aria2::A2Gid gid)
+{
+  auto it = session->digests.find(gid);
+  if (it != session->digests.end() && !it->second.finished) {
+    session->digests.erase(it);
+  }
+  session->active_digests.erase(gid);
+  if (session->active_digests.empty()) {
+    std::vector<uint8_t>().swap(session->digest_buffer);
   }
-  const auto& value = aria2::getGlobalOption(session->session, name);
-  return aria2_strdup(value);
 }
 
-int aria2_get_global_options(aria2_session_t* session,
-                             aria2_key_val_t** options,
-                                   size_t* options_count)
+// 计入 [offset, offset + size) 中尚未计入的部分，数据必须从
+// state.length 或之前开始。
+static void aria2_digest_extend(aria2_digest_state& state,
+                                const uint8_t* data,
+                                size_t size,
+                                int64_t offset)
 {
-  if (!session) {
-    return -1;
+  int64_t end = offset + static_cast<int64_t>(size);
+  if (end <= state.length) {
+    return;
   }
-  auto cpp_options = aria2::getGlobalOptions(session->session);
-  return aria2_copy_key_vals(cpp_options, options, options_count);
+  size_t skip = static_cast<size_t>(state.length - offset);
+  data += skip;
+  size -= skip;
+  if (state.types & ARIA2_DIGEST_SHA1) {
+    aria2_hash_update(&state.sha1, data, size);
+  }
+  if (state.types & ARIA2_DIGEST_SHA256) {
+    aria2_hash_update(&state.sha256, data, size);
+  }
+  if (state.types & ARIA2_DIGEST_XXH64) {
+    aria2_xxh64_update(&state.xxh64, data, size);
+  }
+  state.length = end;
 }
 
-int aria2_change_global_option(aria2_session_t* session,
-                               const aria2_key_val_t* options,
-                                     size_t options_count)
+// 把与已计入前缀相接的保留数据和内存目标中的区间计入摘要。
+static void aria2_digest_advance(aria2_digest_state& state,
+                                 const aria2_memory_target* memory)
 {
-  if (!session) {
-    return -1;
+  while (!state.held.empty() && state.held.begin()->first <= state.length) {
+    auto chunk = state.held.begin();
+    aria2_digest_extend(state, chunk->second.data(), chunk->second.size(),
+                        chunk->first);
+    state.held.erase(chunk);
+  }
+  while (!state.pending.empty() &&
+         state.pending.begin()->first <= state.length) {
+    auto range = state.pending.begin();
+    int64_t end = range->second;
+    if (end > state.length) {
+      if (!memory || memory->spilled ||
+          end > static_cast<int64_t>(memory->buffer.length)) {
+        // 只能从文件读取，留给循环迭代后的补算。
+        return;
+      }
+      aria2_digest_extend(state, memory->buffer.data + state.length,
+                          static_cast<size_t>(end - state.length),
+                          state.length);
+    }
+    state.pending.erase(range);
   }
-  auto cpp_options = aria2_to_key_vals(options, options_count);
-  return aria2::changeGlobalOption(session->session, cpp_options);
 }
 
-aria2_global_stat_t aria2_get_global_stat(aria2_session_t* session)
+// 记录一个乱序写入的区间，与相邻或重叠的区间合并。
+static void aria2_digest_defer(aria2_digest_state& state,
+                               int64_t begin,
+                               int64_t end)
 {
-  aria2_global_stat_t stat{};
-  if (!session) {
-    return stat;
+  auto it = state.pending.upper_bound(begin);
+  if (it != state.pending.begin() && std::prev(it)->second >= begin) {
+    --it;
+    begin = it->first;
+    end = std::max(end, it->second);
+    it = state.pending.erase(it);
   }
-  auto cpp_stat = aria2::getGlobalStat(session->session);
-  stat.download_speed = cpp_stat.downloadSpeed;
-  stat.upload_speed = cpp_stat.uploadSpeed;
-  stat.num_active = cpp_stat.numActive;
-  stat.num_waiting = cpp_stat.numWaiting;
-  stat.num_stopped = cpp_stat.numStopped;
-  return stat;
+  while (it != state.pending.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    it = state.pending.erase(it);
+  }
+  state.pending.emplace(begin, end);
 }
 
-int aria2_change_position(aria2_session_t* session,
-                          aria2_gid_t gid,
-                                int pos,
-                                aria2_offset_mode_t how)
+// aria2 写入了一段数据。与已计入前缀相接的数据直接计入，乱序的数据
+// 记录区间，接收回调的数据另外保留副本。
+static void aria2_digest_write(aria2_session_t* session,
+                               aria2::A2Gid gid,
+                               const uint8_t* data,
+                               size_t size,
+                               int64_t offset)
 {
-  if (!session) {
+  auto it = session->digests.find(gid);
+  if (it == session->digests.end() || it->second.finished) {
+    return;
+  }
+  aria2_digest_state& state = it->second;
+  int64_t end = offset + static_cast<int64_t>(size);
+  if (end <= state.length) {
+    return;
+  }
+  auto memory = session->memory_targets.find(gid);
+  if (offset > state.length) {
+    try {
+      if (state.hold) {
+        std::vector<uint8_t>& chunk = state.held[offset];
+        if (chunk.size() < size) {
+          chunk.assign(data, data + size);
+        }
+      }
+      else {
+        aria2_digest_defer(state, offset, end);
+      }
+    }
+    catch (const std::bad_alloc&) {
+      aria2_digest_drop(session, gid);
+    }
+    return;
+  }
+  aria2_digest_extend(state, data, size, offset);
+  aria2_digest_advance(state, memory != session->memory_targets.end()
+                                  ? &memory->second
+                                  : nullptr);
+}
+
+static void aria2_digest_finish(aria2_session_t* session, aria2::A2Gid gid)
+{
+  auto it = session->digests.find(gid);
+  if (it == session->digests.end() || it->second.finished) {
+    return;
+  }
+  aria2_digest_state& state = it->second;
+  state.result.types = state.types;
+  state.result.length = state.length;
+  if (state.types & ARIA2_DIGEST_SHA1) {
+    aria2_hash_final(&state.sha1, state.result.sha1);
+  }
+  if (state.types & ARIA2_DIGEST_SHA256) {
+    aria2_hash_final(&state.sha256, state.result.sha256);
+  }
+  if (state.types & ARIA2_DIGEST_XXH64) {
+    state.result.xxh64 = aria2_xxh64_final(&state.xxh64);
+  }
+  state.finished = true;
+  state.held.clear();
+  state.pending.clear();
+  session->active_digests.erase(gid);
+  const size_t max_finished = 1000;
+  session->finished_digests.push_back(gid);
+  if (session->finished_digests.size() > max_finished) {
+    session->digests.erase(session->finished_digests.front());
+    session->finished_digests.pop_front();
+  }
+}
+
+static int aria2_fseek64(FILE* file, int64_t offset)
+{
+#if defined(_WIN32)
+  return _fseeki64(file, offset, SEEK_SET);
+#else
+  return fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+}
+
+// 从文件读取与已计入前缀相接的区间并计入摘要，最多读取 budget 字节，
+// 返回读取的字节数，文件无法读取时返回 -1。
+static int64_t aria2_digest_catch_up(aria2_session_t* session,
+                                     aria2_digest_state& state,
+                                     int64_t budget)
+{
+  if (state.pending.empty() || state.pending.begin()->first > state.length ||
+      budget <= 0) {
+    return 0;
+  }
+  FILE* file = std::fopen(state.path.c_str(), "rb");
+  if (!file || aria2_fseek64(file, state.length) != 0) {
+    if (file) {
+      std::fclose(file);
+    }
     return -1;
   }
-  return aria2::changePosition(session->session,
-                               static_cast<aria2::A2Gid>(gid),
-                               pos,
-                               static_cast<aria2::OffsetMode>(how));
-}
-
-int aria2_shutdown(aria2_session_t* session, int force)
-{
-  if (!session) {
-    return -1;
+  const size_t chunk = 1 << 20;
+  std::vector<uint8_t>& buffer = session->digest_buffer;
+  buffer.resize(chunk);
+  int64_t read = 0;
+  while (read < budget && !state.pending.empty() &&
+         state.pending.begin()->first <= state.length) {
+    auto range = state.pending.begin();
+    if (range->second <= state.length) {
+      state.pending.erase(range);
+      continue;
+    }
+    size_t want = static_cast<size_t>(std::min<int64_t>(
+        {range->second - state.length, budget - read,
+         static_cast<int64_t>(chunk)}));
+    size_t got = std::fread(buffer.data(), 1, want, file);
+    if (got == 0) {
+      std::fclose(file);
+      return -1;
+    }
+    aria2_digest_extend(state, buffer.data(), got, state.length);
+    read += static_cast<int64_t>(got);
+  }
+  std::fclose(file);
+  return read;
+}
+
+// 每次循环迭代后补算乱序写入的区间，每次迭代总共最多读取 4 MiB，
+// 返回是否仍有已完成的下载等待补算。
+static bool aria2_digest_pump(aria2_session_t* session)
+{
+  int64_t budget = 4 << 20;
+  bool waiting = false;
+  std::vector<aria2::A2Gid> gids(session->active_digests.begin(),
+                                 session->active_digests.end());
+  for (aria2::A2Gid gid : gids) {
+    auto it = session->digests.find(gid);
+    if (it == session->digests.end() || it->second.finished) {
+      session->active_digests.erase(gid);
+      continue;
+    }
+    aria2_digest_state& state = it->second;
+    int64_t read = aria2_digest_catch_up(session, state, budget);
+    if (read < 0 && state.ended) {
+      aria2_digest_drop(session, gid);
+      continue;
+    }
+    budget -= std::max<int64_t>(read, 0);
+    if (state.ended) {
+      if (state.pending.empty()) {
+        aria2_digest_finish(session, gid);
+      }
+      else {
+        waiting = true;
+      }
+    }
+  }
+  if (session->active_digests.empty()) {
+    std::vector<uint8_t>().swap(session->digest_buffer);
   }
-  return aria2::shutdown(session->session, force != 0);
+  return waiting;
 }
 
-aria2_download_handle_t* aria2_get_download_handle(aria2_session_t* session,
-                                                   aria2_gid_t gid)
+// 下载完成时所有数据都已写入，没有待补算的区间即可得出结果，否则留给
+// 之后的迭代；出错或停止的下载丢弃摘要。
+static void aria2_digest_event(aria2_session_t* session,
+                               aria2::DownloadEvent event,
+                               aria2::A2Gid gid)
 {
-  if (!session) {
-    return nullptr;
+  if (event != aria2::EVENT_ON_DOWNLOAD_COMPLETE &&
+      event != aria2::EVENT_ON_DOWNLOAD_ERROR &&
+      event != aria2::EVENT_ON_DOWNLOAD_STOP) {
+    return;
   }
-  auto* handle =
-      aria2::getDownloadHandle(session->session, static_cast<aria2::A2Gid>(gid));
-  if (!handle) {
-    return nullptr;
+  auto it = session->digests.find(gid);
+  if (it == session->digests.end() || it->second.finished) {
+    return;
   }
-  aria2_download_handle_t* c_handle =
-      static_cast<aria2_download_handle_t*>(std::malloc(sizeof(*c_handle)));
-  if (!c_handle) {
-    aria2::deleteDownloadHandle(handle);
-    return nullptr;
+  aria2_digest_state& state = it->second;
+  if (event != aria2::EVENT_ON_DOWNLOAD_COMPLETE || !state.held.empty() ||
+      (!state.pending.empty() && state.pending.begin()->first > state.length)) {
+    aria2_digest_drop(session, gid);
+    return;
+  }
+  state.ended = true;
+  if (state.pending.empty()) {
+    aria2_digest_finish(session, gid);
   }
-  c_handle->handle = handle;
-  return c_handle;
 }
 
-void aria2_delete_download_handle(aria2_download_handle_t* dh)
+// 把 aria2 对一个下载的写入转交给本库，只在事件循环线程上调用。
+class aria2_data_writer : public aria2::DataWriter {
+public:
+  aria2_data_writer(aria2_session_t* session, aria2::A2Gid gid)
+      : session_(session), gid_(gid)
+  {
+  }
+
+  int open(const std::string& path, int64_t total_length,
+           bool truncated) override;
+  int write(const unsigned char* data, size_t length, int64_t offset) override;
+  int64_t read(unsigned char* data, size_t length, int64_t offset) override;
+  int64_t size() override;
+
+private:
+  aria2_session_t* session_;
+  aria2::A2Gid gid_;
+  int64_t end_ = 0;
+};
+
+// 交给接收回调；暂存区非空或回调暂不接收时复制到暂存区末尾。
+static int aria2_sink_write(aria2_session_t* session,
+                            aria2::A2Gid gid,
+                            aria2_sink_state& sink,
+                            const uint8_t* data,
+                            size_t length,
+                            int64_t offset)
 {
-  if (!dh) {
-    return;
+  sink.end = std::max(sink.end, offset + static_cast<int64_t>(length));
+  if (sink.backlog.empty()) {
+    int rv = sink.config.callback(session, static_cast<aria2_gid_t>(gid),
+                                  offset, data, length,
+                                  sink.config.user_data);
+    if (rv <= 0) {
+      return rv;
+    }
+  }
+  try {
+    sink.backlog.emplace_back(offset,
+                              std::vector<uint8_t>(data, data + length));
+  }
+  catch (const std::bad_alloc&) {
+    return -1;
   }
-  aria2::deleteDownloadHandle(dh->handle);
-  std::free(dh);
+  sink.backlog_bytes += static_cast<int64_t>(length);
+  return 0;
 }
 
-aria2_download_status_t
-aria2_download_handle_get_status(aria2_download_handle_t* dh)
+// 写入内存目标的缓冲区。超过上限或无法分配时返回 1，让 aria2 溢出到
+// 文件；aria2 从缓冲区复制已写入的数据后再次写入同一区间，此时释放
+// 缓冲区，之后的写入只进入文件。
+static int aria2_memory_target_write(aria2_memory_target& target,
+                                     const uint8_t* data,
+                                     size_t length,
+                                     int64_t offset)
 {
-  if (!dh) {
-    return ARIA2_DOWNLOAD_ERROR;
+  if (target.spilled) {
+    std::free(target.buffer.data);
+    target.buffer = aria2_binary_t{};
+    target.capacity = 0;
+    return 0;
   }
-  return static_cast<aria2_download_status_t>(dh->handle->getStatus());
+  int64_t end = offset + static_cast<int64_t>(length);
+  if (end > target.max_bytes || target.total > target.max_bytes) {
+    target.spilled = true;
+    return 1;
+  }
+  size_t need = static_cast<size_t>(end);
+  if (need > target.capacity) {
+    // 长度已知时一次分配全部空间。
+    size_t capacity =
+        target.total > 0
+            ? static_cast<size_t>(target.total)
+            : std::min(std::max({need, target.capacity * 2,
+                                 static_cast<size_t>(64 * 1024)}),
+                       static_cast<size_t>(target.max_bytes));
+    void* grown = std::realloc(target.buffer.data, capacity);
+    if (!grown) {
+      target.spilled = true;
+      return 1;
+    }
+    target.buffer.data = static_cast<uint8_t*>(grown);
+    target.capacity = capacity;
+  }
+  size_t begin = static_cast<size_t>(offset);
+  if (begin > target.buffer.length) {
+    std::memset(target.buffer.data + target.buffer.length, 0,
+                begin - target.buffer.length);
+  }
+  std::memcpy(target.buffer.data + begin, data, length);
+  target.buffer.length = std::max(target.buffer.length, need);
+  return 0;
 }
 
-int64_t aria2_download_handle_get_total_length(aria2_download_handle_t* dh)
+int aria2_data_writer::open(const std::string& path,
+                            int64_t total_length,
+                            bool truncated)
 {
-  return dh ? dh->handle->getTotalLength() : 0;
+  auto digest = session_->digests.find(gid_);
+  if (digest != session_->digests.end() && !digest->second.finished) {
+    aria2_digest_state& state = digest->second;
+    // 续传时文件中已有的部分没有经过写入器，摘要无法得出。
+    if (!truncated || !aria2_digest_start(state)) {
+      aria2_digest_drop(session_, gid_);
+    }
+    else {
+      try {
+        state.path = path;
+      }
+      catch (const std::bad_alloc&) {
+        aria2_digest_drop(session_, gid_);
+      }
+    }
+  }
+  auto memory = session_->memory_targets.find(gid_);
+  if (memory != session_->memory_targets.end()) {
+    aria2_memory_target& target = memory->second;
+    target.total = total_length;
+    // 重新开始的下载从内存重新写起。
+    if (truncated) {
+      target.buffer.length = 0;
+      target.spilled = false;
+    }
+  }
+  return 0;
 }
 
-int64_t aria2_download_handle_get_completed_length(
-    aria2_download_handle_t* dh)
+int aria2_data_writer::write(const unsigned char* data,
+                             size_t length,
+                             int64_t offset)
 {
-  return dh ? dh->handle->getCompletedLength() : 0;
+  end_ = std::max(end_, offset + static_cast<int64_t>(length));
+  auto memory = session_->memory_targets.find(gid_);
+  if (memory != session_->memory_targets.end()) {
+    int rv = aria2_memory_target_write(memory->second, data, length, offset);
+    if (rv != 0) {
+      return rv;
+    }
+  }
+  else {
+    auto sink = session_->sinks.find(gid_);
+    if (sink != session_->sinks.end() &&
+        aria2_sink_write(session_, gid_, sink->second, data, length,
+                         offset) != 0) {
+      return -1;
+    }
+  }
+  if (!session_->active_digests.empty()) {
+    aria2_digest_write(session_, gid_, data, length, offset);
+  }
+  if (session_->timings) {
+    aria2_timings_write(session_, gid_);
+  }
+  return 0;
 }
 
-int64_t aria2_download_handle_get_upload_length(aria2_download_handle_t* dh)
+int64_t aria2_data_writer::read(unsigned char* data,
+                                size_t length,
+                                int64_t offset)
 {
-  return dh ? dh->handle->getUploadLength() : 0;
+  auto memory = session_->memory_targets.find(gid_);
+  // 接收回调的数据不保留。
+  if (memory == session_->memory_targets.end() || offset < 0) {
+    return -1;
+  }
+  const aria2_binary_t& buffer = memory->second.buffer;
+  if (static_cast<uint64_t>(offset) >= buffer.length) {
+    return 0;
+  }
+  size_t n = std::min(length, buffer.length - static_cast<size_t>(offset));
+  std::memcpy(data, buffer.data + offset, n);
+  return static_cast<int64_t>(n);
 }
 
-aria2_binary_t aria2_download_handle_get_bitfield(
-    aria2_download_handle_t* dh)
+int64_t aria2_data_writer::size()
 {
-  if (!dh) {
-    return aria2_binary_t{};
+  auto memory = session_->memory_targets.find(gid_);
+  if (memory != session_->memory_targets.end()) {
+    return static_cast<int64_t>(memory->second.buffer.length);
   }
-  return aria2_make_binary(dh->handle->getBitfield());
+  return end_;
 }
 
-int aria2_download_handle_get_download_speed(aria2_download_handle_t* dh)
+// 按顺序重新交付暂存的数据。全部交付返回 0，回调暂不接收返回 1，
+// 回调要求失败返回 -1。
+static int aria2_sink_flush(aria2_session_t* session,
+                            aria2::A2Gid gid,
+                            aria2_sink_state& sink)
 {
-  return dh ? dh->handle->getDownloadSpeed() : 0;
+  while (!sink.backlog.empty()) {
+    const auto& chunk = sink.backlog.front();
+    int rv = sink.config.callback(session, static_cast<aria2_gid_t>(gid),
+                                  chunk.first, chunk.second.data(),
+                                  chunk.second.size(), sink.config.user_data);
+    if (rv != 0) {
+      return rv < 0 ? -1 : 1;
+    }
+    sink.backlog_bytes -= static_cast<int64_t>(chunk.second.size());
+    sink.backlog.pop_front();
+  }
+  return 0;
 }
 
-int aria2_download_handle_get_upload_speed(aria2_download_handle_t* dh)
+// 发送结束调用并移除接收回调。
+static void aria2_sink_close(aria2_session_t* session, aria2::A2Gid gid)
 {
-  return dh ? dh->handle->getUploadSpeed() : 0;
+  auto it = session->sinks.find(gid);
+  if (it == session->sinks.end()) {
+    return;
+  }
+  aria2_sink_t config = it->second.config;
+  int64_t end = it->second.end;
+  session->sinks.erase(it);
+  config.callback(session, static_cast<aria2_gid_t>(gid), end, nullptr, 0,
+                  config.user_data);
 }
 
-aria2_binary_t aria2_download_handle_get_info_hash(
-    aria2_download_handle_t* dh)
+// 暂存的数据超过上限时把下载限速到每秒 1 字节，回落到一半以下时恢复。
+static void aria2_sink_throttle(aria2_session_t* session,
+                                aria2::A2Gid gid,
+                                aria2_sink_state& sink)
 {
-  if (!dh) {
-    return aria2_binary_t{};
+  if (!sink.throttled && sink.backlog_bytes > sink.config.max_backlog) {
+    aria2::DownloadHandle* handle =
+        aria2::getDownloadHandle(session->session, gid);
+    if (!handle) {
+      return;
+    }
+    std::string limit = handle->getOption("max-download-limit");
+    aria2::deleteDownloadHandle(handle);
+    if (aria2::changeOption(session->session, gid,
+                            {{"max-download-limit", "1"}}) == 0) {
+      sink.saved_limit = limit.empty() ? "0" : limit;
+      sink.throttled = true;
+    }
+  }
+  else if (sink.throttled &&
+           sink.backlog_bytes <= sink.config.max_backlog / 2 &&
+           aria2::changeOption(session->session, gid,
+                               {{"max-download-limit", sink.saved_limit}}) ==
+               0) {
+    sink.throttled = false;
   }
-  return aria2_make_binary(dh->handle->getInfoHash());
 }
 
-size_t aria2_download_handle_get_piece_length(aria2_download_handle_t* dh)
+// 下载结束：完成时先交付暂存的数据再发送结束调用，否则丢弃暂存的数据。
+// 回调暂不接收时，完成的下载留给之后的迭代处理。
+static void aria2_sink_event(aria2_session_t* session,
+                             aria2::DownloadEvent event,
+                             aria2::A2Gid gid)
 {
-  return dh ? dh->handle->getPieceLength() : 0;
+  if (event != aria2::EVENT_ON_DOWNLOAD_COMPLETE &&
+      event != aria2::EVENT_ON_DOWNLOAD_ERROR &&
+      event != aria2::EVENT_ON_DOWNLOAD_STOP) {
+    return;
+  }
+  auto it = session->sinks.find(gid);
+  if (it == session->sinks.end()) {
+    return;
+  }
+  if (event == aria2::EVENT_ON_DOWNLOAD_COMPLETE) {
+    it->second.ended = true;
+    if (aria2_sink_flush(session, gid, it->second) == 1) {
+      return;
+    }
+  }
+  aria2_sink_close(session, gid);
 }
 
-int aria2_download_handle_get_num_pieces(aria2_download_handle_t* dh)
+// 每次循环迭代后重新交付暂存的数据并调整限速，返回是否仍有已完成的
+// 下载等待交付。
+static bool aria2_sink_pump(aria2_session_t* session)
 {
-  return dh ? dh->handle->getNumPieces() : 0;
+  // 回调中可能移除下载并触发结束事件，先复制 gid 列表。
+  std::vector<aria2::A2Gid> gids;
+  gids.reserve(session->sinks.size());
+  for (const auto& entry : session->sinks) {
+    if (!entry.second.backlog.empty() || entry.second.throttled) {
+      gids.push_back(entry.first);
+    }
+  }
+  bool pending = false;
+  for (aria2::A2Gid gid : gids) {
+    auto it = session->sinks.find(gid);
+    if (it == session->sinks.end()) {
+      continue;
+    }
+    aria2_sink_state& sink = it->second;
+    int rv = aria2_sink_flush(session, gid, sink);
+    if (sink.ended) {
+      if (rv == 1) {
+        pending = true;
+      }
+      else {
+        aria2_sink_close(session, gid);
+      }
+      continue;
+    }
+    if (rv < 0) {
+      sink.backlog.clear();
+      sink.backlog_bytes = 0;
+      // 结束调用在停止事件中发送。
+      if (aria2::removeDownload(session->session, gid, true) == 0) {
+        aria2_change_feed_touch(session, gid, ARIA2_DOWNLOAD_REMOVED);
+        aria2_invalidate_handle(session, gid);
+      }
+      continue;
+    }
+    if (sink.config.max_backlog > 0) {
+      aria2_sink_throttle(session, gid, sink);
+    }
+  }
+  return pending;
 }
 
-int aria2_download_handle_get_connections(aria2_download_handle_t* dh)
+// 内存目标下载结束：完成时保留缓冲区等待取走，否则释放。
+static void aria2_memory_target_event(aria2_session_t* session,
+                                      aria2::DownloadEvent event,
+                                      aria2::A2Gid gid)
 {
-  return dh ? dh->handle->getConnections() : 0;
+  if (event != aria2::EVENT_ON_DOWNLOAD_COMPLETE &&
+      event != aria2::EVENT_ON_DOWNLOAD_ERROR &&
+      event != aria2::EVENT_ON_DOWNLOAD_STOP) {
+    return;
+  }
+  auto it = session->memory_targets.find(gid);
+  if (it == session->memory_targets.end()) {
+    return;
+  }
+  if (event != aria2::EVENT_ON_DOWNLOAD_COMPLETE) {
+    std::free(it->second.buffer.data);
+    session->memory_targets.erase(it);
+    return;
+  }
+  it->second.complete = true;
 }
 
-int aria2_download_handle_get_error_code(aria2_download_handle_t* dh)
+// 为尚未开始的下载安装数据写入器，接收回调、内存目标和摘要的状态在
+// 调用前已登记。只计算摘要的下载照常写入文件。
+static int aria2_install_data_writer(aria2_session_t* session,
+                                     aria2::A2Gid gid)
 {
-  return dh ? dh->handle->getErrorCode() : 0;
+  aria2::DataWriterMode mode =
+      session->memory_targets.count(gid) || session->sinks.count(gid)
+          ? aria2::DATA_WRITER_REPLACE
+          : aria2::DATA_WRITER_OBSERVE;
+  try {
+    auto writer = std::make_shared<aria2_data_writer>(session, gid);
+    return aria2::setDataWriter(session->session, gid, writer, mode);
+  }
+  catch (const std::bad_alloc&) {
+    return -1;
+  }
 }
 
-int aria2_download_handle_get_followed_by(aria2_download_handle_t* dh,
-                                          aria2_gid_t** gids,
-                                                size_t* gids_count)
+static int aria2_attach_memory_target(aria2_session_t* session,
+                                      aria2::A2Gid gid,
+                                      int64_t max_bytes)
 {
-  if (!dh) {
+  if (session->memory_targets.count(gid) || session->sinks.count(gid)) {
     return -1;
   }
-  return aria2_copy_gid_vector(dh->handle->getFollowedBy(), gids,
-                                     gids_count);
+  try {
+    session->memory_targets[gid].max_bytes = max_bytes;
+  }
+  catch (const std::bad_alloc&) {
+    return -1;
+  }
+  if (aria2_install_data_writer(session, gid) != 0) {
+    session->memory_targets.erase(gid);
+    return -1;
+  }
+  return 0;
 }
 
-aria2_gid_t aria2_download_handle_get_following(
-    aria2_download_handle_t* dh)
+// 登记摘要，没有内存目标和接收回调的下载安装只观察写入的写入器。
+// 已安装写入器的下载必须尚未写入数据。
+static int aria2_attach_digests(aria2_session_t* session,
+                                aria2::A2Gid gid,
+                                int types)
 {
-  return dh ? static_cast<aria2_gid_t>(dh->handle->getFollowing()) : 0;
+  if (session->digests.count(gid)) {
+    return -1;
+  }
+  auto memory = session->memory_targets.find(gid);
+  auto sink = session->sinks.find(gid);
+  if ((memory != session->memory_targets.end() &&
+       (memory->second.buffer.length || memory->second.spilled)) ||
+      (sink != session->sinks.end() && sink->second.end > 0)) {
+    return -1;
+  }
+  try {
+    aria2_digest_state& state = session->digests[gid];
+    state.types = types;
+    state.hold = sink != session->sinks.end();
+    session->active_digests.insert(gid);
+  }
+  catch (const std::bad_alloc&) {
+    aria2_digest_drop(session, gid);
+    return -1;
+  }
+  if (!aria2_digest_start(session->digests[gid]) ||
+      (memory == session->memory_targets.end() &&
+       sink == session->sinks.end() &&
+       aria2_install_data_writer(session, gid) != 0)) {
+    aria2_digest_drop(session, gid);
+    return -1;
+  }
+  return 0;
 }
 
-aria2_gid_t aria2_download_handle_get_belongs_to(
-    aria2_download_handle_t* dh)
+// 按选项集合为刚添加的下载安装数据写入器。
+static int aria2_attach_data_writer(aria2_session_t* session,
+                                    aria2::A2Gid gid,
+                                    const aria2_option_set_t* option_set)
 {
-  return dh ? static_cast<aria2_gid_t>(dh->handle->getBelongsTo()) : 0;
+  if (!option_set) {
+    return 0;
+  }
+  if (option_set->memory_target > 0 &&
+      aria2_attach_memory_target(session, gid, option_set->memory_target) !=
+          0) {
+    return -1;
+  }
+  if (option_set->sink.callback) {
+    try {
+      session->sinks[gid].config = option_set->sink;
+    }
+    catch (const std::bad_alloc&) {
+      return -1;
+    }
+    if (aria2_install_data_writer(session, gid) != 0) {
+      session->sinks.erase(gid);
+      return -1;
+    }
+  }
+  if (option_set->digests) {
+    return aria2_attach_digests(session, gid, option_set->digests);
+  }
+  return 0;
 }
 
-char* aria2_download_handle_get_dir(aria2_download_handle_t* dh)
+int aria2_set_download_memory_target(aria2_session_t* session,
+                                     aria2_gid_t gid,
+                                     int64_t max_bytes)
 {
-  return dh ? aria2_strdup(dh->handle->getDir()) : nullptr;
+  ARIA2_API_SCOPE(aria2_set_download_memory_target);
+  if (!session || max_bytes <= 0) {
+    return -1;
+  }
+  return aria2_session_call(session, [&]() -> int {
+    return aria2_attach_memory_target(
+        session, static_cast<aria2::A2Gid>(gid), max_bytes);
+  });
 }
 
-int aria2_download_handle_get_files(aria2_download_handle_t* dh,
-                                    aria2_file_data_t** files,
-                                          size_t* files_count)
+int aria2_download_handle_take_buffer(aria2_download_handle_t* dh,
+                                      aria2_binary_t* buffer)
 {
-  if (!dh) {
+  ARIA2_API_SCOPE(aria2_download_handle_take_buffer);
+  if (!dh || !buffer) {
     return -1;
   }
-  return aria2_copy_file_data_vector(dh->handle->getFiles(), files,
-                                           files_count);
+  aria2_session_t* session = dh->session;
+  return aria2_session_call(session, [&]() -> int {
+    auto it = session->memory_targets.find(dh->gid);
+    if (it == session->memory_targets.end() || !it->second.complete) {
+      return -1;
+    }
+    int rv = it->second.spilled ? 1 : 0;
+    *buffer = it->second.buffer;
+    session->memory_targets.erase(it);
+    return rv;
+  });
 }
 
-int aria2_download_handle_get_num_files(aria2_download_handle_t* dh)
+// 区间就绪返回 0，已不可能就绪返回 -1，仍需等待返回 1。
+static int aria2_range_state(aria2::DownloadStatus status,
+                             const std::string& bits,
+                             size_t num_pieces,
+                             int64_t piece_length,
+                             int64_t total,
+                             const aria2_range_watch& watch)
 {
-  return dh ? dh->handle->getNumFiles() : 0;
+  if (status == aria2::DOWNLOAD_ERROR || status == aria2::DOWNLOAD_REMOVED) {
+    return -1;
+  }
+  if (total <= 0) {
+    return status == aria2::DOWNLOAD_COMPLETE ? -1 : 1;
+  }
+  int64_t end = watch.end < 0 ? total : watch.end;
+  if (end > total) {
+    return -1;
+  }
+  if (watch.begin >= end || status == aria2::DOWNLOAD_COMPLETE) {
+    return 0;
+  }
+  if (piece_length <= 0) {
+    return 1;
+  }
+  size_t first = static_cast<size_t>(watch.begin / piece_length);
+  size_t last = static_cast<size_t>((end - 1) / piece_length);
+  if (last >= num_pieces) {
+    return 1;
+  }
+  for (size_t i = first; i <= last; ++i) {
+    if (!(static_cast<uint8_t>(bits[i / 8]) & (0x80 >> (i % 8)))) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
-aria2_file_data_t aria2_download_handle_get_file(
-    aria2_download_handle_t* dh,
-    int index)
+// 检查区间等待，使用与 aria2_get_bitfield_delta 共用的位图记录，
+// 只在位图或状态变化后重新检查已检查过的等待。
+static void aria2_range_watch_scan(aria2_session_t* session)
 {
-  aria2_file_data_t result{};
-  if (!dh) {
-    return result;
+  struct fired {
+    aria2::A2Gid gid;
+    aria2_range_watch watch;
+    int result;
+  };
+  std::vector<fired> ready;
+  for (auto it = session->range_watches.begin();
+       it != session->range_watches.end();) {
+    aria2::DownloadStatus status = aria2::DOWNLOAD_REMOVED;
+    static const std::string no_bits;
+    const std::string* bits = &no_bits;
+    size_t num_pieces = 0;
+    int64_t piece_length = 0;
+    int64_t total = 0;
+    bool changed = true;
+    aria2_bitfield_track* track = nullptr;
+    auto found = session->bitfields.find(it->first);
+    uint64_t version =
+        found == session->bitfields.end() ? 0 : found->second.version;
+    aria2::DownloadStatus last_status = found == session->bitfields.end()
+                                            ? aria2::DOWNLOAD_REMOVED
+                                            : found->second.status;
+    if (aria2_bitfield_refresh(session, it->first)) {
+      track = &session->bitfields[it->first];
+      status = track->status;
+      bits = &track->bits;
+      num_pieces = track->num_pieces;
+      piece_length = track->piece_length;
+      total = track->total;
+      changed = track->version != version || track->status != last_status;
+    }
+    std::vector<aria2_range_watch>& watches = it->second;
+    size_t kept = 0;
+    for (aria2_range_watch& watch : watches) {
+      int state = 1;
+      if (changed || !watch.checked) {
+        state = aria2_range_state(status, *bits, num_pieces, piece_length,
+                                  total, watch);
+        watch.checked = true;
+      }
+      if (state == 1) {
+        watches[kept++] = watch;
+      }
+      else {
+        ready.push_back(fired{it->first, watch, state});
+      }
+    }
+    watches.resize(kept);
+    if (watches.empty()) {
+      if (track && !track->delta) {
+        session->bitfields.erase(it->first);
+      }
+      it = session->range_watches.erase(it);
+    }
+    else {
+      ++it;
+    }
   }
-  aria2::FileData file = dh->handle->getFile(index);
-  if (aria2_copy_file_data(file, &result) != 0) {
-    return aria2_file_data_t{};
+  // 回调中可能添加新的等待，在遍历结束后调用。
+  for (const fired& entry : ready) {
+    entry.watch.callback(session, static_cast<aria2_gid_t>(entry.gid),
+                         entry.watch.begin, entry.watch.end, entry.result,
+                         entry.watch.user_data);
   }
-  return result;
 }
 
-aria2_bt_meta_info_data_t
-aria2_download_handle_get_bt_meta_info(aria2_download_handle_t* dh)
+int aria2_watch_range(aria2_session_t* session,
+                      aria2_gid_t gid,
+                      int64_t begin,
+                      int64_t end,
+                      aria2_range_callback callback,
+                      void* user_data)
 {
-  aria2_bt_meta_info_data_t result{};
-  if (!dh) {
-    return result;
-  }
-  aria2::BtMetaInfoData info = dh->handle->getBtMetaInfo();
-  result.comment = aria2_strdup(info.comment);
-  result.creation_date = static_cast<int64_t>(info.creationDate);
-  result.mode = static_cast<aria2_bt_file_mode_t>(info.mode);
-  result.name = aria2_strdup(info.name);
-  if (aria2_copy_string_list_array(info.announceList,
-                                   &result.announce_list,
-                                   &result.announce_list_count) != 0) {
-    aria2_free_bt_meta_info_data(&result);
-    return aria2_bt_meta_info_data_t{};
+  ARIA2_API_SCOPE(aria2_watch_range);
+  if (!session || !callback || begin < 0 || (end >= 0 && end < begin)) {
+    return -1;
   }
-  return result;
+  return aria2_session_call(session, [&]() -> int {
+    aria2::DownloadHandle* handle =
+        aria2::getDownloadHandle(session->session,
+                                 static_cast<aria2::A2Gid>(gid));
+    if (!handle) {
+      return -1;
+    }
+    aria2::deleteDownloadHandle(handle);
+    try {
+      session->range_watches[static_cast<aria2::A2Gid>(gid)].push_back(
+          aria2_range_watch{begin, end, callback, user_data, false});
+    }
+    catch (const std::bad_alloc&) {
+      return -1;
+    }
+    return 0;
+  });
 }
 
-char* aria2_download_handle_get_option(aria2_download_handle_t* dh,
-                                       const char* name)
+int aria2_set_download_digests(aria2_session_t* session,
+                               aria2_gid_t gid,
+                               int types)
 {
-  if (!dh || !name) {
-    return nullptr;
+  ARIA2_API_SCOPE(aria2_set_download_digests);
+  const int all =
+      ARIA2_DIGEST_SHA1 | ARIA2_DIGEST_SHA256 | ARIA2_DIGEST_XXH64;
+  if (!session || !types || (types & ~all)) {
+    return -1;
   }
-  const auto& value = dh->handle->getOption(name);
-  return aria2_strdup(value);
+  return aria2_session_call(session, [&]() -> int {
+    return aria2_attach_digests(session, static_cast<aria2::A2Gid>(gid),
+                                types);
+  });
 }
 
-int aria2_download_handle_get_options(aria2_download_handle_t* dh,
-                                      aria2_key_val_t** options,
-                                            size_t* options_count)
+int aria2_download_handle_get_digests(aria2_download_handle_t* dh,
+                                      aria2_download_digests_t* digests)
 {
-  if (!dh) {
+  ARIA2_API_SCOPE(aria2_download_handle_get_digests);
+  if (!dh || !digests) {
     return -1;
   }
-  auto cpp_options = dh->handle->getOptions();
-  return aria2_copy_key_vals(cpp_options, options, options_count);
+  aria2_session_t* session = dh->session;
+  return aria2_session_call(session, [&]() -> int {
+    auto it = session->digests.find(dh->gid);
+    if (it == session->digests.end()) {
+      return -1;
+    }
+    const aria2_digest_state& state = it->second;
+    if (!state.finished) {
+      *digests = aria2_download_digests_t{};
+      digests->types = state.types;
+      digests->length = state.length;
+      return 1;
+    }
+    *digests = state.result;
+    return 0;
+  });
 }
 
 void aria2_free(void* ptr)
 {
+  ARIA2_API_SCOPE(aria2_free);
   std::free(ptr);
 }
 
 void aria2_free_key_vals(aria2_key_val_t* options, size_t count)
 {
+  ARIA2_API_SCOPE(aria2_free_key_vals);
   if (!options) {
     return;
   }
@@ -859,6 +6336,7 @@ void aria2_free_key_vals(aria2_key_val_t* options, size_t count)
 
 void aria2_free_uri_data_array(aria2_uri_data_t* uris, size_t count)
 {
+  ARIA2_API_SCOPE(aria2_free_uri_data_array);
   if (!uris) {
     return;
   }
@@ -870,6 +6348,7 @@ void aria2_free_uri_data_array(aria2_uri_data_t* uris, size_t count)
 
 void aria2_free_file_data(aria2_file_data_t* file)
 {
+  ARIA2_API_SCOPE(aria2_free_file_data);
   if (!file) {
     return;
   }
@@ -884,6 +6363,7 @@ void aria2_free_file_data(aria2_file_data_t* file)
 
 void aria2_free_file_data_array(aria2_file_data_t* files, size_t count)
 {
+  ARIA2_API_SCOPE(aria2_free_file_data_array);
   if (!files) {
     return;
   }
@@ -895,6 +6375,7 @@ void aria2_free_file_data_array(aria2_file_data_t* files, size_t count)
 
 void aria2_free_string_list(aria2_string_list_t* list)
 {
+  ARIA2_API_SCOPE(aria2_free_string_list);
   if (!list) {
     return;
   }
@@ -910,6 +6391,7 @@ void aria2_free_string_list(aria2_string_list_t* list)
 
 void aria2_free_string_list_array(aria2_string_list_t* lists, size_t count)
 {
+  ARIA2_API_SCOPE(aria2_free_string_list_array);
   if (!lists) {
     return;
   }
@@ -921,6 +6403,7 @@ void aria2_free_string_list_array(aria2_string_list_t* lists, size_t count)
 
 void aria2_free_bt_meta_info_data(aria2_bt_meta_info_data_t* meta)
 {
+  ARIA2_API_SCOPE(aria2_free_bt_meta_info_data);
   if (!meta) {
     return;
   }
@@ -938,6 +6421,7 @@ void aria2_free_bt_meta_info_data(aria2_bt_meta_info_data_t* meta)
 
 void aria2_free_binary(aria2_binary_t* bin)
 {
+  ARIA2_API_SCOPE(aria2_free_binary);
   if (!bin) {
     return;
   }
@@ -945,3 +6429,13 @@ void aria2_free_binary(aria2_binary_t* bin)
   bin->data = nullptr;
   bin->length = 0;
 }
+
+void aria2_free_status_snapshot(aria2_status_snapshot_t* snapshot)
+{
+  ARIA2_API_SCOPE(aria2_free_status_snapshot);
+  if (!snapshot) {
+    return;
+  }
+  std::free(snapshot->gids);
+  *snapshot = aria2_status_snapshot_t{};
+}
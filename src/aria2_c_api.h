@@ -20,9 +20,58 @@ extern "C" {
 
 typedef struct aria2_session_t aria2_session_t;
 typedef struct aria2_download_handle_t aria2_download_handle_t;
+typedef struct aria2_arena_t aria2_arena_t;
+typedef struct aria2_option_set_t aria2_option_set_t;
 
 typedef uint64_t aria2_gid_t;
 
+/*
+ * 数值和布尔选项的 ID 表：X(ID, 选项名)。
+ */
+#define ARIA2_OPTION_TABLE(X)                                       \
+  X(MAX_CONCURRENT_DOWNLOADS, "max-concurrent-downloads")           \
+  X(SPLIT, "split")                                                 \
+  X(MAX_CONNECTION_PER_SERVER, "max-connection-per-server")         \
+  X(MIN_SPLIT_SIZE, "min-split-size")                               \
+  X(PIECE_LENGTH, "piece-length")                                   \
+  X(MAX_OVERALL_DOWNLOAD_LIMIT, "max-overall-download-limit")       \
+  X(MAX_OVERALL_UPLOAD_LIMIT, "max-overall-upload-limit")           \
+  X(MAX_DOWNLOAD_LIMIT, "max-download-limit")                       \
+  X(MAX_UPLOAD_LIMIT, "max-upload-limit")                           \
+  X(LOWEST_SPEED_LIMIT, "lowest-speed-limit")                       \
+  X(MAX_TRIES, "max-tries")                                         \
+  X(RETRY_WAIT, "retry-wait")                                       \
+  X(TIMEOUT, "timeout")                                             \
+  X(CONNECT_TIMEOUT, "connect-timeout")                             \
+  X(MAX_FILE_NOT_FOUND, "max-file-not-found")                       \
+  X(MAX_RESUME_FAILURE_TRIES, "max-resume-failure-tries")           \
+  X(DISK_CACHE, "disk-cache")                                       \
+  X(MAX_DOWNLOAD_RESULT, "max-download-result")                     \
+  X(AUTO_SAVE_INTERVAL, "auto-save-interval")                       \
+  X(SAVE_SESSION_INTERVAL, "save-session-interval")                 \
+  X(BT_MAX_PEERS, "bt-max-peers")                                   \
+  X(BT_REQUEST_PEER_SPEED_LIMIT, "bt-request-peer-speed-limit")     \
+  X(CONTINUE, "continue")                                           \
+  X(ALLOW_OVERWRITE, "allow-overwrite")                             \
+  X(AUTO_FILE_RENAMING, "auto-file-renaming")                       \
+  X(CHECK_INTEGRITY, "check-integrity")                             \
+  X(REMOTE_TIME, "remote-time")                                     \
+  X(PAUSE, "pause")                                                 \
+  X(ALWAYS_RESUME, "always-resume")                                 \
+  X(FORCE_SAVE, "force-save")                                       \
+  X(REALTIME_CHUNK_CHECKSUM, "realtime-chunk-checksum")             \
+  X(ENABLE_HTTP_KEEP_ALIVE, "enable-http-keep-alive")               \
+  X(ENABLE_HTTP_PIPELINING, "enable-http-pipelining")               \
+  X(ENABLE_DHT, "enable-dht")                                       \
+  X(BT_ENABLE_LPD, "bt-enable-lpd")
+
+typedef enum {
+#define ARIA2_OPTION_ENUM(id, name) ARIA2_OPT_##id,
+  ARIA2_OPTION_TABLE(ARIA2_OPTION_ENUM)
+#undef ARIA2_OPTION_ENUM
+  ARIA2_OPT_COUNT
+} aria2_option_id_t;
+
 typedef enum {
   ARIA2_EVENT_ON_DOWNLOAD_START = 1,
   ARIA2_EVENT_ON_DOWNLOAD_PAUSE,
@@ -68,11 +117,47 @@ typedef int (*aria2_download_event_callback)(aria2_session_t* session,
                                              aria2_gid_t gid,
                                              void* user_data);
 
+typedef void (*aria2_session_task_t)(aria2_session_t* session,
+                                     void* user_data);
+
+typedef int (*aria2_tick_callback)(aria2_session_t* session, void* user_data);
+
+/*
+ * threaded 非 0 时由库创建事件循环线程并在其中驱动下载，
+ * 此时不能调用 aria2_run。其他线程上的 API 调用会通过无锁队列
+ * 转发到事件循环线程，在两次循环迭代之间执行并阻塞等待结果。入队时
+ * 唤醒 aria2 对网络事件的等待，调用在当前迭代结束后即执行；Windows 上
+ * 没有可供等待的描述符，最长要等 aria2 的一次等待超时（约 1 秒）。
+ * 事件回调也在事件循环线程上调用。在事件循环线程上（事件回调、
+ * aria2_session_post 的任务中）调用的 API 直接执行，不经过队列；
+ * 但 aria2_session_final 在该线程上调用时返回 -1。aria2_session_final
+ * 开始后其他线程上的调用不再转发，直接失败（返回 -1、NULL 或 0），
+ * 之前已入队的调用仍会执行完。其他线程在持有事件回调也需要的锁时
+ * 调用 API 会造成死锁。
+ * stats_capacity 非 0 时，事件循环每隔 stats_interval_ms 毫秒记录一次
+ * 全局统计，最多保留 stats_capacity 个样本。
+ * enable_timings 非 0 时记录每个下载的阶段耗时。
+ * trace_file 非 NULL 时把下载生命周期和每次循环迭代以 Chrome trace-event
+ * JSON 格式写入该文件。事件先缓存在内存中，累积一定数量后批量写出，
+ * 会话结束时补全文件结尾；未正常结束的文件仍可被 Perfetto 等工具读取。
+ * pin_loop_cpu 非 0 时把事件循环线程绑定到编号为 loop_cpu 的 CPU，
+ * 仅在线程模式和 Linux 上生效。libaria2 每个进程只支持一个会话，
+ * 需要利用多个核心时应运行多个进程，并分别绑定到不同的 CPU。
+ */
 typedef struct {
   int keep_running;
   int use_signal_handler;
   aria2_download_event_callback download_event_callback;
   void* user_data;
+  int enable_change_feed;
+  int threaded;
+  size_t event_queue_capacity;
+  int stats_interval_ms;
+  size_t stats_capacity;
+  int enable_timings;
+  const char* trace_file;
+  int pin_loop_cpu;
+  int loop_cpu;
 } aria2_session_config_t;
 
 typedef struct {
@@ -88,6 +173,44 @@ typedef struct {
   int num_stopped;
 } aria2_global_stat_t;
 
+typedef struct {
+  int64_t timestamp_ms;
+  aria2_global_stat_t stat;
+} aria2_global_stat_sample_t;
+
+typedef struct {
+  double min;
+  double mean;
+  double p50;
+  double p95;
+  double p99;
+  double max;
+} aria2_stat_summary_t;
+
+typedef struct {
+  size_t samples;
+  aria2_stat_summary_t download_speed;
+  aria2_stat_summary_t upload_speed;
+  aria2_stat_summary_t num_active;
+  aria2_stat_summary_t num_waiting;
+  aria2_stat_summary_t num_stopped;
+} aria2_global_stat_summary_t;
+
+/*
+ * 下载各阶段耗时（毫秒），尚未到达的阶段为 -1。
+ * first_byte_ms 从开始下载计，包含 DNS、连接和 TLS 握手；transfer_ms
+ * 到全部数据到达为止，finalize_ms 为全部数据到达到完成事件之间的校验和
+ * 收尾时间。经过本库写入路径（内存目标、接收回调或摘要）的下载按实际
+ * 写入计时，其余下载每 100 毫秒采样一次进度，误差在一个采样间隔内。
+ */
+typedef struct {
+  int64_t queued_ms;
+  int64_t first_byte_ms;
+  int64_t transfer_ms;
+  int64_t finalize_ms;
+  int64_t total_ms;
+} aria2_download_timings_t;
+
 typedef struct {
   char* uri;
   aria2_uri_status_t status;
@@ -122,9 +245,149 @@ typedef struct {
   size_t length;
 } aria2_binary_t;
 
+/*
+ * 借用视图，数据归下载句柄所有，调用方不得释放或修改。
+ */
+typedef struct {
+  const char* data;
+  size_t length;
+} aria2_str_view_t;
+
+typedef struct {
+  const uint8_t* data;
+  size_t length;
+} aria2_bytes_view_t;
+
+typedef struct {
+  aria2_str_view_t name;
+  aria2_str_view_t comment;
+  int64_t creation_date;
+  aria2_bt_file_mode_t mode;
+  size_t announce_list_count;
+} aria2_bt_meta_info_view_t;
+
+/*
+ * 分片区间 [begin, end)。
+ */
+typedef struct {
+  uint32_t begin;
+  uint32_t end;
+} aria2_piece_range_t;
+
+typedef enum {
+  ARIA2_DIGEST_SHA1 = 1 << 0,
+  ARIA2_DIGEST_SHA256 = 1 << 1,
+  ARIA2_DIGEST_XXH64 = 1 << 2
+} aria2_digest_type_t;
+
+/*
+ * 下载内容的摘要，types 为已计算的 aria2_digest_type_t 组合，
+ * xxh64 为种子 0 的 XXH64 值，length 为参与计算的字节数。
+ */
+typedef struct {
+  int types;
+  uint8_t sha1[20];
+  uint8_t sha256[32];
+  uint64_t xxh64;
+  int64_t length;
+} aria2_download_digests_t;
+
+/*
+ * 字节区间 [begin, end)，偏移为下载内的偏移，多文件下载按文件顺序拼接。
+ */
+typedef struct {
+  int64_t begin;
+  int64_t end;
+} aria2_byte_range_t;
+
+typedef struct {
+  size_t completed_pieces;
+  size_t num_runs;
+  size_t longest_run;
+  size_t first_missing;
+} aria2_bitfield_stats_t;
+
+#define ARIA2_API_LATENCY_BUCKETS 40
+
+/*
+ * 单个 API 入口的调用统计。buckets[i] 为耗时落在 [2^i, 2^(i+1)) 纳秒内的
+ * 调用次数，0 号桶包含 0，最后一个桶包含更长的耗时。
+ */
+typedef struct {
+  const char* name;
+  uint64_t calls;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[ARIA2_API_LATENCY_BUCKETS];
+} aria2_api_metric_t;
+
+typedef enum {
+  ARIA2_SNAPSHOT_STATUS = 1 << 0,
+  ARIA2_SNAPSHOT_TOTAL_LENGTH = 1 << 1,
+  ARIA2_SNAPSHOT_COMPLETED_LENGTH = 1 << 2,
+  ARIA2_SNAPSHOT_DOWNLOAD_SPEED = 1 << 3,
+  ARIA2_SNAPSHOT_UPLOAD_SPEED = 1 << 4,
+  ARIA2_SNAPSHOT_CONNECTIONS = 1 << 5,
+  ARIA2_SNAPSHOT_ERROR_CODE = 1 << 6,
+  ARIA2_SNAPSHOT_ALL = 0x7f
+} aria2_snapshot_field_t;
+
+/*
+ * 结构数组形式的下载状态快照。所有数组位于同一块内存中，
+ * 未在 fields 中选择的字段为 NULL。使用 aria2_free_status_snapshot 释放。
+ */
+typedef struct {
+  size_t count;
+  unsigned int fields;
+  aria2_gid_t* gids;
+  aria2_download_status_t* status;
+  int64_t* total_length;
+  int64_t* completed_length;
+  int* download_speed;
+  int* upload_speed;
+  int* connections;
+  int* error_code;
+} aria2_status_snapshot_t;
+
+typedef struct {
+  aria2_download_event_t event;
+  aria2_gid_t gid;
+} aria2_event_t;
+
+/*
+ * aria2_add_uri_batch 的单个任务。多个任务指向同一个 options 数组时，
+ * 该数组只转换一次；option_set 不为 NULL 时忽略 options。
+ */
+typedef struct {
+  const char** uris;
+  size_t uris_count;
+  const aria2_key_val_t* options;
+  size_t options_count;
+  int position;
+  const aria2_option_set_t* option_set;
+} aria2_uri_job_t;
+
+typedef struct {
+  aria2_gid_t gid;
+  aria2_download_status_t status;
+  int64_t completed_length;
+  int download_speed;
+  uint64_t version;
+} aria2_change_t;
+
 ARIA2_C_API int aria2_library_init();
 ARIA2_C_API int aria2_library_deinit();
 
+/*
+ * 运行时开关全部 aria2_* 函数的调用计数与耗时直方图，默认关闭。
+ * aria2_get_api_metrics 按固定顺序返回每个入口一项，使用 aria2_free 释放。
+ * 以 ARIA2_C_API_NO_METRICS 编译时不做任何统计。
+ */
+ARIA2_C_API void aria2_set_api_metrics_enabled(int enabled);
+ARIA2_C_API int aria2_get_api_metrics(aria2_api_metric_t** metrics,
+                                      size_t* metrics_count);
+ARIA2_C_API void aria2_reset_api_metrics();
+
 ARIA2_C_API void aria2_session_config_init(aria2_session_config_t* config);
 
 ARIA2_C_API aria2_session_t* aria2_session_new(
@@ -135,10 +398,51 @@ ARIA2_C_API int aria2_session_final(aria2_session_t* session);
 
 ARIA2_C_API int aria2_run(aria2_session_t* session, aria2_run_mode_t mode);
 
+/*
+ * aria2_run_for 驱动事件循环直到 timeout_ms 到期、下载全部结束或
+ * aria2_wakeup 被调用；空闲时阻塞在 aria2 内部的 I/O 等待中，不会忙等。
+ * aria2_run_with_tick 每隔 interval_ms 调用一次 callback，callback 返回
+ * 非 0 时返回。两者在仍有下载时返回 1，全部结束时返回 0，出错时返回 -1。
+ * aria2 对网络事件的等待不超过到超时或下一次 tick 的剩余时间，
+ * aria2_wakeup 使这一等待立即结束，因此两者都不必等到 aria2 约 1 秒的
+ * 等待超时；Windows 上没有可供等待的描述符，aria2_wakeup 最长要等这么久。
+ * aria2_wakeup 可在任意线程上调用。线程模式下前两个函数返回 -1。
+ */
+ARIA2_C_API int aria2_run_for(aria2_session_t* session, int timeout_ms);
+ARIA2_C_API int aria2_run_with_tick(aria2_session_t* session,
+                                    int interval_ms,
+                                    aria2_tick_callback callback,
+                                    void* user_data);
+ARIA2_C_API void aria2_wakeup(aria2_session_t* session);
+
+/*
+ * 在事件循环线程上异步执行 task，不等待其完成。
+ * 非线程模式下 task 在当前线程上立即执行。aria2_session_final 开始后
+ * 返回 -1，task 不会执行。
+ * 这是 API 的非阻塞提交方式：task 中调用的 aria2_* 函数直接执行，
+ * 调用方可在 task 末尾自行发出完成通知。库不提供单独的 future 类型。
+ */
+ARIA2_C_API int aria2_session_post(aria2_session_t* session,
+                                   aria2_session_task_t task,
+                                   void* user_data);
+
 ARIA2_C_API char* aria2_gid_to_hex(aria2_gid_t gid);
 ARIA2_C_API aria2_gid_t aria2_hex_to_gid(const char* hex);
 ARIA2_C_API int aria2_is_null(aria2_gid_t gid);
 
+/*
+ * 不分配内存的 GID 十六进制转换。aria2_gid_to_hex_buf 写入 16 个小写字符
+ * 和结尾的 '\0'。批量编码时 out 至少为 count * 17 字节，第 i 个结果
+ * 位于 out + i * 17。批量解码时非法或长度不为 16 的字符串解码为 0。
+ */
+ARIA2_C_API int aria2_gid_to_hex_buf(aria2_gid_t gid, char out[17]);
+ARIA2_C_API int aria2_gids_to_hex_batch(const aria2_gid_t* gids,
+                                        size_t count,
+                                        char* out);
+ARIA2_C_API int aria2_hex_to_gids_batch(const char* const* hex,
+                                        size_t count,
+                                        aria2_gid_t* out);
+
 ARIA2_C_API int aria2_add_uri(aria2_session_t* session,
                               aria2_gid_t* gid,
                               const char** uris,
@@ -147,6 +451,116 @@ ARIA2_C_API int aria2_add_uri(aria2_session_t* session,
                               size_t options_count,
                               int position);
 
+/*
+ * 预先构建的选项集合，可在多次添加或修改调用之间复用，避免每次调用都
+ * 转换 aria2_key_val_t 数组。aria2_option_set_set 检查选项名只包含
+ * 小写字母、数字和 '-'，重复设置同一选项时覆盖原值。选项集合构建完成后
+ * 可在多个线程间只读共享。
+ */
+ARIA2_C_API aria2_option_set_t* aria2_option_set_new();
+ARIA2_C_API int aria2_option_set_set(aria2_option_set_t* option_set,
+                                     const char* key,
+                                     const char* value);
+ARIA2_C_API void aria2_option_set_free(aria2_option_set_t* option_set);
+
+/*
+ * 在选项集合中设置优先下载文件开头的分片选择：HTTP/FTP 按顺序选择分片
+ * （stream-piece-selector=inorder），BitTorrent 优先下载开头 head_bytes
+ * 字节所在的分片（bt-prioritize-piece=head），head_bytes 不大于 0 时
+ * 使用 aria2 的默认大小。
+ */
+ARIA2_C_API int aria2_option_set_prefix_first(aria2_option_set_t* option_set,
+                                              int64_t head_bytes);
+
+/*
+ * 数据接收回调。aria2 写入下载数据时直接调用，data 为从 offset 开始的
+ * length 字节，数据不再写入文件。分段下载的各段交替到达，offset 不保证
+ * 递增；重试或暂停后重新开始时同一区间可能再次交付。下载结束（完成、
+ * 出错或被移除）时以 data 为 NULL、length 为 0 调用一次，此时 offset 为
+ * 已写入的最大偏移。
+ * 返回 0 表示已接收；返回 1 表示暂时无法接收，库复制该段数据，在之后的
+ * 每次循环迭代中按原顺序重新交付，之后到达的数据也排在其后；返回 -1
+ * 使下载失败。回调在 aria2 的写入路径上调用，其中不能添加、移除、暂停
+ * 或修改下载，也不能驱动事件循环。
+ */
+typedef int (*aria2_sink_callback)(aria2_session_t* session,
+                                   aria2_gid_t gid,
+                                   int64_t offset,
+                                   const uint8_t* data,
+                                   size_t length,
+                                   void* user_data);
+
+typedef struct {
+  aria2_sink_callback callback;
+  void* user_data;
+  int64_t max_backlog;
+} aria2_sink_t;
+
+/*
+ * 让 aria2_add_uri_with_option_set 和 aria2_add_uri_batch 用该选项集合
+ * 添加的单文件下载把数据交给 sink，不创建文件和控制文件，也不预分配，
+ * 因此会话结束后无法续传；需要读回数据校验分片（checksum 选项等）的
+ * 下载会失败。暂存的数据超过 max_backlog 字节时把该下载限速为每秒
+ * 1 字节，回落到一半以下时恢复原来的 max-download-limit，max_backlog
+ * 为 0 表示不限制。下载完成时暂存的数据先重新交付一次，仍未被接收时
+ * 留到之后的迭代，结束调用在全部交付之后。sink 为 NULL 时清除设置。
+ * aria2_add_torrent_with_option_set 不接受设置了接收回调、内存目标或
+ * 摘要的选项集合。
+ */
+ARIA2_C_API int aria2_option_set_set_sink(aria2_option_set_t* option_set,
+                                          const aria2_sink_t* sink);
+
+/*
+ * 让 aria2_add_uri_with_option_set 和 aria2_add_uri_batch 用该选项集合
+ * 添加的下载成为内存目标，行为同 aria2_set_download_memory_target。
+ * max_bytes 为 0 时清除设置；不能与接收回调同时设置。
+ */
+ARIA2_C_API int aria2_option_set_set_memory_target(
+    aria2_option_set_t* option_set,
+    int64_t max_bytes);
+
+/*
+ * 让 aria2_add_uri_with_option_set 和 aria2_add_uri_batch 用该选项集合
+ * 添加的下载计算摘要，行为同 aria2_set_download_digests。types 为 0 时
+ * 清除设置。
+ */
+ARIA2_C_API int aria2_option_set_set_digests(aria2_option_set_t* option_set,
+                                             int types);
+
+ARIA2_C_API int aria2_add_uri_with_option_set(
+    aria2_session_t* session,
+    aria2_gid_t* gid,
+    const char** uris,
+    size_t uris_count,
+    const aria2_option_set_t* option_set,
+    int position);
+ARIA2_C_API int aria2_add_torrent_with_option_set(
+    aria2_session_t* session,
+    aria2_gid_t* gid,
+    const char* torrent_file,
+    const char** webseed_uris,
+    size_t webseed_uris_count,
+    const aria2_option_set_t* option_set,
+    int position);
+ARIA2_C_API int aria2_change_option_with_option_set(
+    aria2_session_t* session,
+    aria2_gid_t gid,
+    const aria2_option_set_t* option_set);
+ARIA2_C_API int aria2_change_global_option_with_option_set(
+    aria2_session_t* session,
+    const aria2_option_set_t* option_set);
+
+/*
+ * 一次添加多个 URI 下载。out_gids 和 out_results 可以为 NULL，否则必须
+ * 有 jobs_count 个元素，分别接收每个任务的 gid 和 aria2_add_uri 的返回值。
+ * 全部成功时返回 0，否则返回 -1。
+ */
+ARIA2_C_API int aria2_add_uri_batch(aria2_session_t* session,
+                                    const aria2_uri_job_t* jobs,
+                                    size_t jobs_count,
+                                    aria2_gid_t* out_gids,
+                                    int* out_results);
+
 ARIA2_C_API int aria2_add_metalink(aria2_session_t* session,
                                    aria2_gid_t** gids,
                                    size_t* gids_count,
@@ -175,6 +589,53 @@ ARIA2_C_API int aria2_get_active_download(aria2_session_t* session,
                                           aria2_gid_t** gids,
                                           size_t* gids_count);
 
+/*
+ * 一次调用获取多个下载的状态。gids 为 NULL 时使用全部活动下载；
+ * libaria2 只能枚举活动下载，等待中或已停止的下载需由调用方传入 gid。
+ * 不存在的 gid 会被跳过，因此 snapshot->count 可能小于 gids_count。
+ */
+ARIA2_C_API int aria2_get_status_snapshot(aria2_session_t* session,
+                                          const aria2_gid_t* gids,
+                                          size_t gids_count,
+                                          unsigned int fields,
+                                          aria2_status_snapshot_t* snapshot);
+
+/*
+ * 事件队列，需要在会话配置中设置 event_queue_capacity。下载事件写入
+ * 有界无锁环形缓冲区，并通过 aria2_session_get_event_fd 返回的文件描述符
+ * （Linux 上为 eventfd，其他 POSIX 系统上为管道的读端）通知可读，
+ * 可加入 epoll/poll 等事件循环。Windows 上没有通知描述符，返回 -1。
+ * aria2_drain_events 只能在同一个消费者线程上调用；
+ * 队列已满时新的事件被丢弃并计入 aria2_get_dropped_event_count。
+ */
+ARIA2_C_API int aria2_session_get_event_fd(aria2_session_t* session);
+ARIA2_C_API size_t aria2_drain_events(aria2_session_t* session,
+                                      aria2_event_t* events,
+                                      size_t capacity);
+ARIA2_C_API uint64_t aria2_get_dropped_event_count(aria2_session_t* session);
+
+/*
+ * 变化订阅，需要在会话配置中启用 enable_change_feed。
+ * aria2_register_change_poller 注册一个轮询者并返回其编号，失败返回 0；
+ * 不再轮询时应以 aria2_unregister_change_poller 注销，编号不存在时返回 -1。
+ * aria2_poll_changes 返回该轮询者上次读到的版本以来状态、已完成长度或
+ * 下载速度发生变化的下载，首次调用返回全部下载；当变化数超过 capacity
+ * 时，剩余的变化在下次调用时返回。每个下载只返回其最新状态。状态取自
+ * 下载事件和本 API 的调用，活动下载的进度在每次调用时一次取得。
+ * aria2 清除已停止下载的结果后，其记录在所有已注册的轮询者都读过其
+ * 最终状态后删除；超过 60 秒未轮询的轮询者不再阻止删除。成功返回 0；
+ * 若轮询者读到的版本早于已删除的记录，其间被清除的下载不会再返回，
+ * 此时返回 1，其余变化照常返回。轮询者编号不存在时返回 -1。
+ */
+ARIA2_C_API uint64_t aria2_register_change_poller(aria2_session_t* session);
+ARIA2_C_API int aria2_unregister_change_poller(aria2_session_t* session,
+                                               uint64_t poller);
+ARIA2_C_API int aria2_poll_changes(aria2_session_t* session,
+                                   uint64_t poller,
+                                   aria2_change_t* changes,
+                                   size_t capacity,
+                                   size_t* changes_count);
+
 ARIA2_C_API int aria2_remove_download(aria2_session_t* session,
                                       aria2_gid_t gid,
                                       int force);
@@ -198,9 +659,44 @@ ARIA2_C_API int aria2_change_global_option(aria2_session_t* session,
                                            const aria2_key_val_t* options,
                                            size_t options_count);
 
+/*
+ * 按选项 ID 读取或修改全局选项。数值选项接受 K/M 后缀，
+ * 布尔选项的值为 0 或 1。解析结果缓存在会话中，通过本 API 修改全局选项时
+ * 失效；启用 RPC 的会话不使用缓存，因为选项可能被 RPC 修改。
+ * 选项不存在或无法解析时返回 -1。
+ */
+ARIA2_C_API const char* aria2_option_name(aria2_option_id_t id);
+ARIA2_C_API int aria2_get_option_int64(aria2_session_t* session,
+                                       aria2_option_id_t id,
+                                       int64_t* value);
+ARIA2_C_API int aria2_get_option_bool(aria2_session_t* session,
+                                      aria2_option_id_t id,
+                                      int* value);
+ARIA2_C_API int aria2_set_option_int64(aria2_session_t* session,
+                                       aria2_option_id_t id,
+                                       int64_t value);
+ARIA2_C_API int aria2_set_option_bool(aria2_session_t* session,
+                                      aria2_option_id_t id,
+                                      int value);
+
 ARIA2_C_API aria2_global_stat_t aria2_get_global_stat(
     aria2_session_t* session);
 
+/*
+ * 返回最近 window_ms 毫秒内记录的全局统计样本（window_ms <= 0 时返回全部），
+ * 按时间先后排列，timestamp_ms 为单调时钟。使用 aria2_free 释放。
+ * 未启用统计记录时返回 -1。
+ */
+ARIA2_C_API int aria2_get_global_stat_series(
+    aria2_session_t* session,
+    int64_t window_ms,
+    aria2_global_stat_sample_t** samples,
+    size_t* samples_count);
+ARIA2_C_API int aria2_get_global_stat_summary(
+    aria2_session_t* session,
+    int64_t window_ms,
+    aria2_global_stat_summary_t* summary);
+
 ARIA2_C_API int aria2_change_position(aria2_session_t* session,
                                       aria2_gid_t gid,
                                       int pos,
@@ -213,6 +709,23 @@ ARIA2_C_API aria2_download_handle_t* aria2_get_download_handle(
     aria2_gid_t gid);
 ARIA2_C_API void aria2_delete_download_handle(aria2_download_handle_t* dh);
 
+/*
+ * 获取共享的下载句柄。同一活动下载的重复获取只做一次哈希查找；
+ * 下载停止、完成、出错或被移除后缓存失效，之后获取到新的句柄。
+ * 返回的句柄用 aria2_release_download_handle 释放，传给
+ * aria2_delete_download_handle 时同样按释放处理；
+ * aria2_get_download_handle 返回的句柄传给 aria2_release_download_handle
+ * 时按删除处理。每次获取返回独立的持有者，它们共享底层句柄，但视图
+ * 数据各自保存：一个持有者上的视图不受其他持有者的调用影响，在该
+ * 持有者释放前按下文的规则保持有效。速度和上传量每次读取时重新取得，
+ * 其余数据为缓存的值。所有持有者都必须在 aria2_session_final 之前释放，
+ * 否则 aria2_session_final 返回 -1 且不结束会话。
+ */
+ARIA2_C_API aria2_download_handle_t* aria2_acquire_download_handle(
+    aria2_session_t* session,
+    aria2_gid_t gid);
+ARIA2_C_API void aria2_release_download_handle(aria2_download_handle_t* dh);
+
 ARIA2_C_API aria2_download_status_t
 aria2_download_handle_get_status(aria2_download_handle_t* dh);
 ARIA2_C_API int64_t aria2_download_handle_get_total_length(
@@ -235,6 +748,20 @@ ARIA2_C_API int aria2_download_handle_get_num_pieces(
     aria2_download_handle_t* dh);
 ARIA2_C_API int aria2_download_handle_get_connections(
     aria2_download_handle_t* dh);
+/*
+ * 需要在会话配置中启用 enable_timings。已结束的下载保留最近 1000 条记录。
+ */
+ARIA2_C_API int aria2_download_handle_get_timings(
+    aria2_download_handle_t* dh,
+    aria2_download_timings_t* timings);
+/*
+ * 已完整写入文件、可以安全读取的字节区间，按偏移递增排列，
+ * 使用 aria2_free 释放。粒度为分片，正在写入的分片不计入。
+ */
+ARIA2_C_API int aria2_download_handle_get_available_ranges(
+    aria2_download_handle_t* dh,
+    aria2_byte_range_t** ranges,
+    size_t* ranges_count);
 ARIA2_C_API int aria2_download_handle_get_error_code(
     aria2_download_handle_t* dh);
 ARIA2_C_API int aria2_download_handle_get_followed_by(
@@ -266,6 +793,193 @@ ARIA2_C_API int aria2_download_handle_get_options(
     aria2_key_val_t** options,
     size_t* options_count);
 
+ARIA2_C_API int aria2_download_handle_get_option_int64(
+    aria2_download_handle_t* dh,
+    aria2_option_id_t id,
+    int64_t* value);
+ARIA2_C_API int aria2_download_handle_get_option_bool(
+    aria2_download_handle_t* dh,
+    aria2_option_id_t id,
+    int* value);
+
+/*
+ * 零拷贝访问下载句柄中的数据。视图在 aria2_delete_download_handle 之前有效；
+ * dir 和 option 视图在修改该下载的选项后失效，bitfield 视图在同一句柄上
+ * 再次调用 aria2_download_handle_view_bitfield 后失效。
+ * BitTorrent 元信息在首次访问时缓存于句柄中。
+ * 线程模式下 dir、option 和 info_hash 需要从事件循环线程复制到句柄内，
+ * 并在同一句柄上再次调用相应函数（option 为同名选项）后失效。
+ */
+ARIA2_C_API aria2_str_view_t aria2_download_handle_view_dir(
+    aria2_download_handle_t* dh);
+ARIA2_C_API aria2_str_view_t aria2_download_handle_view_option(
+    aria2_download_handle_t* dh,
+    const char* name);
+ARIA2_C_API aria2_bytes_view_t aria2_download_handle_view_bitfield(
+    aria2_download_handle_t* dh);
+ARIA2_C_API aria2_bytes_view_t aria2_download_handle_view_info_hash(
+    aria2_download_handle_t* dh);
+ARIA2_C_API aria2_bt_meta_info_view_t
+aria2_download_handle_view_bt_meta_info(aria2_download_handle_t* dh);
+ARIA2_C_API size_t aria2_download_handle_view_announce_tier(
+    aria2_download_handle_t* dh,
+    size_t tier,
+    const aria2_str_view_t** uris);
+
+/*
+ * 内存池（arena）。*_arena 变体把整个结果（包括所有字符串和数组）
+ * 分配在 arena 中，无需使用 aria2_free_* 逐个释放；
+ * 调用 aria2_arena_reset 后这些结果全部失效，内存块保留供下次复用。
+ * block_size 为 0 时使用默认大小。arena 不是线程安全的。
+ */
+ARIA2_C_API aria2_arena_t* aria2_arena_new(size_t block_size);
+ARIA2_C_API void aria2_arena_reset(aria2_arena_t* arena);
+ARIA2_C_API void aria2_arena_free(aria2_arena_t* arena);
+
+ARIA2_C_API char* aria2_get_global_option_arena(aria2_session_t* session,
+                                                aria2_arena_t* arena,
+                                                const char* name);
+ARIA2_C_API int aria2_get_global_options_arena(aria2_session_t* session,
+                                               aria2_arena_t* arena,
+                                               aria2_key_val_t** options,
+                                               size_t* options_count);
+ARIA2_C_API char* aria2_download_handle_get_dir_arena(
+    aria2_download_handle_t* dh,
+    aria2_arena_t* arena);
+ARIA2_C_API int aria2_download_handle_get_files_arena(
+    aria2_download_handle_t* dh,
+    aria2_arena_t* arena,
+    aria2_file_data_t** files,
+    size_t* files_count);
+ARIA2_C_API int aria2_download_handle_get_file_arena(
+    aria2_download_handle_t* dh,
+    aria2_arena_t* arena,
+    int index,
+    aria2_file_data_t* file);
+ARIA2_C_API int aria2_download_handle_get_bt_meta_info_arena(
+    aria2_download_handle_t* dh,
+    aria2_arena_t* arena,
+    aria2_bt_meta_info_data_t* meta);
+ARIA2_C_API char* aria2_download_handle_get_option_arena(
+    aria2_download_handle_t* dh,
+    aria2_arena_t* arena,
+    const char* name);
+ARIA2_C_API int aria2_download_handle_get_options_arena(
+    aria2_download_handle_t* dh,
+    aria2_arena_t* arena,
+    aria2_key_val_t** options,
+    size_t* options_count);
+
+/*
+ * 位图辅助函数，直接处理 aria2 的位图（最高位对应序号最小的分片）。
+ * aria2_bitfield_stats 统计已完成分片数、连续已完成区间的数量、
+ * 最长区间长度以及第一个未完成分片的序号（全部完成时为 num_pieces），
+ * 在支持的平台上使用 AVX2 或 NEON 计数。aria2_bitfield_runs 输出
+ * 连续已完成区间，*ranges_count 为区间总数，只写入前 capacity 个。
+ */
+ARIA2_C_API int aria2_bitfield_stats(const uint8_t* bitfield,
+                                     size_t length,
+                                     size_t num_pieces,
+                                     aria2_bitfield_stats_t* stats);
+ARIA2_C_API int aria2_bitfield_runs(const uint8_t* bitfield,
+                                    size_t length,
+                                    size_t num_pieces,
+                                    aria2_piece_range_t* ranges,
+                                    size_t capacity,
+                                    size_t* ranges_count);
+
+/*
+ * 返回指定下载自 since_version 以来状态发生翻转的分片区间，并把当前
+ * 位图版本写入 *version。会话保存每个下载的位图，每次循环迭代最多从
+ * aria2 取得一次并与之原地比较，同一迭代内的多次调用得到相同结果；
+ * 会话为每个下载保留最近若干个版本的变化记录；
+ * since_version 为 0 或已超出记录范围时返回 1，此时 ranges 为当前全部
+ * 已完成区间，调用方应据此重建状态。正常返回 0，出错返回 -1。
+ * *ranges_count 为区间总数，只写入前 capacity 个。
+ * 下载停止、完成或出错后其记录被丢弃。
+ */
+ARIA2_C_API int aria2_get_bitfield_delta(aria2_session_t* session,
+                                         aria2_gid_t gid,
+                                         uint64_t since_version,
+                                         uint64_t* version,
+                                         aria2_piece_range_t* ranges,
+                                         size_t capacity,
+                                         size_t* ranges_count);
+
+/*
+ * 把尚未开始的单文件下载设为内存目标，应在添加下载后、下一次循环迭代
+ * 之前调用，下载已开始时返回 -1；线程模式下应使用
+ * aria2_option_set_set_memory_target 在添加时设置。aria2 写入的数据直接
+ * 进入库持有的缓冲区，不创建文件和控制文件，也不预分配，会话结束后
+ * 无法续传。下载完成后通过 aria2_download_handle_take_buffer 取得，
+ * 在 ARIA2_EVENT_ON_DOWNLOAD_COMPLETE 回调中即可取得。
+ * 已知长度超过 max_bytes、写入超过 max_bytes 或缓冲区无法分配时溢出：
+ * aria2 在原本的路径创建文件，写入缓冲区中已有的数据，之后照常写入
+ * 文件，缓冲区随即释放。不能用于设置了接收回调的下载。未取走的缓冲区
+ * 在会话结束时释放。
+ */
+ARIA2_C_API int aria2_set_download_memory_target(aria2_session_t* session,
+                                                 aria2_gid_t gid,
+                                                 int64_t max_bytes);
+
+/*
+ * 区间就绪回调。result 为 0 表示 [begin, end) 已完整写入文件；为 -1 表示
+ * 下载在此之前已结束或区间超出下载大小。回调在事件循环线程上调用。
+ */
+typedef void (*aria2_range_callback)(aria2_session_t* session,
+                                     aria2_gid_t gid,
+                                     int64_t begin,
+                                     int64_t end,
+                                     int result,
+                                     void* user_data);
+
+/*
+ * 在字节区间 [begin, end) 可以读取时调用一次 callback，end 小于 0
+ * 表示到下载末尾。每次循环迭代后检查，区间已就绪时在下一次迭代后调用；
+ * 与 aria2_get_bitfield_delta 共用保存的位图，只在下载的已完成长度或
+ * 状态变化后重新检查。检查在 aria2 的迭代内部进行，aria2_run 照常运行；
+ * Windows 上设置了区间等待的会话中 aria2_run 按单次迭代驱动。
+ */
+ARIA2_C_API int aria2_watch_range(aria2_session_t* session,
+                                  aria2_gid_t gid,
+                                  int64_t begin,
+                                  int64_t end,
+                                  aria2_range_callback callback,
+                                  void* user_data);
+
+/*
+ * 为尚未开始的单文件下载计算 types 指定的摘要，应在添加下载后、下一次
+ * 循环迭代之前调用，下载已开始时返回 -1；线程模式下应使用
+ * aria2_option_set_set_digests 在添加时设置。摘要在 aria2 写入数据时
+ * 计算，与已计算部分相接的写入直接计入。分段下载乱序写入的区间先记录
+ * 下来，等前面的部分写入后计入：内存目标从缓冲区计入；接收回调的下载
+ * 保留这些数据的副本；写入文件的下载在循环迭代后从文件读回，每次迭代
+ * 最多读取 4 MiB。没有待补算的区间时下载完成事件的回调中即可取得结果。
+ * 续传已有文件的下载无法得出摘要。
+ * SHA-1 与 SHA-256 使用已链接的 OpenSSL、macOS/iOS 的 CommonCrypto
+ * 或 Windows 的 BCrypt，都没有时使用内置实现；XXH64 使用内置实现。
+ */
+ARIA2_C_API int aria2_set_download_digests(aria2_session_t* session,
+                                           aria2_gid_t gid,
+                                           int types);
+
+/*
+ * 下载完成且摘要计算完毕时填写 digests 并返回 0；仍在计算时返回 1，
+ * 此时只填写 types 和 length；未设置摘要或下载失败时返回 -1。
+ * 已完成的下载保留最近 1000 条结果。
+ */
+ARIA2_C_API int aria2_download_handle_get_digests(
+    aria2_download_handle_t* dh,
+    aria2_download_digests_t* digests);
+
+/*
+ * 取走内存目标下载的数据，使用 aria2_free_binary 释放，每个下载只能
+ * 取一次，可以在下载完成事件的回调中调用。成功返回 0；已溢出到文件时
+ * 返回 1；下载尚未完成、出错或不是内存目标时返回 -1。
+ */
+ARIA2_C_API int aria2_download_handle_take_buffer(aria2_download_handle_t* dh,
+                                                  aria2_binary_t* buffer);
+
 /*
  * 释放由本 C API 分配的内存。所有返回的字符串、数组、
  * 以及包含深层数据的结构体都应使用下面的函数释放。
@@ -285,6 +999,8 @@ ARIA2_C_API void aria2_free_string_list_array(
 ARIA2_C_API void aria2_free_bt_meta_info_data(
     aria2_bt_meta_info_data_t* meta);
 ARIA2_C_API void aria2_free_binary(aria2_binary_t* bin);
+ARIA2_C_API void aria2_free_status_snapshot(
+    aria2_status_snapshot_t* snapshot);
 
 #ifdef __cplusplus
 }
@@ -1,15 +1,125 @@
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if !defined(_WIN32)
+#  include <sys/resource.h>
+#endif
 
 #include "aria2_c_api.h"
 
+#if defined(__GLIBC__)
+// 统计整个进程（包括 aria2 内部）的内存分配次数。
+#  include <atomic>
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+static std::atomic<uint64_t> g_allocs{0};
+
+extern "C" void* malloc(size_t size)
+{
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+static int64_t alloc_count()
+{
+  return static_cast<int64_t>(g_allocs.load(std::memory_order_relaxed));
+}
+#else
+static int64_t alloc_count()
+{
+  return -1;
+}
+#endif
+
+struct download_job {
+  std::vector<std::string> uris;
+  std::vector<std::pair<std::string, std::string>> options;
+};
+
+struct download_record {
+  int session = 0;
+  std::string uri;
+  aria2_gid_t gid = 0;
+  aria2_download_status_t status = ARIA2_DOWNLOAD_WAITING;
+  int error_code = 0;
+  int64_t completed_length = 0;
+  aria2_download_timings_t timings{-1, -1, -1, -1, -1};
+};
+
+struct run_state {
+  bool quiet = false;
+  int session = 0;
+  std::unordered_map<aria2_gid_t, size_t> index;
+  std::vector<download_record> records;
+};
+
+// 在下载结束时记录其状态、大小和各阶段耗时。
+static void record_download(aria2_session_t* session,
+                            run_state* state,
+                            aria2_gid_t gid)
+{
+  auto it = state->index.find(gid);
+  if (it == state->index.end()) {
+    return;
+  }
+  download_record& record = state->records[it->second];
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  if (!dh) {
+    return;
+  }
+  record.status = aria2_download_handle_get_status(dh);
+  record.error_code = aria2_download_handle_get_error_code(dh);
+  record.completed_length = aria2_download_handle_get_completed_length(dh);
+  aria2_download_handle_get_timings(dh, &record.timings);
+  aria2_delete_download_handle(dh);
+}
+
 int download_event_callback(aria2_session_t* session,
                             aria2_download_event_t event,
                             aria2_gid_t gid,
                             void* user_data)
 {
-  (void)user_data;
+  auto* state = static_cast<run_state*>(user_data);
+  switch (event) {
+  case ARIA2_EVENT_ON_DOWNLOAD_COMPLETE:
+  case ARIA2_EVENT_ON_DOWNLOAD_ERROR:
+  case ARIA2_EVENT_ON_DOWNLOAD_STOP:
+    if (state) {
+      record_download(session, state, gid);
+    }
+    break;
+  default:
+    break;
+  }
+  if (state && state->quiet) {
+    return 0;
+  }
   switch (event) {
   case ARIA2_EVENT_ON_DOWNLOAD_COMPLETE:
     std::cerr << "COMPLETE";
@@ -52,96 +162,491 @@ int download_event_callback(aria2_session_t* session,
   return 0;
 }
 
+int print_progress(aria2_session_t* session, void* user_data)
+{
+  (void)user_data;
+  aria2_global_stat_t gstat = aria2_get_global_stat(session);
+  std::cerr << "Overall #Active:" << gstat.num_active
+            << " #waiting:" << gstat.num_waiting
+            << " D:" << gstat.download_speed / 1024 << "KiB/s"
+            << " U:" << gstat.upload_speed / 1024 << "KiB/s "
+            << std::endl;
+
+  aria2_status_snapshot_t snapshot{};
+  if (aria2_get_status_snapshot(session, nullptr, 0,
+                                ARIA2_SNAPSHOT_TOTAL_LENGTH |
+                                    ARIA2_SNAPSHOT_COMPLETED_LENGTH |
+                                    ARIA2_SNAPSHOT_DOWNLOAD_SPEED |
+                                    ARIA2_SNAPSHOT_UPLOAD_SPEED,
+                                &snapshot) == 0) {
+    for (size_t i = 0; i < snapshot.count; ++i) {
+      int64_t completed = snapshot.completed_length[i];
+      int64_t total = snapshot.total_length[i];
+      int progress =
+          total > 0 ? static_cast<int>(100 * completed / total) : 0;
+      std::cerr << "    [";
+      char* gid_hex = aria2_gid_to_hex(snapshot.gids[i]);
+      if (gid_hex) {
+        std::cerr << gid_hex;
+        aria2_free(gid_hex);
+      }
+      else {
+        std::cerr << "unknown";
+      }
+      std::cerr << "] " << completed << "/" << total << "(" << progress
+                << "%)"
+                << " D:" << snapshot.download_speed[i] / 1024
+                << "KiB/s, U:" << snapshot.upload_speed[i] / 1024
+                << "KiB/s" << std::endl;
+    }
+  }
+  aria2_free_status_snapshot(&snapshot);
+  return 0;
+}
+
+static int quiet_tick(aria2_session_t* session, void* user_data)
+{
+  (void)session;
+  (void)user_data;
+  return 0;
+}
+
+static bool split_option(const std::string& text,
+                         std::pair<std::string, std::string>* option)
+{
+  size_t eq = text.find('=');
+  if (eq == std::string::npos || eq == 0) {
+    return false;
+  }
+  option->first = text.substr(0, eq);
+  option->second = text.substr(eq + 1);
+  return true;
+}
+
+static std::string trim(const std::string& text)
+{
+  size_t begin = text.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  size_t end = text.find_last_not_of(" \t\r");
+  return text.substr(begin, end - begin + 1);
+}
+
+// 读取 aria2 输入文件格式的子集：每行一个下载，同一下载的多个 URI 以
+// 制表符分隔；以空白开头的行是上一个下载的 key=value 选项；# 开头为注释。
+static bool read_input_file(const std::string& path,
+                            std::vector<download_job>* jobs)
+{
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    std::string text = trim(line);
+    if (text.empty() || text[0] == '#') {
+      continue;
+    }
+    if ((line[0] == ' ' || line[0] == '\t') && !jobs->empty()) {
+      std::pair<std::string, std::string> option;
+      if (split_option(text, &option)) {
+        jobs->back().options.push_back(option);
+      }
+      continue;
+    }
+    download_job job;
+    std::istringstream uris(text);
+    std::string uri;
+    while (std::getline(uris, uri, '\t')) {
+      uri = trim(uri);
+      if (!uri.empty()) {
+        job.uris.push_back(uri);
+      }
+    }
+    jobs->push_back(std::move(job));
+  }
+  return true;
+}
+
+// 选项配置文件：每行一个 key=value，应用到每个下载。
+static bool read_profile(const std::string& path,
+                         std::vector<std::pair<std::string, std::string>>* out)
+{
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    std::string text = trim(line);
+    std::pair<std::string, std::string> option;
+    if (!text.empty() && text[0] != '#' && split_option(text, &option)) {
+      out->push_back(option);
+    }
+  }
+  return true;
+}
+
+static std::vector<aria2_key_val_t>
+to_key_vals(const std::vector<std::pair<std::string, std::string>>& options)
+{
+  std::vector<aria2_key_val_t> result;
+  for (const auto& option : options) {
+    result.push_back({const_cast<char*>(option.first.c_str()),
+                      const_cast<char*>(option.second.c_str())});
+  }
+  return result;
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  size_t rank = static_cast<size_t>(p * values.size() + 0.999999);
+  return values[std::min(std::max<size_t>(rank, 1), values.size()) - 1];
+}
+
+static void write_distribution(std::ostream& out,
+                               const std::vector<double>& values)
+{
+  double total = 0;
+  for (double value : values) {
+    total += value;
+  }
+  out << "{\"count\":" << values.size() << ",\"mean\":"
+      << (values.empty() ? 0 : total / values.size())
+      << ",\"min\":" << percentile(values, 0)
+      << ",\"p50\":" << percentile(values, 0.50)
+      << ",\"p95\":" << percentile(values, 0.95)
+      << ",\"p99\":" << percentile(values, 0.99)
+      << ",\"max\":" << percentile(values, 1.0) << "}";
+}
+
+static std::string json_string(const std::string& text)
+{
+  std::ostringstream out;
+  out << '"';
+  for (unsigned char c : text) {
+    switch (c) {
+    case '"':
+      out << "\\\"";
+      break;
+    case '\\':
+      out << "\\\\";
+      break;
+    default:
+      if (c < 0x20) {
+        out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+            << static_cast<int>(c) << std::dec << std::setfill(' ');
+      }
+      else {
+        out << c;
+      }
+      break;
+    }
+  }
+  out << '"';
+  return out.str();
+}
+
+static const char* status_name(aria2_download_status_t status)
+{
+  switch (status) {
+  case ARIA2_DOWNLOAD_ACTIVE:
+    return "active";
+  case ARIA2_DOWNLOAD_WAITING:
+    return "waiting";
+  case ARIA2_DOWNLOAD_PAUSED:
+    return "paused";
+  case ARIA2_DOWNLOAD_COMPLETE:
+    return "complete";
+  case ARIA2_DOWNLOAD_ERROR:
+    return "error";
+  case ARIA2_DOWNLOAD_REMOVED:
+    return "removed";
+  }
+  return "unknown";
+}
+
+static int64_t peak_rss_bytes()
+{
+#if defined(_WIN32)
+  return -1;
+#else
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#  if defined(__APPLE__)
+  return static_cast<int64_t>(usage.ru_maxrss);
+#  else
+  return static_cast<int64_t>(usage.ru_maxrss) * 1024;
+#  endif
+#endif
+}
+
+static void write_summary(std::ostream& out,
+                          int sessions,
+                          double elapsed,
+                          const std::vector<download_record>& records,
+                          const std::vector<double>& speed_samples,
+                          int64_t allocs)
+{
+  int completed = 0;
+  int errors = 0;
+  int64_t bytes = 0;
+  std::map<int, int> error_codes;
+  std::vector<double> durations;
+  for (const download_record& record : records) {
+    bytes += record.completed_length;
+    if (record.status == ARIA2_DOWNLOAD_COMPLETE) {
+      ++completed;
+      if (record.timings.total_ms >= 0) {
+        durations.push_back(static_cast<double>(record.timings.total_ms));
+      }
+    }
+    else if (record.status == ARIA2_DOWNLOAD_ERROR) {
+      ++errors;
+      ++error_codes[record.error_code];
+    }
+  }
+
+  out << "{\"sessions\":" << sessions << ",\"downloads\":" << records.size()
+      << ",\"completed\":" << completed << ",\"errors\":" << errors
+      << ",\"error_codes\":{";
+  for (auto it = error_codes.begin(); it != error_codes.end(); ++it) {
+    out << (it == error_codes.begin() ? "" : ",") << "\"" << it->first
+        << "\":" << it->second;
+  }
+  out << "},\"bytes\":" << bytes << ",\"elapsed_s\":" << elapsed
+      << ",\"throughput_mb_s\":"
+      << (elapsed > 0 ? bytes / 1e6 / elapsed : 0)
+      << ",\"download_speed_mb_s\":";
+  write_distribution(out, speed_samples);
+  out << ",\"download_duration_ms\":";
+  write_distribution(out, durations);
+  out << ",\"peak_rss_bytes\":" << peak_rss_bytes()
+      << ",\"allocations_per_download\":"
+      << (allocs < 0 || records.empty()
+              ? -1.0
+              : static_cast<double>(allocs) / records.size())
+      << ",\"per_download\":[";
+  for (size_t i = 0; i < records.size(); ++i) {
+    const download_record& record = records[i];
+    char* gid_hex = aria2_gid_to_hex(record.gid);
+    out << (i ? "," : "") << "\n  {\"session\":" << record.session
+        << ",\"gid\":\"" << (gid_hex ? gid_hex : "") << "\",\"uri\":"
+        << json_string(record.uri) << ",\"status\":\""
+        << status_name(record.status)
+        << "\",\"error_code\":" << record.error_code
+        << ",\"bytes\":" << record.completed_length
+        << ",\"queued_ms\":" << record.timings.queued_ms
+        << ",\"first_byte_ms\":" << record.timings.first_byte_ms
+        << ",\"transfer_ms\":" << record.timings.transfer_ms
+        << ",\"total_ms\":" << record.timings.total_ms << "}";
+    aria2_free(gid_hex);
+  }
+  out << "\n]}" << std::endl;
+}
+
+static void usage()
+{
+  std::cerr
+      << "Usage: aria2_c_api_main [OPTIONS] [URI...]\n\n"
+      << "  Download given URIs in parallel in the current directory.\n\n"
+      << "Options:\n"
+      << "  --input FILE        read downloads from FILE (one per line, "
+         "tab-separated\n"
+      << "                      mirrors, indented key=value options)\n"
+      << "  --sessions N        run the whole list N times, one session "
+         "after another\n"
+      << "  --profile FILE      apply key=value options in FILE to every "
+         "download\n"
+      << "  --option KEY=VALUE  set a global option (repeatable)\n"
+      << "  --json FILE         write a JSON summary to FILE ('-' for "
+         "stdout)\n"
+      << "  --quiet             do not print progress and per-download "
+         "lines\n";
+}
+
 int main(int argc, char** argv)
 {
   if (argc < 2) {
-    std::cerr << "Usage: aria2_c_api_main URI [URI...]\n\n"
-              << "  Download given URIs in parallel in the current directory."
-              << std::endl;
+    usage();
     return 0;
   }
 
+  std::vector<download_job> jobs;
+  std::vector<std::pair<std::string, std::string>> global_options;
+  std::vector<std::pair<std::string, std::string>> profile;
+  std::string json_path;
+  int sessions = 1;
+  bool quiet = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--input" && has_value) {
+      if (!read_input_file(argv[++i], &jobs)) {
+        std::cerr << "Cannot read input file " << argv[i] << std::endl;
+        return 1;
+      }
+    }
+    else if (arg == "--sessions" && has_value) {
+      sessions = std::max(std::atoi(argv[++i]), 1);
+    }
+    else if (arg == "--profile" && has_value) {
+      if (!read_profile(argv[++i], &profile)) {
+        std::cerr << "Cannot read profile " << argv[i] << std::endl;
+        return 1;
+      }
+    }
+    else if (arg == "--option" && has_value) {
+      std::pair<std::string, std::string> option;
+      if (!split_option(argv[++i], &option)) {
+        std::cerr << "Invalid option " << argv[i] << std::endl;
+        return 1;
+      }
+      global_options.push_back(option);
+    }
+    else if (arg == "--json" && has_value) {
+      json_path = argv[++i];
+    }
+    else if (arg == "--quiet") {
+      quiet = true;
+    }
+    else if (arg == "--help") {
+      usage();
+      return 0;
+    }
+    else if (arg.compare(0, 2, "--") == 0) {
+      std::cerr << "Unknown option " << arg << std::endl;
+      usage();
+      return 1;
+    }
+    else {
+      jobs.push_back(download_job{{arg}, {}});
+    }
+  }
+
   int rv = aria2_library_init();
   if (rv != 0) {
     std::cerr << "aria2 init failed: " << rv << std::endl;
     return 1;
   }
 
-  aria2_session_config_t config{};
-  aria2_session_config_init(&config);
-  config.download_event_callback = download_event_callback;
-
-  aria2_session_t* session = aria2_session_new(nullptr, 0, &config);
-  if (!session) {
-    std::cerr << "aria2 session create failed" << std::endl;
-    aria2_library_deinit();
-    return 1;
+  // 没有自身选项的下载共享同一个选项集合，有自身选项的下载在配置文件
+  // 选项之后追加自身选项，后者优先。
+  aria2_option_set_t* profile_set = nullptr;
+  if (!profile.empty()) {
+    profile_set = aria2_option_set_new();
+    for (const auto& option : profile) {
+      if (aria2_option_set_set(profile_set, option.first.c_str(),
+                               option.second.c_str()) != 0) {
+        std::cerr << "Invalid profile option " << option.first << std::endl;
+      }
+    }
   }
-
-  for (int i = 1; i < argc; ++i) {
-    const char* uris[] = {argv[i]};
-    rv = aria2_add_uri(session, nullptr, uris, 1, nullptr, 0, -1);
-    if (rv < 0) {
-      std::cerr << "Failed to add download " << argv[i] << std::endl;
+  std::vector<std::vector<const char*>> job_uris(jobs.size());
+  std::vector<std::vector<std::pair<std::string, std::string>>> job_options(
+      jobs.size());
+  std::vector<std::vector<aria2_key_val_t>> job_key_vals(jobs.size());
+  std::vector<aria2_uri_job_t> batch(jobs.size());
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    for (const std::string& uri : jobs[i].uris) {
+      job_uris[i].push_back(uri.c_str());
+    }
+    if (!jobs[i].options.empty()) {
+      job_options[i] = profile;
+      job_options[i].insert(job_options[i].end(), jobs[i].options.begin(),
+                            jobs[i].options.end());
+      job_key_vals[i] = to_key_vals(job_options[i]);
     }
+    batch[i] = aria2_uri_job_t{
+        job_uris[i].data(), job_uris[i].size(), job_key_vals[i].data(),
+        job_key_vals[i].size(), -1,
+        job_key_vals[i].empty() ? profile_set : nullptr};
   }
+  std::vector<aria2_key_val_t> session_options = to_key_vals(global_options);
 
+  run_state state;
+  state.quiet = quiet;
+  std::vector<double> speed_samples;
+  int64_t allocs_before = alloc_count();
   auto start = std::chrono::steady_clock::now();
-  for (;;) {
-    rv = aria2_run(session, ARIA2_RUN_ONCE);
-    if (rv != 1) {
+  for (int s = 0; s < sessions && rv == 0; ++s) {
+    aria2_session_config_t config{};
+    aria2_session_config_init(&config);
+    config.download_event_callback = download_event_callback;
+    config.user_data = &state;
+    config.enable_timings = 1;
+    config.stats_interval_ms = 1000;
+    config.stats_capacity = 24 * 3600;
+
+    // libaria2 每个进程同一时刻只支持一个会话，多个会话依次运行。
+    aria2_session_t* session = aria2_session_new(
+        session_options.data(), session_options.size(), &config);
+    if (!session) {
+      std::cerr << "aria2 session create failed" << std::endl;
+      rv = 1;
       break;
     }
-    auto now = std::chrono::steady_clock::now();
-    auto count =
-        std::chrono::duration_cast<std::chrono::milliseconds>(now - start)
-            .count();
-    if (count >= 500) {
-      start = now;
-      aria2_global_stat_t gstat = aria2_get_global_stat(session);
-      std::cerr << "Overall #Active:" << gstat.num_active
-                << " #waiting:" << gstat.num_waiting
-                << " D:" << gstat.download_speed / 1024 << "KiB/s"
-                << " U:" << gstat.upload_speed / 1024 << "KiB/s "
-                << std::endl;
-
-      aria2_gid_t* gids = nullptr;
-      size_t gids_count = 0;
-      if (aria2_get_active_download(session, &gids, &gids_count) == 0) {
-        for (size_t i = 0; i < gids_count; ++i) {
-          aria2_download_handle_t* dh =
-              aria2_get_download_handle(session, gids[i]);
-          if (dh) {
-            int64_t completed =
-                aria2_download_handle_get_completed_length(dh);
-            int64_t total = aria2_download_handle_get_total_length(dh);
-            int progress =
-                total > 0 ? static_cast<int>(100 * completed / total) : 0;
-            std::cerr << "    [";
-            char* gid_hex = aria2_gid_to_hex(gids[i]);
-            if (gid_hex) {
-              std::cerr << gid_hex;
-              aria2_free(gid_hex);
-            }
-            else {
-              std::cerr << "unknown";
-            }
-            std::cerr << "] " << completed << "/" << total << "(" << progress
-                      << "%)"
-                      << " D:"
-                      << aria2_download_handle_get_download_speed(dh) / 1024
-                      << "KiB/s, U:"
-                      << aria2_download_handle_get_upload_speed(dh) / 1024
-                      << "KiB/s" << std::endl;
-            aria2_delete_download_handle(dh);
-          }
-        }
+
+    state.session = s;
+    state.index.clear();
+    std::vector<aria2_gid_t> gids(batch.size());
+    std::vector<int> results(batch.size());
+    aria2_add_uri_batch(session, batch.data(), batch.size(), gids.data(),
+                        results.data());
+    for (size_t i = 0; i < batch.size(); ++i) {
+      download_record record;
+      record.session = s;
+      record.uri = jobs[i].uris.empty() ? std::string() : jobs[i].uris[0];
+      if (results[i] < 0) {
+        std::cerr << "Failed to add download " << record.uri << std::endl;
+        record.status = ARIA2_DOWNLOAD_ERROR;
+        record.error_code = -1;
       }
-      aria2_free(gids);
+      else {
+        record.gid = gids[i];
+        state.index[gids[i]] = state.records.size();
+      }
+      state.records.push_back(record);
+    }
+
+    aria2_run_with_tick(session, 500, quiet ? quiet_tick : print_progress,
+                        nullptr);
+
+    aria2_global_stat_sample_t* samples = nullptr;
+    size_t samples_count = 0;
+    if (aria2_get_global_stat_series(session, 0, &samples, &samples_count) ==
+        0) {
+      for (size_t i = 0; i < samples_count; ++i) {
+        speed_samples.push_back(samples[i].stat.download_speed / 1e6);
+      }
+      aria2_free(samples);
+    }
+    rv = aria2_session_final(session);
+  }
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  int64_t allocs =
+      allocs_before < 0 ? -1 : alloc_count() - allocs_before;
+
+  if (!json_path.empty()) {
+    if (json_path == "-") {
+      write_summary(std::cout, sessions, elapsed, state.records,
+                    speed_samples, allocs);
+    }
+    else {
+      std::ofstream out(json_path);
+      write_summary(out, sessions, elapsed, state.records, speed_samples,
+                    allocs);
     }
   }
 
-  rv = aria2_session_final(session);
+  aria2_option_set_free(profile_set);
   aria2_library_deinit();
   return rv;
 }
@@ -0,0 +1,1037 @@
+// 包含实现文件，以便检查内部状态。
+#include "../src/aria2_c_api.cpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#  include "../bench/loopback_server.h"
+#  define ARIA2_TEST_LOOPBACK 1
+#endif
+
+namespace {
+
+int g_failures = 0;
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,       \
+                   __LINE__, #cond);                                    \
+      ++g_failures;                                                     \
+    }                                                                   \
+  } while (0)
+
+std::string temp_dir()
+{
+  const char* tmp = std::getenv("TMPDIR");
+  return tmp && *tmp ? tmp : "/tmp";
+}
+
+std::string to_string(aria2_str_view_t view)
+{
+  return view.data ? std::string(view.data, view.length) : std::string();
+}
+
+aria2_session_t* new_session(aria2_session_config_t* config)
+{
+  std::string dir = temp_dir();
+  aria2_key_val_t options[] = {
+      {const_cast<char*>("dir"), const_cast<char*>(dir.c_str())}};
+  config->keep_running = 1;
+  return aria2_session_new(options, 1, config);
+}
+
+// 同一下载的两个共享句柄持有者，各自的视图互不影响。
+void test_shared_handle_views(int threaded)
+{
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  config.threaded = threaded;
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  const char* uri = "http://127.0.0.1:1/shared-handle";
+  aria2_key_val_t options[] = {
+      {const_cast<char*>("pause"), const_cast<char*>("true")},
+      {const_cast<char*>("split"), const_cast<char*>("3")},
+      {const_cast<char*>("max-connection-per-server"),
+       const_cast<char*>("7")}};
+  aria2_gid_t gid = 0;
+  CHECK(aria2_add_uri(session, &gid, &uri, 1, options, 3, -1) == 0);
+
+  aria2_download_handle_t* first = aria2_acquire_download_handle(session, gid);
+  aria2_download_handle_t* second = aria2_acquire_download_handle(session, gid);
+  CHECK(first && second && first != second);
+  if (first && second) {
+    aria2_str_view_t split = aria2_download_handle_view_option(first, "split");
+    aria2_str_view_t dir = aria2_download_handle_view_dir(first);
+    aria2_bytes_view_t bitfield = aria2_download_handle_view_bitfield(first);
+    std::string dir_copy = to_string(dir);
+    std::string bitfield_copy(reinterpret_cast<const char*>(bitfield.data),
+                              bitfield.length);
+    CHECK(to_string(split) == "3");
+
+    CHECK(to_string(aria2_download_handle_view_option(
+              second, "max-connection-per-server")) == "7");
+    aria2_download_handle_view_dir(second);
+    aria2_download_handle_view_bitfield(second);
+    aria2_release_download_handle(second);
+    second = nullptr;
+    // 另一个持有者的调用和释放不影响已取得的视图。
+    aria2_download_handle_t* third =
+        aria2_acquire_download_handle(session, gid);
+    CHECK(third);
+    aria2_download_handle_view_option(third, "max-connection-per-server");
+    aria2_download_handle_view_bitfield(third);
+
+    CHECK(to_string(split) == "3");
+    CHECK(to_string(dir) == dir_copy);
+    CHECK(std::string(reinterpret_cast<const char*>(bitfield.data),
+                      bitfield.length) == bitfield_copy);
+    aria2_release_download_handle(third);
+  }
+  aria2_release_download_handle(second);
+  aria2_release_download_handle(first);
+
+  aria2_remove_download(session, gid, 1);
+  aria2_shutdown(session, 1);
+  aria2_session_final(session);
+}
+
+// 共享句柄读取最新的速度和上传量，两种句柄互相传错释放函数时按各自
+// 的方式释放，未释放的持有者使 aria2_session_final 失败。
+void test_shared_handle_lifetime(int threaded)
+{
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  config.threaded = threaded;
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  const char* uri = "http://127.0.0.1:1/shared-lifetime";
+  // 限速使下载在检查统计值时仍处于活动状态。
+  aria2_key_val_t options[] = {
+      {const_cast<char*>("pause"), const_cast<char*>("true")},
+      {const_cast<char*>("max-download-limit"), const_cast<char*>("1M")}};
+  aria2_gid_t gid = 0;
+  CHECK(aria2_add_uri(session, &gid, &uri, 1, options, 2, -1) == 0);
+
+  aria2_download_handle_t* shared = aria2_acquire_download_handle(session, gid);
+  CHECK(shared);
+  if (shared) {
+    CHECK(aria2_download_handle_get_download_speed(shared) == 0);
+    CHECK(aria2_download_handle_get_upload_length(shared) == 0);
+  }
+  CHECK(aria2_unpause_download(session, gid) == 0);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (shared && aria2_download_handle_get_completed_length(shared) == 0 &&
+         std::chrono::steady_clock::now() < deadline) {
+    if (threaded) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    else {
+      aria2_run(session, ARIA2_RUN_ONCE);
+    }
+  }
+  if (shared) {
+    CHECK(aria2_download_handle_get_status(shared) == ARIA2_DOWNLOAD_ACTIVE);
+    CHECK(aria2_download_handle_get_download_speed(shared) > 0);
+    CHECK(aria2_download_handle_get_upload_length(shared) > 0);
+  }
+
+  aria2_release_download_handle(aria2_get_download_handle(session, gid));
+  aria2_delete_download_handle(aria2_acquire_download_handle(session, gid));
+
+  aria2_remove_download(session, gid, 1);
+  if (shared) {
+    aria2_file_data_t file = aria2_download_handle_get_file(shared, 1);
+    if (file.path) {
+      std::remove(file.path);
+    }
+    aria2_free_file_data(&file);
+  }
+  aria2_shutdown(session, 1);
+  CHECK(aria2_session_final(session) == (shared ? -1 : 0));
+  if (shared) {
+    aria2_release_download_handle(shared);
+    CHECK(aria2_session_final(session) == 0);
+  }
+}
+
+void count_task(aria2_session_t*, void* user_data)
+{
+  ++*static_cast<std::atomic<int>*>(user_data);
+}
+
+// 线程模式下其他线程的调用唤醒 aria2 对网络事件的等待，不必等到
+// 约 1 秒的等待超时；aria2_session_final 开始后调用不再入队。
+void test_loop_call_latency()
+{
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  config.threaded = 1;
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  std::atomic<int> tasks{0};
+  auto slowest = std::chrono::steady_clock::duration::zero();
+  for (int i = 0; i < 5; ++i) {
+    // 让事件循环进入 aria2 的等待。
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    auto start = std::chrono::steady_clock::now();
+    CHECK(aria2_session_post(session, count_task, &tasks) == 0);
+    aria2_get_global_stat(session);
+    slowest = std::max(slowest, std::chrono::steady_clock::now() - start);
+  }
+  CHECK(tasks.load() == 5);
+  CHECK(slowest < std::chrono::milliseconds(250));
+
+  session->loop->closing.store(true);
+  CHECK(aria2_session_post(session, count_task, &tasks) == -1);
+  CHECK(aria2_shutdown(session, 1) == -1);
+  CHECK(tasks.load() == 5);
+  aria2_session_final(session);
+}
+
+int count_tick(aria2_session_t*, void* user_data)
+{
+  return ++*static_cast<int*>(user_data) == 3;
+}
+
+// 空闲的会话里 aria2 每次等待网络事件约 1 秒，超时、tick 和
+// aria2_wakeup 都应在这一等待中途生效。
+void test_run_for_latency()
+{
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  CHECK(aria2_run_for(session, 50) == 1);
+  CHECK(std::chrono::steady_clock::now() - start <
+        std::chrono::milliseconds(300));
+
+  int ticks = 0;
+  start = std::chrono::steady_clock::now();
+  CHECK(aria2_run_with_tick(session, 30, count_tick, &ticks) == 1);
+  CHECK(ticks == 3);
+  CHECK(std::chrono::steady_clock::now() - start <
+        std::chrono::milliseconds(400));
+
+  std::thread waker([session] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    aria2_wakeup(session);
+  });
+  start = std::chrono::steady_clock::now();
+  CHECK(aria2_run_for(session, 5000) == 1);
+  CHECK(std::chrono::steady_clock::now() - start <
+        std::chrono::milliseconds(400));
+  waker.join();
+  aria2_session_final(session);
+}
+
+std::string to_hex(const uint8_t* data, size_t length)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (size_t i = 0; i < length; ++i) {
+    hex += digits[data[i] >> 4];
+    hex += digits[data[i] & 0xf];
+  }
+  return hex;
+}
+
+std::string hash_hex(int type, const std::string& input)
+{
+  aria2_hash hash;
+  if (!aria2_hash_init(&hash, type)) {
+    return std::string();
+  }
+  aria2_hash_update(&hash, reinterpret_cast<const uint8_t*>(input.data()),
+                    input.size());
+  uint8_t out[32];
+  aria2_hash_final(&hash, out);
+  return to_hex(out, type == ARIA2_DIGEST_SHA1 ? 20 : 32);
+}
+
+uint64_t xxh64(const std::string& input)
+{
+  aria2_xxh64_state state;
+  aria2_xxh64_init(&state);
+  aria2_xxh64_update(&state, reinterpret_cast<const uint8_t*>(input.data()),
+                     input.size());
+  return aria2_xxh64_final(&state);
+}
+
+// 各摘要算法的标准测试向量。
+void test_digest_vectors()
+{
+  CHECK(hash_hex(ARIA2_DIGEST_SHA1, "") ==
+        "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+  CHECK(hash_hex(ARIA2_DIGEST_SHA1, "abc") ==
+        "a9993e364706816aba3e25717850c26c9cd0d89d");
+  CHECK(hash_hex(ARIA2_DIGEST_SHA256, "") ==
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  CHECK(hash_hex(ARIA2_DIGEST_SHA256, "abc") ==
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  CHECK(xxh64("") == 0xef46db3751d8e999ULL);
+  CHECK(xxh64("abc") == 0x44bc2cf5ad770999ULL);
+}
+
+// 保存的位图原地比较：内容相同不产生新版本，变化时记录翻转区间。
+void test_bitfield_track_update()
+{
+  aria2_bitfield_track track;
+  std::string bits(16, '\0');
+  CHECK(aria2_bitfield_track_update(track, bits, 128));
+  CHECK(track.version == 1);
+  CHECK(track.history.back().second.empty());
+
+  bits.assign(16, '\0');
+  CHECK(!aria2_bitfield_track_update(track, bits, 128));
+  CHECK(track.version == 1);
+
+  // 分片 3、8..15 和 127 完成。
+  bits.assign(16, '\0');
+  bits[0] = 0x10;
+  bits[1] = static_cast<char>(0xff);
+  bits[15] = 0x01;
+  CHECK(aria2_bitfield_track_update(track, bits, 128));
+  CHECK(track.version == 2);
+  const std::vector<aria2_piece_range_t>& flipped = track.history.back().second;
+  CHECK(flipped.size() == 3);
+  if (flipped.size() == 3) {
+    CHECK(flipped[0].begin == 3 && flipped[0].end == 4);
+    CHECK(flipped[1].begin == 8 && flipped[1].end == 16);
+    CHECK(flipped[2].begin == 127 && flipped[2].end == 128);
+  }
+  CHECK(static_cast<uint8_t>(track.bits[1]) == 0xff);
+}
+
+#if defined(ARIA2_TEST_LOOPBACK)
+const int64_t g_loopback_size = 4 * 1024 * 1024;
+
+// 回环下载的附加设置。
+struct loopback_setup {
+  // /stream-0.bin 不提供长度。
+  const char* path = "/bench-0.bin";
+  const char* split = "1";
+  const aria2_sink_t* sink = nullptr;
+  int64_t memory_target = 0;
+  int digests = 0;
+};
+
+// 添加一个从回环服务器下载的任务。
+aria2_gid_t add_loopback_download(aria2_session_t* session,
+                                  const loopback_server& server,
+                                  const char* out,
+                                  const loopback_setup& setup = {})
+{
+  std::string uri =
+      "http://127.0.0.1:" + std::to_string(server.port()) + setup.path;
+  const char* uris[] = {uri.c_str()};
+  aria2_option_set_t* option_set = aria2_option_set_new();
+  aria2_option_set_set(option_set, "out", out);
+  aria2_option_set_set(option_set, "allow-overwrite", "true");
+  aria2_option_set_set(option_set, "split", setup.split);
+  // 限速使下载持续多次迭代，接收回调有机会施加背压。
+  aria2_option_set_set(option_set, "max-download-limit", "2M");
+  aria2_gid_t gid = 0;
+  if (aria2_option_set_set_sink(option_set, setup.sink) != 0 ||
+      aria2_option_set_set_memory_target(option_set, setup.memory_target) !=
+          0 ||
+      aria2_option_set_set_digests(option_set, setup.digests) != 0 ||
+      aria2_add_uri_with_option_set(session, &gid, uris, 1, option_set, -1) !=
+          0) {
+    gid = 0;
+  }
+  aria2_option_set_free(option_set);
+  return gid;
+}
+
+struct back_pressure_state {
+  const loopback_server* server = nullptr;
+  bool stalled = true;
+  bool finished = false;
+  bool in_order = true;
+  bool same = true;
+  int64_t delivered = 0;
+  int64_t end = -1;
+};
+
+int back_pressure_sink(aria2_session_t*,
+                       aria2_gid_t,
+                       int64_t offset,
+                       const uint8_t* data,
+                       size_t length,
+                       void* user_data)
+{
+  auto* state = static_cast<back_pressure_state*>(user_data);
+  if (!data) {
+    state->finished = true;
+    state->end = offset;
+    return 0;
+  }
+  if (state->stalled) {
+    return 1;
+  }
+  state->in_order = state->in_order && offset == state->delivered;
+  for (size_t i = 0; state->same && i < length; ++i) {
+    state->same = static_cast<char>(data[i]) ==
+                  state->server->byte_at(offset + static_cast<int64_t>(i));
+  }
+  state->delivered += static_cast<int64_t>(length);
+  return 0;
+}
+
+// 暂存的数据超过 max_backlog 时下载被限速，消费者追上后恢复原来的限速
+// 并完成；数据只经过接收回调，不写入文件。
+void test_sink_back_pressure()
+{
+  loopback_server server(g_loopback_size, 1);
+  CHECK(server.start());
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  back_pressure_state state;
+  state.server = &server;
+  aria2_sink_t sink = {back_pressure_sink, &state, 1024 * 1024};
+  loopback_setup setup;
+  setup.sink = &sink;
+  aria2_gid_t gid =
+      add_loopback_download(session, server, "back-pressure.bin", setup);
+  CHECK(gid);
+
+  bool throttled = false;
+  std::string limit;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (!state.finished && std::chrono::steady_clock::now() < deadline) {
+    aria2_run(session, ARIA2_RUN_ONCE);
+    auto it = session->sinks.find(static_cast<aria2::A2Gid>(gid));
+    if (state.stalled && it != session->sinks.end() && it->second.throttled) {
+      aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+      if (dh) {
+        limit = to_string(
+            aria2_download_handle_view_option(dh, "max-download-limit"));
+        aria2_delete_download_handle(dh);
+      }
+      throttled = true;
+      state.stalled = false;
+    }
+  }
+  CHECK(throttled);
+  CHECK(limit == "1");
+  CHECK(state.finished);
+  CHECK(state.in_order);
+  CHECK(state.same);
+  CHECK(state.delivered == g_loopback_size);
+  CHECK(state.end == g_loopback_size);
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  CHECK(dh && aria2_download_handle_get_status(dh) == ARIA2_DOWNLOAD_COMPLETE);
+  if (dh) {
+    CHECK(to_string(aria2_download_handle_view_option(
+              dh, "max-download-limit")) != "1");
+    aria2_file_data_t file = aria2_download_handle_get_file(dh, 1);
+    FILE* written = file.path ? std::fopen(file.path, "rb") : nullptr;
+    CHECK(!written);
+    if (written) {
+      std::fclose(written);
+    }
+    aria2_free_file_data(&file);
+  }
+  aria2_delete_download_handle(dh);
+
+  aria2_shutdown(session, 1);
+  aria2_session_final(session);
+}
+
+struct memory_target_state {
+  std::atomic<bool> completed{false};
+  int taken = -2;
+  aria2_binary_t buffer = {};
+};
+
+int memory_target_event(aria2_session_t* session,
+                        aria2_download_event_t event,
+                        aria2_gid_t gid,
+                        void* user_data)
+{
+  auto* state = static_cast<memory_target_state*>(user_data);
+  if (event != ARIA2_EVENT_ON_DOWNLOAD_COMPLETE) {
+    return 0;
+  }
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  if (dh) {
+    state->taken = aria2_download_handle_take_buffer(dh, &state->buffer);
+    aria2_delete_download_handle(dh);
+  }
+  state->completed = true;
+  return 0;
+}
+
+// 下载的文件是否存在。
+bool download_file_exists(aria2_session_t* session, aria2_gid_t gid)
+{
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  if (!dh) {
+    return false;
+  }
+  aria2_file_data_t file = aria2_download_handle_get_file(dh, 1);
+  FILE* stream = file.path ? std::fopen(file.path, "rb") : nullptr;
+  if (stream) {
+    std::fclose(stream);
+  }
+  aria2_free_file_data(&file);
+  aria2_delete_download_handle(dh);
+  return stream != nullptr;
+}
+
+// 内存目标的缓冲区在下载完成事件的回调中即可取得，不写入文件。
+void test_memory_target_take_in_event(int threaded)
+{
+  loopback_server server(g_loopback_size, 1);
+  CHECK(server.start());
+  memory_target_state state;
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  config.threaded = threaded;
+  config.download_event_callback = memory_target_event;
+  config.user_data = &state;
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  // 线程模式下事件循环可能在添加后立即开始下载，在添加时设置。
+  loopback_setup setup;
+  setup.memory_target = 2 * g_loopback_size;
+  aria2_gid_t gid =
+      add_loopback_download(session, server, "memory-target.bin", setup);
+  CHECK(gid);
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (!state.completed && std::chrono::steady_clock::now() < deadline) {
+    if (threaded) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    else {
+      aria2_run(session, ARIA2_RUN_ONCE);
+    }
+  }
+  CHECK(state.completed);
+  CHECK(state.taken == 0);
+  CHECK(state.buffer.length == static_cast<size_t>(g_loopback_size));
+  bool same = state.buffer.data != nullptr;
+  for (size_t i = 0; same && i < state.buffer.length; ++i) {
+    same = static_cast<char>(state.buffer.data[i]) ==
+           server.byte_at(static_cast<int64_t>(i));
+  }
+  CHECK(same);
+  CHECK(!download_file_exists(session, gid));
+  aria2_free_binary(&state.buffer);
+
+  aria2_shutdown(session, 1);
+  aria2_session_final(session);
+}
+
+// 超过上限的内存目标溢出到文件。overflow 为 0 时长度已知且超过上限，
+// 第一次写入即溢出；为 1 时长度未知，缓冲区写满后在下载中途溢出。
+void test_memory_target_spill(int overflow)
+{
+  loopback_server server(g_loopback_size, 1);
+  CHECK(server.start());
+  memory_target_state state;
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  config.download_event_callback = memory_target_event;
+  config.user_data = &state;
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  const int64_t max_bytes = 1024 * 1024;
+  loopback_setup setup;
+  if (overflow) {
+    setup.path = "/stream-0.bin";
+    setup.memory_target = max_bytes;
+  }
+  aria2_gid_t gid =
+      add_loopback_download(session, server, "memory-spill.bin", setup);
+  CHECK(gid);
+  if (!overflow) {
+    CHECK(aria2_set_download_memory_target(session, gid, max_bytes) == 0);
+  }
+
+  bool buffered = false;
+  bool spilled = false;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (!state.completed && std::chrono::steady_clock::now() < deadline) {
+    aria2_run(session, ARIA2_RUN_ONCE);
+    auto it = session->memory_targets.find(static_cast<aria2::A2Gid>(gid));
+    if (it != session->memory_targets.end()) {
+      buffered = buffered || (!it->second.spilled && it->second.buffer.length);
+      spilled = spilled || it->second.spilled;
+    }
+  }
+  CHECK(state.completed);
+  CHECK(spilled);
+  CHECK(buffered == (overflow != 0));
+  CHECK(state.taken == 1);
+  CHECK(!state.buffer.data && !state.buffer.length);
+  CHECK(session->memory_targets.empty());
+
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  CHECK(dh);
+  if (dh) {
+    aria2_file_data_t file = aria2_download_handle_get_file(dh, 1);
+    FILE* stream = file.path ? std::fopen(file.path, "rb") : nullptr;
+    CHECK(stream);
+    if (stream) {
+      std::vector<char> data(static_cast<size_t>(g_loopback_size) + 1);
+      size_t n = std::fread(data.data(), 1, data.size(), stream);
+      std::fclose(stream);
+      CHECK(n == static_cast<size_t>(g_loopback_size));
+      bool same = true;
+      for (size_t i = 0; same && i < n; ++i) {
+        same = data[i] == server.byte_at(static_cast<int64_t>(i));
+      }
+      CHECK(same);
+      std::remove(file.path);
+    }
+    aria2_free_file_data(&file);
+    aria2_delete_download_handle(dh);
+  }
+
+  aria2_shutdown(session, 1);
+  aria2_session_final(session);
+}
+
+// 计算回环服务器前 size 字节的全部摘要。
+void server_digests(const loopback_server& server,
+                    int64_t size,
+                    aria2_download_digests_t* digests)
+{
+  aria2_hash sha1;
+  aria2_hash sha256;
+  aria2_xxh64_state xxh;
+  aria2_hash_init(&sha1, ARIA2_DIGEST_SHA1);
+  aria2_hash_init(&sha256, ARIA2_DIGEST_SHA256);
+  aria2_xxh64_init(&xxh);
+  *digests = aria2_download_digests_t{};
+  std::vector<uint8_t> buffer(64 * 1024);
+  for (int64_t offset = 0; offset < size;) {
+    size_t n = static_cast<size_t>(
+        std::min<int64_t>(static_cast<int64_t>(buffer.size()), size - offset));
+    for (size_t i = 0; i < n; ++i) {
+      buffer[i] = static_cast<uint8_t>(server.byte_at(offset + i));
+    }
+    aria2_hash_update(&sha1, buffer.data(), n);
+    aria2_hash_update(&sha256, buffer.data(), n);
+    aria2_xxh64_update(&xxh, buffer.data(), n);
+    offset += static_cast<int64_t>(n);
+  }
+  digests->length = size;
+  aria2_hash_final(&sha1, digests->sha1);
+  aria2_hash_final(&sha256, digests->sha256);
+  digests->xxh64 = aria2_xxh64_final(&xxh);
+}
+
+int accept_sink(aria2_session_t*,
+                aria2_gid_t,
+                int64_t,
+                const uint8_t*,
+                size_t,
+                void*)
+{
+  return 0;
+}
+
+// 完成的下载的摘要与服务器数据的摘要一致。target 为 0 时写入文件并在
+// 添加后设置；为 1 时写入文件、分段下载，乱序区间从文件补算；为 2 时
+// 分段写入内存目标；为 3 时分段交给接收回调，乱序数据保留副本。
+void test_download_digests(int target)
+{
+  loopback_server server(g_loopback_size, 1);
+  CHECK(server.start());
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  const int types =
+      ARIA2_DIGEST_SHA1 | ARIA2_DIGEST_SHA256 | ARIA2_DIGEST_XXH64;
+  aria2_sink_t sink = {accept_sink, nullptr, 0};
+  loopback_setup setup;
+  if (target > 0) {
+    setup.split = "4";
+    setup.digests = types;
+  }
+  if (target == 2) {
+    setup.memory_target = 2 * g_loopback_size;
+  }
+  if (target == 3) {
+    setup.sink = &sink;
+  }
+  aria2_gid_t gid = add_loopback_download(session, server, "digests.bin", setup);
+  CHECK(gid);
+  if (target == 0) {
+    CHECK(aria2_set_download_digests(session, gid, types) == 0);
+  }
+  // 摘要已设置。
+  CHECK(aria2_set_download_digests(session, gid, types) == -1);
+
+  aria2_download_digests_t digests = {};
+  int rv = 1;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (rv == 1 && std::chrono::steady_clock::now() < deadline) {
+    aria2_run(session, ARIA2_RUN_ONCE);
+    aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+    rv = dh ? aria2_download_handle_get_digests(dh, &digests) : -1;
+    aria2_delete_download_handle(dh);
+  }
+  CHECK(rv == 0);
+  CHECK(digests.types == types);
+  aria2_download_digests_t expected;
+  server_digests(server, g_loopback_size, &expected);
+  CHECK(digests.length == expected.length);
+  CHECK(std::memcmp(digests.sha1, expected.sha1, sizeof(expected.sha1)) == 0);
+  CHECK(std::memcmp(digests.sha256, expected.sha256,
+                    sizeof(expected.sha256)) == 0);
+  CHECK(digests.xxh64 == expected.xxh64);
+  CHECK(session->active_digests.empty());
+  CHECK(download_file_exists(session, gid) == (target < 2));
+
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  if (dh) {
+    aria2_file_data_t file = aria2_download_handle_get_file(dh, 1);
+    if (file.path) {
+      std::remove(file.path);
+    }
+    aria2_free_file_data(&file);
+    aria2_delete_download_handle(dh);
+  }
+
+  aria2_shutdown(session, 1);
+  aria2_session_final(session);
+}
+
+struct range_result {
+  int64_t begin;
+  int64_t end;
+  int result;
+};
+
+void record_range(aria2_session_t* session,
+                  aria2_gid_t,
+                  int64_t begin,
+                  int64_t end,
+                  int result,
+                  void* user_data)
+{
+  static_cast<std::vector<range_result>*>(user_data)->push_back(
+      range_result{begin, end, result});
+  // 区间等待在 aria2 的迭代内部检查，唤醒使 aria2_run_for 立即返回。
+  aria2_wakeup(session);
+}
+
+// 检查可读区间：按偏移递增、互不重叠且不超过下载大小。
+bool available_ranges_valid(aria2_session_t* session, aria2_gid_t gid)
+{
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  if (!dh) {
+    return false;
+  }
+  aria2_byte_range_t* ranges = nullptr;
+  size_t count = 0;
+  bool valid = aria2_download_handle_get_available_ranges(dh, &ranges,
+                                                           &count) == 0;
+  int64_t last = 0;
+  for (size_t i = 0; valid && i < count; ++i) {
+    valid = ranges[i].begin >= last && ranges[i].begin < ranges[i].end &&
+            ranges[i].end <= g_loopback_size;
+    last = ranges[i].end + 1;
+  }
+  aria2_free(ranges);
+  aria2_delete_download_handle(dh);
+  return valid;
+}
+
+// 区间等待：就绪的区间回调 0，超出下载大小的回调 -1，结束后不保留
+// 位图记录。
+void test_watch_range()
+{
+  loopback_server server(g_loopback_size, 1);
+  CHECK(server.start());
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  loopback_setup setup;
+  setup.split = "4";
+  aria2_gid_t gid = add_loopback_download(session, server, "ranges.bin", setup);
+  CHECK(gid);
+  std::vector<range_result> fired;
+  const int64_t mib = 1024 * 1024;
+  CHECK(aria2_watch_range(session, gid, 0, mib, record_range, &fired) == 0);
+  CHECK(aria2_watch_range(session, gid, g_loopback_size - 1024, -1,
+                          record_range, &fired) == 0);
+  CHECK(aria2_watch_range(session, gid, 0, g_loopback_size + 1, record_range,
+                          &fired) == 0);
+  CHECK(aria2_watch_range(session, gid, 2, 1, record_range, &fired) == -1);
+  CHECK(aria2_watch_range(session, static_cast<aria2_gid_t>(0xdead), 0, 1,
+                          record_range, &fired) == -1);
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (fired.size() < 3 && std::chrono::steady_clock::now() < deadline) {
+    aria2_run_for(session, 5000);
+    CHECK(available_ranges_valid(session, gid));
+  }
+  CHECK(fired.size() == 3);
+  for (const range_result& entry : fired) {
+    CHECK(entry.result == (entry.end == g_loopback_size + 1 ? -1 : 0));
+  }
+  CHECK(session->range_watches.empty());
+  CHECK(session->bitfields.empty());
+
+  // 完成后整个下载可读。
+  int rv = 1;
+  while (rv == 1 && std::chrono::steady_clock::now() < deadline) {
+    aria2_run(session, ARIA2_RUN_ONCE);
+    aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+    rv = dh && aria2_download_handle_get_status(dh) == ARIA2_DOWNLOAD_COMPLETE
+             ? 0
+             : 1;
+    aria2_delete_download_handle(dh);
+  }
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  CHECK(dh);
+  if (dh) {
+    aria2_byte_range_t* ranges = nullptr;
+    size_t count = 0;
+    CHECK(aria2_download_handle_get_available_ranges(dh, &ranges, &count) ==
+          0);
+    CHECK(count == 1 && ranges[0].begin == 0 &&
+          ranges[0].end == g_loopback_size);
+    aria2_free(ranges);
+    // 已完成的下载上的等待在下一次迭代后就绪。
+    CHECK(aria2_watch_range(session, gid, 0, -1, record_range, &fired) == 0);
+    aria2_run(session, ARIA2_RUN_ONCE);
+    CHECK(fired.size() == 4 && fired.back().result == 0);
+    aria2_file_data_t file = aria2_download_handle_get_file(dh, 1);
+    if (file.path) {
+      std::remove(file.path);
+    }
+    aria2_free_file_data(&file);
+    aria2_delete_download_handle(dh);
+  }
+
+  aria2_shutdown(session, 1);
+  aria2_session_final(session);
+}
+
+// 变化订阅：注册的轮询者各自读到活动下载的进度和事件带来的最终状态，
+// 注销后编号失效。
+void test_change_feed()
+{
+  loopback_server server(g_loopback_size, 1);
+  CHECK(server.start());
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  config.enable_change_feed = 1;
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  uint64_t first = aria2_register_change_poller(session);
+  uint64_t second = aria2_register_change_poller(session);
+  CHECK(first != 0 && second != 0 && first != second);
+  aria2_gid_t gid = add_loopback_download(session, server, "changes.bin");
+  CHECK(gid);
+
+  aria2_change_t changes[8];
+  size_t count = 0;
+  CHECK(aria2_poll_changes(session, first, changes, 8, &count) == 0);
+  CHECK(count == 1 && changes[0].gid == gid &&
+        changes[0].status == ARIA2_DOWNLOAD_WAITING);
+  CHECK(aria2_poll_changes(session, first, changes, 8, &count) == 0);
+  CHECK(count == 0);
+
+  int64_t progress = 0;
+  bool saw_active = false;
+  aria2_download_status_t status = ARIA2_DOWNLOAD_WAITING;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (status != ARIA2_DOWNLOAD_COMPLETE &&
+         std::chrono::steady_clock::now() < deadline) {
+    aria2_run(session, ARIA2_RUN_ONCE);
+    CHECK(aria2_poll_changes(session, first, changes, 8, &count) == 0);
+    for (size_t i = 0; i < count; ++i) {
+      CHECK(changes[i].gid == gid);
+      CHECK(changes[i].completed_length >= progress);
+      progress = changes[i].completed_length;
+      status = changes[i].status;
+      saw_active = saw_active || status == ARIA2_DOWNLOAD_ACTIVE;
+    }
+  }
+  CHECK(saw_active);
+  CHECK(status == ARIA2_DOWNLOAD_COMPLETE);
+  CHECK(progress == g_loopback_size);
+
+  // 第二个轮询者只读到最新状态。
+  CHECK(aria2_poll_changes(session, second, changes, 8, &count) == 0);
+  CHECK(count == 1 && changes[0].status == ARIA2_DOWNLOAD_COMPLETE);
+  CHECK(aria2_unregister_change_poller(session, second) == 0);
+  CHECK(aria2_unregister_change_poller(session, second) == -1);
+  CHECK(aria2_poll_changes(session, second, changes, 8, &count) == -1);
+  CHECK(session->change_feed->pollers.size() == 1);
+
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  if (dh) {
+    aria2_file_data_t file = aria2_download_handle_get_file(dh, 1);
+    if (file.path) {
+      std::remove(file.path);
+    }
+    aria2_free_file_data(&file);
+    aria2_delete_download_handle(dh);
+  }
+  CHECK(aria2_unregister_change_poller(session, first) == 0);
+  aria2_shutdown(session, 1);
+  aria2_session_final(session);
+}
+
+// 阶段耗时：接收回调的下载按写入计时，其余下载按采样计时。
+void test_download_timings(int sink_mode)
+{
+  loopback_server server(g_loopback_size, 1);
+  CHECK(server.start());
+  aria2_session_config_t config;
+  aria2_session_config_init(&config);
+  config.enable_timings = 1;
+  aria2_session_t* session = new_session(&config);
+  CHECK(session);
+  if (!session) {
+    return;
+  }
+  aria2_sink_t sink = {accept_sink, nullptr, 0};
+  loopback_setup setup;
+  if (sink_mode) {
+    setup.sink = &sink;
+  }
+  aria2_gid_t gid = add_loopback_download(session, server, "timings.bin", setup);
+  CHECK(gid);
+
+  aria2_download_timings_t timings = {-1, -1, -1, -1, -1};
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (timings.total_ms < 0 && std::chrono::steady_clock::now() < deadline) {
+    aria2_run(session, ARIA2_RUN_ONCE);
+    aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+    if (dh) {
+      aria2_download_handle_get_timings(dh, &timings);
+    }
+    aria2_delete_download_handle(dh);
+  }
+  CHECK(timings.total_ms >= 0);
+  CHECK(timings.queued_ms >= 0);
+  CHECK(timings.first_byte_ms >= 0);
+  CHECK(timings.transfer_ms >= 0);
+  CHECK(timings.finalize_ms >= 0);
+  CHECK(timings.queued_ms + timings.first_byte_ms + timings.transfer_ms +
+            timings.finalize_ms <=
+        timings.total_ms);
+  const aria2_timing_record& record =
+      session->timings->records[static_cast<aria2::A2Gid>(gid)];
+  CHECK((record.last_write.time_since_epoch().count() != 0) ==
+        (sink_mode != 0));
+
+  aria2_download_handle_t* dh = aria2_get_download_handle(session, gid);
+  if (dh) {
+    aria2_file_data_t file = aria2_download_handle_get_file(dh, 1);
+    if (file.path) {
+      std::remove(file.path);
+    }
+    aria2_free_file_data(&file);
+    aria2_delete_download_handle(dh);
+  }
+
+  aria2_shutdown(session, 1);
+  aria2_session_final(session);
+}
+#endif
+
+struct test_case {
+  const char* name;
+  void (*run)();
+};
+
+const test_case g_tests[] = {
+    {"digest_vectors", test_digest_vectors},
+    {"shared_handle_views", [] { test_shared_handle_views(0); }},
+    {"shared_handle_views_threaded", [] { test_shared_handle_views(1); }},
+    {"shared_handle_lifetime", [] { test_shared_handle_lifetime(0); }},
+    {"shared_handle_lifetime_threaded",
+     [] { test_shared_handle_lifetime(1); }},
+    {"loop_call_latency", test_loop_call_latency},
+    {"bitfield_track_update", test_bitfield_track_update},
+    {"run_for_latency", test_run_for_latency},
+#if defined(ARIA2_TEST_LOOPBACK)
+    {"sink_back_pressure", test_sink_back_pressure},
+    {"memory_target_take_in_event",
+     [] { test_memory_target_take_in_event(0); }},
+    {"memory_target_take_in_event_threaded",
+     [] { test_memory_target_take_in_event(1); }},
+    {"memory_target_spill_known_size", [] { test_memory_target_spill(0); }},
+    {"memory_target_spill_overflow", [] { test_memory_target_spill(1); }},
+    {"download_digests", [] { test_download_digests(0); }},
+    {"download_digests_file_out_of_order", [] { test_download_digests(1); }},
+    {"download_digests_memory_target", [] { test_download_digests(2); }},
+    {"download_digests_sink", [] { test_download_digests(3); }},
+    {"watch_range", test_watch_range},
+    {"change_feed", test_change_feed},
+    {"download_timings", [] { test_download_timings(0); }},
+    {"download_timings_sink", [] { test_download_timings(1); }},
+#endif
+};
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  const char* filter = argc > 1 ? argv[1] : nullptr;
+  aria2_library_init();
+  for (const test_case& test : g_tests) {
+    if (filter && std::string(test.name).find(filter) == std::string::npos) {
+      continue;
+    }
+    int failures = g_failures;
+    test.run();
+    std::printf("%-40s %s\n", test.name,
+                g_failures == failures ? "ok" : "FAILED");
+  }
+  aria2_library_deinit();
+  return g_failures ? 1 : 0;
+}